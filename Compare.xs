@@ -4,6 +4,289 @@
 
 #include "ppport.h"
 #include "engine.h"
+#include "batch.h"
+#include "set.h"
+#include "cache.h"
+
+typedef RcCompiled *Regexp__Compare__Compiled;
+
+/* index with the Regexp::Compare::Compiled objects it refers to */
+typedef struct
+{
+    RcIndex *index;
+    AV *entries;
+} IndexObj;
+
+typedef IndexObj *Regexp__Compare__Index;
+
+/* set with the Regexp::Compare::Compiled objects it refers to (undef
+   for removed entries) */
+typedef struct
+{
+    RcSet *set;
+    AV *entries;
+} SetObj;
+
+typedef SetObj *Regexp__Compare__Set;
+
+#define RC_MAX_THREADS 1024
+
+#define MY_CXT_KEY "Regexp::Compare::_guts" XS_VERSION
+
+/* per-interpreter comparison context */
+typedef struct
+{
+    RcContext ctx;
+
+    /* see open_cache */
+    RcCache *cache;
+    UV cache_hits;
+    UV cache_misses;
+
+    /* see set_lru_size */
+    RcLru *lru;
+    UV lru_hits;
+    UV lru_misses;
+} my_cxt_t;
+
+/* cached results are valid just for the version (and engine revision)
+   which computed them */
+#define CACHE_SALT "Regexp::Compare " XS_VERSION " engine " \
+    STRINGIFY(RC_ENGINE_REVISION) " perl " STRINGIFY(PERL_REVISION) "." \
+    STRINGIFY(PERL_VERSION) "." STRINGIFY(PERL_SUBVERSION)
+
+START_MY_CXT
+
+/* Frees what the context of an interpreter holds when it's
+   destroyed. Registered by BOOT; cloned interpreters inherit the
+   registration (with their own context). */
+static void free_my_cxt(pTHX_ void *unused)
+{
+    dMY_CXT;
+
+    rc_context_free(&MY_CXT.ctx);
+    rc_cache_close(MY_CXT.cache);
+    MY_CXT.cache = 0;
+    rc_lru_free(MY_CXT.lru);
+    MY_CXT.lru = 0;
+}
+
+/* Compiled regexps for a batch call; elements which were passed in
+   as Regexp::Compare::Compiled objects aren't owned. */
+typedef struct
+{
+    RcCompiled **compiled;
+    char *owned;
+    int count;
+} Batch;
+
+static void free_batch(Batch *b)
+{
+    int i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+	if (b->owned[i])
+	{
+	    rc_compiled_free(b->compiled[i]);
+	}
+    }
+
+    Safefree(b->compiled);
+    Safefree(b->owned);
+    Safefree(b);
+}
+
+/* might croak; must be called inside ENTER/LEAVE, which frees the
+   returned batch */
+static Batch *load_batch(RcContext *ctx, AV *patterns)
+{
+    Batch *b;
+    SV **e;
+    int i, n;
+
+    n = av_len(patterns) + 1;
+
+    Newxz(b, 1, Batch);
+    Newxz(b->compiled, n ? n : 1, RcCompiled *);
+    Newxz(b->owned, n ? n : 1, char);
+    SAVEDESTRUCTOR(free_batch, b);
+
+    for (i = 0; i < n; ++i)
+    {
+	e = av_fetch(patterns, i, 0);
+	if (e && sv_isobject(*e) &&
+	    sv_derived_from(*e, "Regexp::Compare::Compiled"))
+	{
+	    b->compiled[i] = INT2PTR(RcCompiled *, SvIV(SvRV(*e)));
+	}
+	else
+	{
+	    b->compiled[i] = rc_compile(ctx, e ? *e : &PL_sv_undef);
+	    b->owned[i] = 1;
+	}
+
+	b->count = i + 1;
+    }
+
+    return b;
+}
+
+/* Returns a mortal reference to a Regexp::Compare::Compiled object -
+   either a copy of rs, if it already is one, or a newly compiled
+   regexp. */
+static SV *load_compiled(pTHX_ RcContext *ctx, SV *rs)
+{
+    SV *obj;
+
+    if (sv_isobject(rs) && sv_derived_from(rs, "Regexp::Compare::Compiled"))
+    {
+	return sv_mortalcopy(rs);
+    }
+
+    obj = sv_newmortal();
+    sv_setref_pv(obj, "Regexp::Compare::Compiled", rc_compile(ctx, rs));
+    return obj;
+}
+
+#define COMPILED_PTR(obj) INT2PTR(RcCompiled *, SvIV(SvRV(obj)))
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* hash of comparing rs1 with rs2 */
+static void cache_key(pTHX_ SV *rs1, SV *rs2, char key[16])
+{
+    SV *buf, *rs[2];
+    const char *s;
+    STRLEN len;
+    int i;
+
+    buf = sv_2mortal(newSVpvs(CACHE_SALT));
+    rs[0] = rs1;
+    rs[1] = rs2;
+    for (i = 0; i < 2; ++i)
+    {
+	s = SvPV(rs[i], len);
+	sv_catpvf(buf, "\n%c%" UVuf "\n", SvUTF8(rs[i]) ? 'u' : 'b', (UV)len);
+	sv_catpvn(buf, s, len);
+    }
+
+    rc_cache_hash(SvPVX(buf), SvCUR(buf), 0, key);
+}
+
+/* Sets ctx->limits from a hash of options (or to the defaults if opts
+   is null or undefined) and clears the error; croaks on invalid
+   options. Called by every comparing XSUB, so options don't leak into
+   the next call. */
+static void load_limits(RcContext *ctx, SV *opts)
+{
+    HV *hv;
+    SV **e;
+    IV v;
+
+    ctx->error = 0;
+    rc_default_limits(&ctx->limits);
+    if (!opts || !SvOK(opts))
+    {
+	return;
+    }
+
+    if (!SvROK(opts) || (SvTYPE(SvRV(opts)) != SVt_PVHV))
+    {
+	croak("Regexp::Compare: options must be a hash reference");
+    }
+
+    hv = (HV *)SvRV(opts);
+
+    e = hv_fetchs(hv, "max_depth", 0);
+    if (e && SvOK(*e))
+    {
+	v = SvIV(*e);
+	if ((v <= 0) || (v > INT_MAX))
+	{
+	    croak("Regexp::Compare: invalid max_depth");
+	}
+
+	ctx->limits.max_depth = (int)v;
+    }
+
+    e = hv_fetchs(hv, "max_steps", 0);
+    if (e && SvOK(*e))
+    {
+	v = SvIV(*e);
+	if ((v < 0) || (v > LONG_MAX))
+	{
+	    croak("Regexp::Compare: invalid max_steps");
+	}
+
+	ctx->limits.max_steps = (long)v;
+    }
+
+    e = hv_fetchs(hv, "deadline_ms", 0);
+    if (e && SvOK(*e))
+    {
+	if (SvNV(*e) < 0)
+	{
+	    croak("Regexp::Compare: invalid deadline_ms");
+	}
+
+	ctx->limits.deadline_ms = SvNV(*e);
+    }
+}
+
+/* "threads" option (already checked by load_limits to be a hash
+   reference, if defined) */
+static int get_threads(SV *opts)
+{
+    SV **e;
+    IV v;
+
+    if (!opts || !SvOK(opts))
+    {
+	return 1;
+    }
+
+    e = hv_fetchs((HV *)SvRV(opts), "threads", 0);
+    if (!e || !SvOK(*e))
+    {
+	return 1;
+    }
+
+    v = SvIV(*e);
+    if ((v < 0) || (v > RC_MAX_THREADS))
+    {
+	croak("Regexp::Compare: invalid threads");
+    }
+
+    return v ? (int)v : 1;
+}
+
+/* return value of a single comparison, undef if it's undecided */
+static SV *make_result(RcContext *ctx, int rv)
+{
+    if (rv == RC_UNDECIDED)
+    {
+	return newSV(0);
+    }
+
+    if (rv < 0)
+    {
+	if (!ctx->error)
+	{
+	    ctx->error = "???";
+	}
+
+	croak("Regexp::Compare: %s", ctx->error);
+    }
+
+    return newSViv(rv);
+}
 
 
 MODULE = Regexp::Compare		PACKAGE = Regexp::Compare
@@ -11,40 +294,676 @@ MODULE = Regexp::Compare		PACKAGE = Regexp::Compare
 PROTOTYPES: ENABLE
 
 BOOT:
-rc_init();
+{
+	MY_CXT_INIT;
+	rc_init();
+	rc_context_init(&MY_CXT.ctx);
+	MY_CXT.cache = 0;
+	MY_CXT.lru = 0;
+	call_atexit(free_my_cxt, 0);
+}
+
+void
+CLONE(...)
+        CODE:
+        {
+	size_t dfa_cache_size;
+
+	MY_CXT_CLONE;
+
+	/* the copied state belongs to the parent */
+	dfa_cache_size = MY_CXT.ctx.dfa_cache_size;
+	rc_context_init(&MY_CXT.ctx);
+	MY_CXT.ctx.dfa_cache_size = dfa_cache_size;
+	MY_CXT.cache = 0;
+	if (MY_CXT.lru)
+	{
+		MY_CXT.lru = rc_lru_new(rc_lru_capacity(MY_CXT.lru));
+	}
+        }
 
 SV *
-_is_less_or_equal(rs1, rs2)
+_is_less_or_equal(rs1, rs2, opts = 0)
         SV *rs1;
         SV *rs2;
+        SV *opts;
         CODE:
         {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
 	REGEXP *r1 = 0, *r2 = 0;
+	char key[16];
+	int rv;
+
+	load_limits(ctx, opts);
+
+	rv = -1;
+	if (MY_CXT.lru || MY_CXT.cache)
+	{
+		cache_key(aTHX_ rs1, rs2, key);
+	}
+
+	if (MY_CXT.lru)
+	{
+		rv = rc_lru_lookup(MY_CXT.lru, key);
+		if (rv < 0)
+		{
+			++MY_CXT.lru_misses;
+		}
+		else
+		{
+			++MY_CXT.lru_hits;
+		}
+	}
+
+	if ((rv < 0) && MY_CXT.cache)
+	{
+		rv = rc_cache_lookup(MY_CXT.cache, key);
+		if (rv < 0)
+		{
+			++MY_CXT.cache_misses;
+		}
+		else
+		{
+			++MY_CXT.cache_hits;
+			if (MY_CXT.lru)
+			{
+				rc_lru_store(MY_CXT.lru, key, rv);
+			}
+		}
+	}
+
+	if (rv < 0)
+	{
+		ENTER;
+
+		r1 = rc_regcomp(rs1);
+		SAVEDESTRUCTOR(rc_regfree, r1);
+
+		r2 = rc_regcomp(rs2);
+		SAVEDESTRUCTOR(rc_regfree, r2);
+
+		rv = rc_compare(ctx, r1, r2);
+
+		LEAVE;
+
+		if (MY_CXT.lru)
+		{
+			rc_lru_store(MY_CXT.lru, key, rv);
+		}
+
+		if (MY_CXT.cache)
+		{
+			rc_cache_store(MY_CXT.cache, key, rv);
+		}
+	}
+
+        RETVAL = make_result(ctx, rv);
+        }
+        OUTPUT:
+        RETVAL
+
+SV *
+is_less_or_equal_compiled(c1, c2, opts = 0)
+        Regexp::Compare::Compiled c1;
+        Regexp::Compare::Compiled c2;
+        SV *opts;
+        CODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
 	int rv;
 
+	load_limits(ctx, opts);
+	rv = rc_compare_compiled(ctx, c1, c2);
+        RETVAL = make_result(ctx, rv);
+        }
+        OUTPUT:
+        RETVAL
+
+SV *
+_subsumption_matrix(patterns, opts = 0)
+        AV *patterns;
+        SV *opts;
+        CODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	Batch *b;
+	STRLEN sz;
+	int rv, threads;
+
+	load_limits(ctx, opts);
+	threads = get_threads(opts);
+
 	ENTER;
 
-	r1 = rc_regcomp(rs1);
-	SAVEDESTRUCTOR(rc_regfree, r1);
+	b = load_batch(ctx, patterns);
 
-	r2 = rc_regcomp(rs2);
-	SAVEDESTRUCTOR(rc_regfree, r2);
+	sz = ((STRLEN)b->count * b->count + 7) / 8;
+	RETVAL = newSV(sz + 1);
+	SAVEFREESV(RETVAL);
+	SvPOK_only(RETVAL);
+	Zero(SvPVX(RETVAL), sz + 1, char);
+	SvCUR_set(RETVAL, sz);
 
-	rv = rc_compare(r1, r2);
+	rv = rc_matrix(ctx, b->compiled, b->count,
+		(unsigned char *)SvPVX(RETVAL), threads);
+	if (rv < 0)
+	{
+		if (!ctx->error)
+		{
+			ctx->error = "???";
+		}
+
+		croak("Regexp::Compare: %s", ctx->error);
+	}
+
+	SvREFCNT_inc_simple_void_NN(RETVAL);
 
 	LEAVE;
+        }
+        OUTPUT:
+        RETVAL
+
+void
+_minimize_blacklist(patterns, stats, opts = 0)
+        AV *patterns;
+        SV *stats;
+        SV *opts;
+        PPCODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	Batch *b;
+	RcMinimizeStats st;
+	char *keep;
+	int i, rv;
+
+	load_limits(ctx, opts);
 
+	ENTER;
+
+	b = load_batch(ctx, patterns);
+
+	Newxz(keep, b->count ? b->count : 1, char);
+	SAVEFREEPV(keep);
+
+	rv = rc_minimize(ctx, b->compiled, b->count, keep, &st);
 	if (rv < 0)
 	{
-		if (!rc_error)
+		if (!ctx->error)
 		{
-			rc_error = "???";
+			ctx->error = "???";
 		}
 
-		croak("Regexp::Compare: %s", rc_error);
+		croak("Regexp::Compare: %s", ctx->error);
+	}
+
+	if (SvROK(stats) && (SvTYPE(SvRV(stats)) == SVt_PVHV))
+	{
+		HV *hv = (HV *)SvRV(stats);
+
+		hv_stores(hv, "comparisons", newSVuv(st.comparisons));
+		hv_stores(hv, "saved", newSVuv(st.saved));
+		hv_stores(hv, "duplicates", newSVuv(st.duplicates));
 	}
 
-        RETVAL = newSViv(rv);
+	for (i = 0; i < b->count; ++i)
+	{
+		if (keep[i])
+		{
+			mXPUSHi(i);
+		}
+	}
+
+	LEAVE;
+        }
+
+SV *
+stats()
+        CODE:
+        {
+	dMY_CXT;
+	RcStats *st = &MY_CXT.ctx.stats;
+	HV *hv = newHV();
+
+	hv_stores(hv, "comparisons", newSVuv(st->comparisons));
+	hv_stores(hv, "steps", newSVuv(st->steps));
+	hv_stores(hv, "memo_hits", newSVuv(st->memo_hits));
+	hv_stores(hv, "class_hits", newSVuv(st->class_hits));
+	hv_stores(hv, "undecided", newSVuv(st->undecided));
+	hv_stores(hv, "prefiltered", newSVuv(st->prefiltered));
+	hv_stores(hv, "automaton", newSVuv(st->automaton));
+	hv_stores(hv, "dfa_flushes", newSVuv(st->dfa_flushes));
+	hv_stores(hv, "cache_hits", newSVuv(MY_CXT.cache_hits));
+	hv_stores(hv, "cache_misses", newSVuv(MY_CXT.cache_misses));
+	hv_stores(hv, "lru_hits", newSVuv(MY_CXT.lru_hits));
+	hv_stores(hv, "lru_misses", newSVuv(MY_CXT.lru_misses));
+	hv_stores(hv, "lru_hit_rate", (MY_CXT.lru_hits + MY_CXT.lru_misses) ?
+		newSVnv((NV)MY_CXT.lru_hits /
+			(MY_CXT.lru_hits + MY_CXT.lru_misses)) :
+		newSV(0));
+        RETVAL = newRV_noinc((SV *)hv);
         }
         OUTPUT:
         RETVAL
+
+void
+open_cache(path, opts = 0)
+        char *path;
+        SV *opts;
+        CODE:
+        {
+	dMY_CXT;
+	RcCache *cache;
+	SV **e;
+	char *error;
+	long slots = 0;
+	int read_only = 0;
+
+	if (opts && SvOK(opts))
+	{
+		if (!SvROK(opts) || (SvTYPE(SvRV(opts)) != SVt_PVHV))
+		{
+			croak("Regexp::Compare: options must be a hash reference");
+		}
+
+		e = hv_fetchs((HV *)SvRV(opts), "slots", 0);
+		if (e && SvOK(*e))
+		{
+			if ((SvIV(*e) <= 0) || (SvIV(*e) > LONG_MAX / 32))
+			{
+				croak("Regexp::Compare: invalid slots");
+			}
+
+			slots = (long)SvIV(*e);
+		}
+
+		e = hv_fetchs((HV *)SvRV(opts), "read_only", 0);
+		read_only = e && SvTRUE(*e);
+	}
+
+	cache = rc_cache_open(path, slots, read_only, &error);
+	if (!cache)
+	{
+		croak("Regexp::Compare: %s", error);
+	}
+
+	rc_cache_close(MY_CXT.cache);
+	MY_CXT.cache = cache;
+        }
+
+void
+set_lru_size(size)
+        IV size;
+        CODE:
+        {
+	dMY_CXT;
+	RcLru *lru = 0;
+
+	if ((size < 0) || (size > INT_MAX / 2))
+	{
+		croak("Regexp::Compare: invalid LRU size");
+	}
+
+	if (size)
+	{
+		lru = rc_lru_new((int)size);
+		if (!lru)
+		{
+			croak("Regexp::Compare: Couldn't allocate memory for LRU");
+		}
+	}
+
+	rc_lru_free(MY_CXT.lru);
+	MY_CXT.lru = lru;
+        }
+
+void
+set_dfa_cache_size(size)
+        IV size;
+        CODE:
+        {
+	dMY_CXT;
+
+	if (size < 0)
+	{
+		croak("Regexp::Compare: invalid automaton cache size");
+	}
+
+	MY_CXT.ctx.dfa_cache_size = (size_t)size;
+        }
+
+void
+close_cache()
+        CODE:
+        {
+	dMY_CXT;
+
+	rc_cache_close(MY_CXT.cache);
+	MY_CXT.cache = 0;
+        }
+
+MODULE = Regexp::Compare		PACKAGE = Regexp::Compare::Compiled
+
+Regexp::Compare::Compiled
+_compile(rs)
+        SV *rs;
+        CODE:
+        {
+	dMY_CXT;
+
+        RETVAL = rc_compile(&MY_CXT.ctx, rs);
+        }
+        OUTPUT:
+        RETVAL
+
+UV
+structural_hash(c)
+        Regexp::Compare::Compiled c;
+        CODE:
+        {
+	dMY_CXT;
+
+        RETVAL = rc_structural_hash(&MY_CXT.ctx, c);
+        }
+        OUTPUT:
+        RETVAL
+
+void
+DESTROY(c)
+        Regexp::Compare::Compiled c;
+        CODE:
+        rc_compiled_free(c);
+
+MODULE = Regexp::Compare		PACKAGE = Regexp::Compare::Index
+
+Regexp::Compare::Index
+_new()
+        CODE:
+        {
+	Newxz(RETVAL, 1, IndexObj);
+	RETVAL->index = rc_index_new();
+	if (!RETVAL->index)
+	{
+		Safefree(RETVAL);
+		croak("Regexp::Compare: Couldn't allocate memory for index");
+	}
+
+	RETVAL->entries = newAV();
+        }
+        OUTPUT:
+        RETVAL
+
+int
+_add(ix, rs)
+        Regexp::Compare::Index ix;
+        SV *rs;
+        CODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	SV *obj;
+
+	ctx->error = 0;
+	obj = load_compiled(aTHX_ ctx, rs);
+	RETVAL = rc_index_add(ctx, ix->index, COMPILED_PTR(obj));
+	if (RETVAL < 0)
+	{
+		croak("Regexp::Compare: %s", ctx->error ? ctx->error : "???");
+	}
+
+	av_push(ix->entries, SvREFCNT_inc_simple_NN(obj));
+        }
+        OUTPUT:
+        RETVAL
+
+int
+size(ix)
+        Regexp::Compare::Index ix;
+        CODE:
+        RETVAL = rc_index_size(ix->index);
+        OUTPUT:
+        RETVAL
+
+SV *
+entry(ix, id)
+        Regexp::Compare::Index ix;
+        int id;
+        CODE:
+        {
+	/* av_fetch counts negative ids from the end */
+	SV **e = (id >= 0) ? av_fetch(ix->entries, id, 0) : 0;
+
+        RETVAL = e ? newSVsv(*e) : newSV(0);
+        }
+        OUTPUT:
+        RETVAL
+
+void
+_candidates(ix, rs, supersets, opts = 0)
+        Regexp::Compare::Index ix;
+        SV *rs;
+        int supersets;
+        SV *opts;
+        PPCODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	RcCompiled *c;
+	int *ids;
+	int i, n;
+
+	load_limits(ctx, opts);
+
+	ENTER;
+
+	c = COMPILED_PTR(load_compiled(aTHX_ ctx, rs));
+
+	n = rc_index_size(ix->index);
+	Newx(ids, n ? n : 1, int);
+	SAVEFREEPV(ids);
+
+	n = supersets ? rc_index_supersets(ctx, ix->index, c, ids) :
+		rc_index_candidates(ctx, ix->index, c, ids);
+	if (n < 0)
+	{
+		croak("Regexp::Compare: %s", ctx->error ? ctx->error : "???");
+	}
+
+	EXTEND(SP, n);
+	for (i = 0; i < n; ++i)
+	{
+		mPUSHi(ids[i]);
+	}
+
+	LEAVE;
+        }
+
+void
+DESTROY(ix)
+        Regexp::Compare::Index ix;
+        CODE:
+        {
+	rc_index_free(ix->index);
+	SvREFCNT_dec((SV *)ix->entries);
+	Safefree(ix);
+        }
+
+MODULE = Regexp::Compare		PACKAGE = Regexp::Compare::Set
+
+Regexp::Compare::Set
+_new()
+        CODE:
+        {
+	Newxz(RETVAL, 1, SetObj);
+	RETVAL->set = rc_set_new();
+	if (!RETVAL->set)
+	{
+		Safefree(RETVAL);
+		croak("Regexp::Compare: Couldn't allocate memory for set");
+	}
+
+	RETVAL->entries = newAV();
+        }
+        OUTPUT:
+        RETVAL
+
+void
+_add(s, rs, opts = 0)
+        Regexp::Compare::Set s;
+        SV *rs;
+        SV *opts;
+        PPCODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	SV *obj;
+	AV *redundant;
+	int *ids;
+	int i, id, n;
+
+	load_limits(ctx, opts);
+
+	ENTER;
+
+	obj = load_compiled(aTHX_ ctx, rs);
+
+	Newx(ids, rc_set_size(s->set) + 1, int);
+	SAVEFREEPV(ids);
+
+	id = rc_set_add(ctx, s->set, COMPILED_PTR(obj), ids, &n);
+	if (id < 0)
+	{
+		croak("Regexp::Compare: %s", ctx->error ? ctx->error : "???");
+	}
+
+	av_store(s->entries, id, SvREFCNT_inc_simple_NN(obj));
+
+	redundant = newAV();
+	for (i = 0; i < n; ++i)
+	{
+		av_push(redundant, newSViv(ids[i]));
+	}
+
+	EXTEND(SP, 2);
+	mPUSHi(id);
+	mPUSHs(newRV_noinc((SV *)redundant));
+
+	LEAVE;
+        }
+
+SV *
+remove(s, id)
+        Regexp::Compare::Set s;
+        int id;
+        CODE:
+        {
+	dMY_CXT;
+	RcContext *ctx = &MY_CXT.ctx;
+	AV *released;
+	int *ids;
+	int i, n;
+
+	ctx->error = 0;
+
+	ENTER;
+
+	Newx(ids, rc_set_size(s->set) + 1, int);
+	SAVEFREEPV(ids);
+
+	if (rc_set_remove(ctx, s->set, id, ids, &n) < 0)
+	{
+		croak("Regexp::Compare: %s", ctx->error ? ctx->error : "???");
+	}
+
+	av_delete(s->entries, id, G_DISCARD);
+
+	released = newAV();
+	for (i = 0; i < n; ++i)
+	{
+		av_push(released, newSViv(ids[i]));
+	}
+
+	LEAVE;
+
+        RETVAL = newRV_noinc((SV *)released);
+        }
+        OUTPUT:
+        RETVAL
+
+SV *
+entry(s, id)
+        Regexp::Compare::Set s;
+        int id;
+        CODE:
+        {
+	/* av_fetch counts negative ids from the end */
+	SV **e = (id >= 0) ? av_fetch(s->entries, id, 0) : 0;
+
+        RETVAL = (e && SvOK(*e)) ? newSVsv(*e) : newSV(0);
+        }
+        OUTPUT:
+        RETVAL
+
+void
+ids(s)
+        Regexp::Compare::Set s;
+        ALIAS:
+        maximal = 1
+        PPCODE:
+        {
+	const int *up;
+	int i, n;
+
+	n = rc_set_size(s->set);
+	for (i = 0; i < n; ++i)
+	{
+		if (rc_set_entry(s->set, i) &&
+		    (!ix || !rc_set_covers(s->set, i, 1, &up)))
+		{
+			mXPUSHi(i);
+		}
+	}
+        }
+
+void
+upper(s, id)
+        Regexp::Compare::Set s;
+        int id;
+        ALIAS:
+        lower = 1
+        PPCODE:
+        {
+	const int *v;
+	int *sorted;
+	int i, n;
+
+	n = rc_set_covers(s->set, id, !ix, &v);
+
+	ENTER;
+
+	Newx(sorted, n ? n : 1, int);
+	SAVEFREEPV(sorted);
+	Copy(v, sorted, n, int);
+	qsort(sorted, n, sizeof(int), compare_int);
+
+	EXTEND(SP, n);
+	for (i = 0; i < n; ++i)
+	{
+		mPUSHi(sorted[i]);
+	}
+
+	LEAVE;
+        }
+
+void
+DESTROY(s)
+        Regexp::Compare::Set s;
+        CODE:
+        {
+	rc_set_free(s->set);
+	SvREFCNT_dec((SV *)s->entries);
+	Safefree(s);
+        }
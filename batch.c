@@ -0,0 +1,627 @@
+#include "batch.h"
+#include <stdlib.h>
+#ifdef I_PTHREAD
+#include <pthread.h>
+#endif
+
+#define SET_BIT(bits, k) ((bits)[(k) / 8] |= 1 << ((k) % 8))
+
+/* Undecided comparisons (over ctx->limits) count as not less or
+   equal - that just keeps more regexps. */
+static int compare_pair(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    int rv;
+
+    rv = rc_compare_compiled(ctx, c1, c2);
+    return (rv == RC_UNDECIDED) ? 0 : rv;
+}
+
+static int matrix_serial(RcContext *ctx, RcCompiled **v, int n,
+    unsigned char *bits)
+{
+    int i, j, rv;
+
+    for (i = 0; i < n; ++i)
+    {
+	for (j = 0; j < n; ++j)
+	{
+	    if (i == j)
+	    {
+		continue;
+	    }
+
+	    rv = compare_pair(ctx, v[i], v[j]);
+	    if (rv < 0)
+	    {
+		return rv;
+	    }
+
+	    if (rv)
+	    {
+		SET_BIT(bits, (size_t)i * n + j);
+	    }
+	}
+    }
+
+    return 0;
+}
+
+#ifdef I_PTHREAD
+
+/* Tiles [head, tail) waiting for a worker. The owner takes tiles from
+   the head, other workers steal from the tail. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} TileQueue;
+
+/* The n x n matrix is split into side x side square tiles of (at
+   most) tile x tile pairs; tile t covers rows starting at
+   (t / side) * tile and columns starting at (t % side) * tile. */
+typedef struct
+{
+    RcCompiled **v;
+    int n;
+    unsigned char *bits;
+    int tile;
+    int side;
+    int workers;
+    TileQueue *queues;
+
+    /* protects bits, failed & error */
+    pthread_mutex_t lock;
+    volatile int failed;
+    char *error;
+} Pool;
+
+typedef struct
+{
+    Pool *pool;
+    int id;
+    RcContext *ctx;
+    pthread_t thread;
+
+    /* pairs (as i * n + j) which needed the interpreter (see
+       RcContext.no_perl), compared by the calling thread after the
+       others finish */
+    size_t *deferred;
+    int ndeferred;
+    int adeferred;
+} Worker;
+
+/* stack of a worker thread, per level of RcLimits.max_depth */
+#define WORKER_STACK_PER_DEPTH 2048
+
+#define WORKER_STACK_MIN (256 * 1024)
+
+/* worker stack sizes are rounded up to a multiple of this */
+#define WORKER_STACK_ALIGN (64 * 1024)
+
+/* returns next tile for worker id, -1 when all tiles are taken */
+static int take_tile(Pool *pool, int id)
+{
+    TileQueue *own, *victim;
+    int i, t, rem, half;
+
+    own = pool->queues + id;
+    pthread_mutex_lock(&own->lock);
+    t = (own->head < own->tail) ? own->head++ : -1;
+    pthread_mutex_unlock(&own->lock);
+    if (t >= 0)
+    {
+	return t;
+    }
+
+    /* steals half of the first non-empty queue */
+    for (i = 1; i < pool->workers; ++i)
+    {
+	victim = pool->queues + (id + i) % pool->workers;
+	pthread_mutex_lock(&victim->lock);
+	rem = victim->tail - victim->head;
+	if (rem <= 0)
+	{
+	    pthread_mutex_unlock(&victim->lock);
+	    continue;
+	}
+
+	half = (rem + 1) / 2;
+	victim->tail -= half;
+	t = victim->tail;
+	pthread_mutex_unlock(&victim->lock);
+
+	pthread_mutex_lock(&own->lock);
+	own->head = t + 1;
+	own->tail = t + half;
+	pthread_mutex_unlock(&own->lock);
+	return t;
+    }
+
+    return -1;
+}
+
+/* returns 0, -1 (with w->ctx->error set) on failed allocation */
+static int defer_pair(Worker *w, size_t k)
+{
+    size_t *nd;
+    int na;
+
+    if (w->ndeferred == w->adeferred)
+    {
+	na = w->adeferred ? 2 * w->adeferred : 16;
+	nd = (size_t *)realloc(w->deferred, na * sizeof(size_t));
+	if (!nd)
+	{
+	    w->ctx->error = "Could not allocate memory for deferred pairs";
+	    return -1;
+	}
+
+	w->deferred = nd;
+	w->adeferred = na;
+    }
+
+    w->deferred[w->ndeferred++] = k;
+    return 0;
+}
+
+static void compare_tile(Worker *w, int t)
+{
+    Pool *pool;
+    int i, j, i_end, j_start, j_end, rv;
+
+    pool = w->pool;
+    i = (t / pool->side) * pool->tile;
+    i_end = (i + pool->tile < pool->n) ? i + pool->tile : pool->n;
+    j_start = (t % pool->side) * pool->tile;
+    j_end = (j_start + pool->tile < pool->n) ? j_start + pool->tile :
+	pool->n;
+
+    for (; i < i_end; ++i)
+    {
+	for (j = j_start; j < j_end; ++j)
+	{
+	    if (pool->failed)
+	    {
+		return;
+	    }
+
+	    if (i == j)
+	    {
+		continue;
+	    }
+
+	    rv = compare_pair(w->ctx, pool->v[i], pool->v[j]);
+	    if ((rv < 0) && (w->ctx->error == rc_perl_needed))
+	    {
+		rv = defer_pair(w, (size_t)i * pool->n + j);
+		if (!rv)
+		{
+		    continue;
+		}
+	    }
+
+	    if (rv < 0)
+	    {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->failed)
+		{
+		    pool->failed = 1;
+		    pool->error = w->ctx->error;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	    }
+
+	    if (rv)
+	    {
+		/* neighbouring tiles can share a byte */
+		pthread_mutex_lock(&pool->lock);
+		SET_BIT(pool->bits, (size_t)i * pool->n + j);
+		pthread_mutex_unlock(&pool->lock);
+	    }
+	}
+    }
+}
+
+static void *run_worker(void *arg)
+{
+    Worker *w;
+    int t;
+
+    w = (Worker *)arg;
+
+    /* other threads than the calling one have no interpreter - see
+       RcContext.no_perl */
+    while ((t = take_tile(w->pool, w->id)) >= 0)
+    {
+	compare_tile(w, t);
+    }
+
+    return 0;
+}
+
+static int matrix_parallel(RcContext *ctx, RcCompiled **v, int n,
+    unsigned char *bits, int threads)
+{
+    Pool pool;
+    Worker *workers;
+    RcContext *contexts;
+    pthread_attr_t attr;
+    size_t stack, need;
+    int i, k, started, tiles, rv;
+
+    /* comparisons recurse up to max_depth levels; without a stack
+       that deep, the pairs are compared serially */
+    if ((size_t)ctx->limits.max_depth > ((size_t)-1 - WORKER_STACK_MIN -
+	WORKER_STACK_ALIGN) / WORKER_STACK_PER_DEPTH)
+    {
+	return matrix_serial(ctx, v, n, bits);
+    }
+
+    need = WORKER_STACK_MIN +
+	(size_t)ctx->limits.max_depth * WORKER_STACK_PER_DEPTH;
+    need = (need + WORKER_STACK_ALIGN - 1) / WORKER_STACK_ALIGN *
+	WORKER_STACK_ALIGN;
+    if (pthread_attr_init(&attr))
+    {
+	return matrix_serial(ctx, v, n, bits);
+    }
+
+    if ((pthread_attr_getstacksize(&attr, &stack) || (stack < need)) &&
+	pthread_attr_setstacksize(&attr, need))
+    {
+	pthread_attr_destroy(&attr);
+	return matrix_serial(ctx, v, n, bits);
+    }
+
+    /* a few tiles per worker in each dimension, so that there's
+       something left to steal from workers stuck on slow pairs */
+    pool.side = (n < 4 * threads) ? n : 4 * threads;
+    pool.tile = (n + pool.side - 1) / pool.side;
+    pool.side = (n + pool.tile - 1) / pool.tile;
+    tiles = pool.side * pool.side;
+    if (threads > tiles)
+    {
+	threads = tiles;
+    }
+
+    pool.v = v;
+    pool.n = n;
+    pool.bits = bits;
+    pool.workers = threads;
+    pool.failed = 0;
+    pool.error = 0;
+
+    workers = (Worker *)calloc(threads, sizeof(Worker));
+    contexts = (RcContext *)calloc(threads, sizeof(RcContext));
+    pool.queues = (TileQueue *)calloc(threads, sizeof(TileQueue));
+    if (!workers || !contexts || !pool.queues)
+    {
+	free(workers);
+	free(contexts);
+	free(pool.queues);
+	pthread_attr_destroy(&attr);
+	return matrix_serial(ctx, v, n, bits);
+    }
+
+    pthread_mutex_init(&pool.lock, 0);
+    for (i = 0; i < threads; ++i)
+    {
+	pthread_mutex_init(&pool.queues[i].lock, 0);
+	pool.queues[i].head = (int)((double)tiles * i / threads);
+	pool.queues[i].tail = (int)((double)tiles * (i + 1) / threads);
+
+	workers[i].pool = &pool;
+	workers[i].id = i;
+	if (i)
+	{
+	    rc_context_init(contexts + i);
+	    contexts[i].limits = ctx->limits;
+
+	    /* the compiled regexps are shared */
+	    contexts[i].dfa_cache_size = 0;
+	    contexts[i].no_perl = 1;
+	    workers[i].ctx = contexts + i;
+	}
+	else
+	{
+	    workers[i].ctx = ctx;
+	}
+    }
+
+    /* worker 0 is the calling thread; if some threads can't be
+       started, the others steal their tiles */
+    started = 1;
+    for (i = 1; i < threads; ++i)
+    {
+	if (!pthread_create(&workers[i].thread, &attr, run_worker,
+		workers + i))
+	{
+	    started = i + 1;
+	}
+	else
+	{
+	    break;
+	}
+    }
+
+    run_worker(workers);
+
+    for (i = 1; i < started; ++i)
+    {
+	pthread_join(workers[i].thread, 0);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    /* the calling thread may use the interpreter */
+    for (i = 1; (i < threads) && !pool.failed; ++i)
+    {
+	for (k = 0; k < workers[i].ndeferred; ++k)
+	{
+	    rv = compare_pair(ctx, v[workers[i].deferred[k] / n],
+		v[workers[i].deferred[k] % n]);
+	    if (rv < 0)
+	    {
+		pool.failed = 1;
+		pool.error = ctx->error;
+		break;
+	    }
+
+	    if (rv)
+	    {
+		SET_BIT(bits, workers[i].deferred[k]);
+	    }
+	}
+    }
+
+    for (i = 1; i < threads; ++i)
+    {
+	free(workers[i].deferred);
+	rc_stats_add(&ctx->stats, &contexts[i].stats);
+	rc_context_free(contexts + i);
+	pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+
+    pthread_mutex_destroy(&pool.queues[0].lock);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(contexts);
+    free(pool.queues);
+
+    if (pool.failed)
+    {
+	ctx->error = pool.error;
+	return -1;
+    }
+
+    return 0;
+}
+
+#endif
+
+int rc_matrix(RcContext *ctx, RcCompiled **v, int n, unsigned char *bits,
+    int threads)
+{
+#ifdef I_PTHREAD
+    if ((threads > 1) && (n > 1))
+    {
+	return matrix_parallel(ctx, v, n, bits, threads);
+    }
+#endif
+
+    return matrix_serial(ctx, v, n, bits);
+}
+
+typedef struct
+{
+    UV hash;
+    int index;
+} HashedIndex;
+
+static int cmp_hashed_index(const void *p1, const void *p2)
+{
+    const HashedIndex *h1 = (const HashedIndex *)p1;
+    const HashedIndex *h2 = (const HashedIndex *)p2;
+
+    if (h1->hash != h2->hash)
+    {
+	return (h1->hash < h2->hash) ? -1 : 1;
+    }
+
+    return h1->index - h2->index;
+}
+
+/* Returns 1 when regexps a & b, having equal structural hashes, are
+   really equal (rather than colliding), 0 when they aren't (or it
+   can't be decided), -1 on error; comparisons made are added to
+   *comparisons. */
+static int confirm_duplicate(RcContext *ctx, RcCompiled *a, RcCompiled *b,
+    UV *comparisons)
+{
+    int rv;
+
+    if (!a->program || !b->program)
+    {
+	/* can't be compared - equal only to the same source */
+	return !a->program && !b->program && (a->forced == b->forced) &&
+	    (!RX_UTF8(a->rx) == !RX_UTF8(b->rx)) &&
+	    (RX_PRELEN(a->rx) == RX_PRELEN(b->rx)) &&
+	    !memcmp(RX_PRECOMP(a->rx), RX_PRECOMP(b->rx), RX_PRELEN(a->rx));
+    }
+
+    ++*comparisons;
+    rv = compare_pair(ctx, a, b);
+    if (rv == 1)
+    {
+	++*comparisons;
+	rv = compare_pair(ctx, b, a);
+    }
+
+    return rv;
+}
+
+/* Sets dup[i] for regexps equal to an earlier one; returns their
+   count, -1 on error. The structural hash just groups candidates,
+   which are compared (adding to *comparisons). */
+static int find_duplicates(RcContext *ctx, RcCompiled **v, int n,
+    char *dup, UV *comparisons)
+{
+    HashedIndex *hi;
+    int i, j, start, count, rv;
+
+    hi = (HashedIndex *)malloc(sizeof(HashedIndex) * (n ? n : 1));
+    if (!hi)
+    {
+	ctx->error = "Could not allocate memory for minimization";
+	return -1;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+	hi[i].hash = rc_structural_hash(ctx, v[i]);
+	hi[i].index = i;
+    }
+
+    qsort(hi, n, sizeof(HashedIndex), cmp_hashed_index);
+
+    count = 0;
+    start = 0;
+    for (i = 1; i < n; ++i)
+    {
+	if (hi[i].hash != hi[start].hash)
+	{
+	    start = i;
+	    continue;
+	}
+
+	for (j = start; j < i; ++j)
+	{
+	    if (dup[hi[j].index])
+	    {
+		continue;
+	    }
+
+	    rv = confirm_duplicate(ctx, v[hi[j].index], v[hi[i].index],
+		comparisons);
+	    if (rv < 0)
+	    {
+		free(hi);
+		return -1;
+	    }
+
+	    if (rv)
+	    {
+		dup[hi[i].index] = 1;
+		++count;
+		break;
+	    }
+	}
+    }
+
+    free(hi);
+    return count;
+}
+
+int rc_minimize(RcContext *ctx, RcCompiled **v, int n, char *keep,
+    RcMinimizeStats *stats)
+{
+    int *maximal;
+    char *dup;
+    int i, j, k, m, rv, dominated, duplicates;
+    UV comparisons;
+
+    maximal = (int *)malloc(sizeof(int) * (n ? n : 1));
+    dup = (char *)calloc(n ? n : 1, sizeof(char));
+    if (!maximal || !dup)
+    {
+	free(maximal);
+	free(dup);
+	ctx->error = "Could not allocate memory for minimization";
+	return -1;
+    }
+
+    comparisons = 0;
+    duplicates = find_duplicates(ctx, v, n, dup, &comparisons);
+    if (duplicates < 0)
+    {
+	free(maximal);
+	free(dup);
+	return -1;
+    }
+
+    m = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (dup[i])
+	{
+	    keep[i] = 0;
+	    continue;
+	}
+
+	dominated = 0;
+	for (j = 0; (j < m) && !dominated; ++j)
+	{
+	    ++comparisons;
+	    rv = compare_pair(ctx, v[i], v[maximal[j]]);
+	    if (rv < 0)
+	    {
+		free(maximal);
+		free(dup);
+		return rv;
+	    }
+
+	    dominated = rv;
+	}
+
+	if (dominated)
+	{
+	    keep[i] = 0;
+	    continue;
+	}
+
+	/* the new element may dominate some of the current maximal
+	   ones, which then drop out of the list */
+	k = 0;
+	for (j = 0; j < m; ++j)
+	{
+	    ++comparisons;
+	    rv = compare_pair(ctx, v[maximal[j]], v[i]);
+	    if (rv < 0)
+	    {
+		free(maximal);
+		free(dup);
+		return rv;
+	    }
+
+	    if (rv)
+	    {
+		keep[maximal[j]] = 0;
+	    }
+	    else
+	    {
+		maximal[k++] = maximal[j];
+	    }
+	}
+
+	m = k;
+	maximal[m++] = i;
+	keep[i] = 1;
+    }
+
+    free(maximal);
+    free(dup);
+
+    if (stats)
+    {
+	stats->comparisons = comparisons;
+	/* confirming duplicates may (in theory) compare a pair twice */
+	stats->saved = ((UV)n * (n ? n - 1 : 0) > comparisons) ?
+	    (UV)n * (n ? n - 1 : 0) - comparisons : 0;
+	stats->duplicates = duplicates;
+    }
+
+    return 0;
+}
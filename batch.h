@@ -0,0 +1,47 @@
+#ifndef batch_h
+#define batch_h
+
+#include "engine.h"
+
+/* Compares all ordered pairs of n compiled regexps. Bit i * n + j of
+   bits (least significant bit first, like Perl's vec) is set when
+   v[i] <= v[j]; the diagonal isn't computed. bits must hold n * n
+   bits (which may need size_t) and be zeroed by the caller. With
+   threads > 1 (and pthreads available), the pairs are compared by
+   that many threads (including the calling one) with their own
+   contexts, whose stats are added to ctx; the regexps must be
+   compiled beforehand and aren't modified. Only the calling thread
+   calls into the Perl interpreter - pairs other threads can't
+   compare without it are compared by the calling one at the end.
+   Returns 0 on success, -1 on error (with ctx->error set). */
+int rc_matrix(RcContext *ctx, RcCompiled **v, int n, unsigned char *bits,
+    int threads);
+
+typedef struct
+{
+    /* calls of rc_compare_compiled */
+    UV comparisons;
+
+    /* n * (n - 1) - comparisons, i.e. how many calls a comparison of
+       all pairs would need on top of the ones actually made */
+    UV saved;
+
+    /* regexps dropped (before comparisons with the rest) as equal to
+       an earlier one with the same structural hash - see
+       rc_structural_hash */
+    UV duplicates;
+} RcMinimizeStats;
+
+/* Finds maximal elements of n compiled regexps (ordered by
+   rc_compare_compiled), setting keep[i] to 1 for those which aren't
+   matched by any other regexp and to 0 for the rest. Of equivalent
+   regexps, the first one is kept. Dominated regexps are never
+   compared again - by transitivity, whatever they dominate is
+   dominated by the regexp which dominates them; regexps with the
+   same structural hash as an earlier one are just compared with it
+   (both ways). stats may be null. Returns 0 on success, -1 on error
+   (with ctx->error set). */
+int rc_minimize(RcContext *ctx, RcCompiled **v, int n, char *keep,
+    RcMinimizeStats *stats);
+
+#endif
@@ -0,0 +1,635 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAS_MMAP) && defined(HAS_QUAD) && defined(HAS_FLOCK) && \
+    defined(__GNUC__)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define RC_HAS_CACHE
+#endif
+
+#define CACHE_MAGIC "RcCache"
+#define CACHE_BYTEORDER 0x01020304
+
+/* slots tried after the home slot */
+#define MAX_PROBE 8
+
+#ifdef HAS_QUAD
+
+typedef U64TYPE Word;
+
+#define ROTATE64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static Word fmix64(Word k)
+{
+    k ^= k >> 33;
+    k *= (Word)0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= (Word)0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* little-endian load, so the hash doesn't depend on alignment */
+static Word get_word(const unsigned char *p)
+{
+    Word w;
+    int i;
+
+    w = 0;
+    for (i = 7; i >= 0; --i)
+    {
+	w = (w << 8) | p[i];
+    }
+
+    return w;
+}
+
+void rc_cache_hash(const void *data, STRLEN len, U32 seed, char out[16])
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const Word c1 = (Word)0x87c37b91114253d5ULL;
+    const Word c2 = (Word)0x4cf5ad432745937fULL;
+    Word h1, h2, k1, k2;
+    STRLEN nblocks, i;
+    const unsigned char *tail;
+    int j;
+
+    h1 = seed;
+    h2 = seed;
+    nblocks = len / 16;
+    for (i = 0; i < nblocks; ++i)
+    {
+	k1 = get_word(p + 16 * i);
+	k2 = get_word(p + 16 * i + 8);
+
+	k1 *= c1;
+	k1 = ROTATE64(k1, 31);
+	k1 *= c2;
+	h1 ^= k1;
+
+	h1 = ROTATE64(h1, 27);
+	h1 += h2;
+	h1 = h1 * 5 + 0x52dce729;
+
+	k2 *= c2;
+	k2 = ROTATE64(k2, 33);
+	k2 *= c1;
+	h2 ^= k2;
+
+	h2 = ROTATE64(h2, 31);
+	h2 += h1;
+	h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    tail = p + 16 * nblocks;
+    k1 = 0;
+    k2 = 0;
+    for (j = (int)(len & 15) - 1; j >= 8; --j)
+    {
+	k2 ^= (Word)tail[j] << (8 * (j - 8));
+    }
+
+    if ((len & 15) > 8)
+    {
+	k2 *= c2;
+	k2 = ROTATE64(k2, 33);
+	k2 *= c1;
+	h2 ^= k2;
+    }
+
+    for (j = (((len & 15) < 8) ? (int)(len & 15) : 8) - 1; j >= 0; --j)
+    {
+	k1 ^= (Word)tail[j] << (8 * j);
+    }
+
+    if (len & 15)
+    {
+	k1 *= c1;
+	k1 = ROTATE64(k1, 31);
+	k1 *= c2;
+	h1 ^= k1;
+    }
+
+    h1 ^= (Word)len;
+    h2 ^= (Word)len;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    memcpy(out, &h1, 8);
+    memcpy(out + 8, &h2, 8);
+}
+
+#else
+
+/* without 64-bit integers, 4 lanes of FNV-1a */
+void rc_cache_hash(const void *data, STRLEN len, U32 seed, char out[16])
+{
+    const unsigned char *p = (const unsigned char *)data;
+    U32 h[4];
+    STRLEN i;
+    int k;
+
+    for (k = 0; k < 4; ++k)
+    {
+	h[k] = 2166136261U ^ (seed + 0x9e3779b9U * k);
+	for (i = 0; i < len; ++i)
+	{
+	    h[k] = (h[k] ^ p[i]) * 16777619U;
+	}
+    }
+
+    memcpy(out, h, 16);
+}
+
+#endif
+
+#ifdef RC_HAS_CACHE
+
+typedef struct
+{
+    char magic[8];
+    U32 byteorder;
+    U32 slot_size;
+    Word slots;
+} Header;
+
+/* Empty while both halves of the key are 0 (keys with both halves 0
+   are stored with h1 = 1). Written in the order h1 = 0, result, h2,
+   h1 (with barriers in between), so that readers checking h1 before
+   and after reading the rest never see a result with the wrong
+   key. Fields are only accessed through the macros below. */
+typedef struct
+{
+    Word h1;
+    Word h2;
+    I32 result;
+    I32 reserved;
+} Slot;
+
+#define LOAD_RELAXED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+struct RcCache
+{
+    char *base;
+    size_t size;
+    Slot *slots;
+    Word count;
+    int read_only;
+};
+
+static void split_key(const char key[16], Word *h1, Word *h2)
+{
+    memcpy(h1, key, 8);
+    memcpy(h2, key + 8, 8);
+    if (!*h1 && !*h2)
+    {
+	*h1 = 1;
+    }
+}
+
+/* Checks the header of an open cache file of the given size. */
+static int valid_header(const Header *hd, size_t size)
+{
+    return !memcmp(hd->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) &&
+	(hd->byteorder == CACHE_BYTEORDER) &&
+	(hd->slot_size == sizeof(Slot)) && hd->slots &&
+	(sizeof(Header) + hd->slots * sizeof(Slot) == size);
+}
+
+/* Gets the size of the file open as fd (holding a lock on it), first
+   initializing it (unless read_only is set) if it's empty. Returns
+   0 on error. */
+static size_t init_file(int fd, long slots, int read_only, char **error)
+{
+    struct stat st;
+    Header hd;
+    size_t size;
+
+    if (fstat(fd, &st) < 0)
+    {
+	*error = "Couldn't open cache file";
+	return 0;
+    }
+
+    size = (size_t)st.st_size;
+    if (!size)
+    {
+	size = sizeof(Header) + (size_t)slots * sizeof(Slot);
+	memset(&hd, 0, sizeof(Header));
+	memcpy(hd.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	hd.byteorder = CACHE_BYTEORDER;
+	hd.slot_size = sizeof(Slot);
+	hd.slots = (Word)slots;
+	if (read_only || (ftruncate(fd, (off_t)size) < 0) ||
+	    (pwrite(fd, &hd, sizeof(Header), 0) != sizeof(Header)))
+	{
+	    *error = "Couldn't initialize cache file";
+	    return 0;
+	}
+    }
+    else if (size < sizeof(Header))
+    {
+	*error = "Invalid cache file";
+	return 0;
+    }
+
+    return size;
+}
+
+RcCache *rc_cache_open(const char *path, long slots, int read_only,
+    char **error)
+{
+    RcCache *cache;
+    size_t size;
+    int fd;
+    void *base;
+
+    if (slots <= 0)
+    {
+	slots = RC_CACHE_DEFAULT_SLOTS;
+    }
+
+    fd = open(path, read_only ? O_RDONLY : (O_RDWR | O_CREAT), 0666);
+    if (fd < 0)
+    {
+	*error = "Couldn't open cache file";
+	return 0;
+    }
+
+    /* an empty file is initialized under an exclusive lock, which
+       other processes opening it wait for - they see either an
+       empty file or a complete header */
+    if (flock(fd, read_only ? LOCK_SH : LOCK_EX) < 0)
+    {
+	close(fd);
+	*error = "Couldn't lock cache file";
+	return 0;
+    }
+
+    size = init_file(fd, slots, read_only, error);
+    if (!size)
+    {
+	close(fd);
+	return 0;
+    }
+
+    base = mmap(0, size, read_only ? PROT_READ : (PROT_READ | PROT_WRITE),
+	MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+	*error = "Couldn't map cache file";
+	return 0;
+    }
+
+    if (!valid_header((Header *)base, size))
+    {
+	munmap(base, size);
+	*error = "Invalid cache file";
+	return 0;
+    }
+
+    cache = (RcCache *)calloc(1, sizeof(RcCache));
+    if (!cache)
+    {
+	munmap(base, size);
+	*error = "Couldn't allocate memory for cache";
+	return 0;
+    }
+
+    cache->base = (char *)base;
+    cache->size = size;
+    cache->slots = (Slot *)(cache->base + sizeof(Header));
+    cache->count = ((Header *)base)->slots;
+    cache->read_only = read_only;
+    return cache;
+}
+
+void rc_cache_close(RcCache *cache)
+{
+    if (cache)
+    {
+	munmap(cache->base, cache->size);
+	free(cache);
+    }
+}
+
+int rc_cache_lookup(RcCache *cache, const char key[16])
+{
+    Slot *sl;
+    Word h1, h2, i, first, second;
+    I32 result;
+    int k;
+
+    split_key(key, &h1, &h2);
+    i = h1 % cache->count;
+    for (k = 0; k <= MAX_PROBE; ++k)
+    {
+	sl = cache->slots + i;
+	first = LOAD_ACQUIRE(sl->h1);
+	if (!first && !LOAD_RELAXED(sl->h2))
+	{
+	    return -1;
+	}
+
+	if (first == h1)
+	{
+	    result = LOAD_RELAXED(sl->result);
+	    second = LOAD_RELAXED(sl->h2);
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if ((second == h2) && (LOAD_RELAXED(sl->h1) == h1) &&
+		((result == 0) || (result == 1)))
+	    {
+		return result;
+	    }
+	}
+
+	i = (i + 1) % cache->count;
+    }
+
+    return -1;
+}
+
+void rc_cache_store(RcCache *cache, const char key[16], int result)
+{
+    Slot *sl;
+    Word h1, h2, i, home, first, second;
+    int k;
+
+    if (cache->read_only || ((result != 0) && (result != 1)))
+    {
+	return;
+    }
+
+    split_key(key, &h1, &h2);
+    home = i = h1 % cache->count;
+    for (k = 0; k <= MAX_PROBE; ++k)
+    {
+	sl = cache->slots + i;
+	first = LOAD_RELAXED(sl->h1);
+	second = LOAD_RELAXED(sl->h2);
+	if ((!first && !second) || ((first == h1) && (second == h2)))
+	{
+	    break;
+	}
+
+	i = (i + 1) % cache->count;
+    }
+
+    if (k > MAX_PROBE)
+    {
+	i = home;
+    }
+
+    sl = cache->slots + i;
+    STORE_RELAXED(sl->h1, 0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    STORE_RELAXED(sl->result, (I32)result);
+    STORE_RELAXED(sl->h2, h2);
+    STORE_RELEASE(sl->h1, h1);
+}
+
+#else
+
+RcCache *rc_cache_open(const char *path, long slots, int read_only,
+    char **error)
+{
+    *error = "Cache files not supported on this platform";
+    return 0;
+}
+
+void rc_cache_close(RcCache *cache)
+{
+}
+
+int rc_cache_lookup(RcCache *cache, const char key[16])
+{
+    return -1;
+}
+
+void rc_cache_store(RcCache *cache, const char key[16], int result)
+{
+}
+
+#endif
+
+typedef struct
+{
+    char key[16];
+    int result;
+
+    /* neighbours in the list ordered by use, most recent first; -1
+       at the ends */
+    int prev;
+    int next;
+
+    /* next entry in the same bucket, -1 at the end */
+    int chain;
+} LruEntry;
+
+struct RcLru
+{
+    LruEntry *entries;
+    int capacity;
+    int count;
+
+    /* first entry of each bucket, -1 for empty ones; the number of
+       buckets is a power of 2 */
+    int *buckets;
+    unsigned mask;
+
+    int head;
+    int tail;
+};
+
+static unsigned lru_bucket(RcLru *lru, const char key[16])
+{
+    unsigned b;
+
+    memcpy(&b, key, sizeof(b));
+    return b & lru->mask;
+}
+
+static void lru_unlink(RcLru *lru, int i)
+{
+    LruEntry *e = lru->entries + i;
+
+    if (e->prev >= 0)
+    {
+	lru->entries[e->prev].next = e->next;
+    }
+    else
+    {
+	lru->head = e->next;
+    }
+
+    if (e->next >= 0)
+    {
+	lru->entries[e->next].prev = e->prev;
+    }
+    else
+    {
+	lru->tail = e->prev;
+    }
+}
+
+static void lru_push_front(RcLru *lru, int i)
+{
+    LruEntry *e = lru->entries + i;
+
+    e->prev = -1;
+    e->next = lru->head;
+    if (lru->head >= 0)
+    {
+	lru->entries[lru->head].prev = i;
+    }
+
+    lru->head = i;
+    if (lru->tail < 0)
+    {
+	lru->tail = i;
+    }
+}
+
+static int lru_find(RcLru *lru, const char key[16])
+{
+    int i;
+
+    for (i = lru->buckets[lru_bucket(lru, key)]; i >= 0;
+	i = lru->entries[i].chain)
+    {
+	if (!memcmp(lru->entries[i].key, key, 16))
+	{
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+RcLru *rc_lru_new(int capacity)
+{
+    RcLru *lru;
+    unsigned n;
+
+    if (capacity <= 0)
+    {
+	return 0;
+    }
+
+    lru = (RcLru *)calloc(1, sizeof(RcLru));
+    if (!lru)
+    {
+	return 0;
+    }
+
+    n = 1;
+    while ((n < 2 * (unsigned)capacity) && (n < (1U << 30)))
+    {
+	n *= 2;
+    }
+
+    lru->entries = (LruEntry *)malloc(capacity * sizeof(LruEntry));
+    lru->buckets = (int *)malloc(n * sizeof(int));
+    if (!lru->entries || !lru->buckets)
+    {
+	rc_lru_free(lru);
+	return 0;
+    }
+
+    memset(lru->buckets, -1, n * sizeof(int));
+    lru->mask = n - 1;
+    lru->capacity = capacity;
+    lru->head = lru->tail = -1;
+    return lru;
+}
+
+void rc_lru_free(RcLru *lru)
+{
+    if (lru)
+    {
+	free(lru->entries);
+	free(lru->buckets);
+	free(lru);
+    }
+}
+
+int rc_lru_capacity(RcLru *lru)
+{
+    return lru->capacity;
+}
+
+int rc_lru_lookup(RcLru *lru, const char key[16])
+{
+    int i;
+
+    i = lru_find(lru, key);
+    if (i < 0)
+    {
+	return -1;
+    }
+
+    lru_unlink(lru, i);
+    lru_push_front(lru, i);
+    return lru->entries[i].result;
+}
+
+void rc_lru_store(RcLru *lru, const char key[16], int result)
+{
+    int i, *p;
+
+    if ((result != 0) && (result != 1))
+    {
+	return;
+    }
+
+    i = lru_find(lru, key);
+    if (i >= 0)
+    {
+	lru->entries[i].result = result;
+	lru_unlink(lru, i);
+	lru_push_front(lru, i);
+	return;
+    }
+
+    if (lru->count < lru->capacity)
+    {
+	i = lru->count++;
+    }
+    else
+    {
+	/* reuse the least recently used entry */
+	i = lru->tail;
+	lru_unlink(lru, i);
+	p = lru->buckets + lru_bucket(lru, lru->entries[i].key);
+	while (*p != i)
+	{
+	    p = &(lru->entries[*p].chain);
+	}
+
+	*p = lru->entries[i].chain;
+    }
+
+    memcpy(lru->entries[i].key, key, 16);
+    lru->entries[i].result = result;
+    p = lru->buckets + lru_bucket(lru, key);
+    lru->entries[i].chain = *p;
+    *p = i;
+    lru_push_front(lru, i);
+}
@@ -0,0 +1,56 @@
+#ifndef cache_h
+#define cache_h
+
+#include "engine.h"
+
+/* Comparison results in a file mapped to memory, shared by all
+   processes which open it: an open-addressing table of fixed-size
+   slots keyed by a 128-bit MurmurHash3 of whatever identifies the
+   comparison. Only decided results (0 and 1) are stored - undecided
+   ones depend on the limits. When no free slot is found near the
+   key's home slot, the home slot is overwritten. Processes may read
+   the file while one writes it; concurrent writers may lose each
+   other's results, but not corrupt the table. Not available without
+   mmap, flock, 64-bit integers or GCC-style atomic builtins, in
+   which case rc_cache_open fails. */
+typedef struct RcCache RcCache;
+
+#define RC_CACHE_DEFAULT_SLOTS (1 << 20)
+
+/* Opens (or, unless read_only is set, creates with the given number
+   of slots) the cache file at path. An existing file keeps its own
+   size. Returns null on error, with *error set to a literal string. */
+RcCache *rc_cache_open(const char *path, long slots, int read_only,
+    char **error);
+
+void rc_cache_close(RcCache *cache);
+
+/* MurmurHash3 x64_128 of len bytes */
+void rc_cache_hash(const void *data, STRLEN len, U32 seed, char out[16]);
+
+/* Returns the result stored for key (from rc_cache_hash), -1 when
+   there's none. */
+int rc_cache_lookup(RcCache *cache, const char key[16]);
+
+/* Stores result (0 or 1) for key; ignored for read-only caches. */
+void rc_cache_store(RcCache *cache, const char key[16], int result);
+
+/* Results of recent comparisons in memory, keyed like RcCache, with
+   the least recently used one dropped when full. Not thread-safe. */
+typedef struct RcLru RcLru;
+
+/* returns null on failed memory allocation (or capacity <= 0) */
+RcLru *rc_lru_new(int capacity);
+
+void rc_lru_free(RcLru *lru);
+
+int rc_lru_capacity(RcLru *lru);
+
+/* Returns the result stored for key, -1 when there's none; found
+   results become the most recently used. */
+int rc_lru_lookup(RcLru *lru, const char key[16]);
+
+/* Stores result (0 or 1, others are ignored) for key. */
+void rc_lru_store(RcLru *lru, const char key[16], int result);
+
+#endif
@@ -1,37 +1,11 @@
 #include "engine.h"
-#include "regnodes.h"
-#include "regcomp.h"
+#include "regapi.h"
+#include "nfa.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-
-#if PERL_API_REVISION != 5
-#error This module is only for Perl 5
-#else
-#if PERL_API_VERSION == 16
-#define RC_ANYOF_UTF8 0
-#else
-#if PERL_API_VERSION == 18
-#define RC_POSIX_NODES
-
-#define RC_ANYOF_UTF8 0
-#else
-#if PERL_API_VERSION == 20
-#define RC_POSIX_NODES
-#define RC_INVLIST_EX
-
-#define RC_ANYOF_UTF8 ANYOF_UTF8
-
-/* renamed */
-#define ANYOF_NON_UTF8_LATIN1_ALL ANYOF_NON_UTF8_NON_ASCII_ALL
-
-/* no longer exists - using 5.18 definition */
-#define ANYOF_NONBITMAP(node)	(ARG(node) != ANYOF_NONBITMAP_EMPTY)
-#else
-#error Unsupported PERL_API_VERSION
-#endif
-#endif
-#endif
+#ifdef I_PTHREAD
+#include <pthread.h>
 #endif
 
 #define SIZEOF_ARRAY(a) (sizeof(a) / sizeof(a[0]))
@@ -82,16 +56,245 @@ typedef struct
     int spent;
 } Arrow;
 
-#define GET_LITERAL(a) (((char *)((a)->rn + 1)) + (a)->spent)
-#define GET_OFFSET(rn) ((rn)->next_off ? (rn)->next_off : get_synth_offset(rn))
+#define GET_LITERAL(a) get_literal(ctx, (a), 0)
+#define GET_OFFSET(rn) ((rn)->next_off ? (rn)->next_off : get_synth_offset(ctx, rn))
 
 /* Most functions below have this signature. The first parameter is a
    flag set after the comparison actually matched something, second
    parameter points into the first ("left") regexp passed into
    rc_compare, the third into the second ("right") regexp. Return
    value is 1 for match, 0 no match, -1 error (with the lowest-level
-   failing function setting rc_error before returning it). */
-typedef int (*FCompare)(int, Arrow *, Arrow *);
+   failing function setting ctx->error before returning it) or
+   RC_UNDECIDED. Comparators may also return RC_SKIP (see
+   compare_mismatch), but only to compare or resume_skip, and RC_TAIL
+   (see compare_tails), only to compare. */
+typedef int (*FCompare)(RcContext *, int, Arrow *, Arrow *);
+
+#define RC_SKIP -3
+#define RC_TAIL -4
+
+/* Memo key of a compare iteration whose result isn't known yet. */
+typedef struct PendingKey
+{
+    struct PendingKey *next;
+    int anchored;
+    int offs1;
+    int spent1;
+    int offs2;
+    int spent2;
+} PendingKey;
+
+/* Comparison whose result is the one of its tails, continued by
+   compare without recursing - see compare_tails. */
+typedef struct TailFrame
+{
+    struct TailFrame *next;
+
+    /* the arrows compare_tails was called with, and its anchored
+       flag */
+    Arrow a1;
+    Arrow a2;
+    int anchored;
+
+    /* memo keys of the comparison */
+    PendingKey *pending;
+} TailFrame;
+
+/* Result of a compare call, keyed by the positions it started
+   from. Positions are node offsets from the start of the compared
+   program, so only arrows pointing into the original programs (not
+   into temporary copies) are memoized. Output positions are stored
+   as well, because callers continue from wherever compare left the
+   arrows (even after a mismatch). */
+typedef struct
+{
+    unsigned generation;
+    int offs1;
+    int spent1;
+    int offs2;
+    int spent2;
+    int anchored;
+    int rv;
+    int out_offs1;
+    int out_spent1;
+    int out_offs2;
+    int out_spent2;
+} MemoEntry;
+
+/* Open-addressing table of MemoEntry, valid for a single
+   rc_compare_compiled call - entries from previous calls have a
+   different generation. */
+typedef struct
+{
+    MemoEntry *entries;
+    unsigned size;
+    unsigned count;
+    unsigned generation;
+
+    /* compared programs; start is null when memoization is
+       disabled */
+    regexp *origin1;
+    regnode *start1;
+    int size1;
+    regexp *origin2;
+    regnode *start2;
+    int size2;
+} Memo;
+
+/* Chunk of the bump allocator for temporary regnode copies; data
+   follows the header. */
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+} ArenaChunk;
+
+/* Temporary copies are allocated (and released) in stack order, so
+   the allocator just bumps a pointer; everything allocated during a
+   comparison is dropped by the reset at the end of
+   rc_compare_compiled, including what was left behind on error
+   paths. */
+typedef struct
+{
+    ArenaChunk *first;
+    ArenaChunk *current;
+} Arena;
+
+typedef struct
+{
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_CHUNK_SIZE 16384
+#define ARENA_ALIGN 8
+
+#define MEMO_MIN_SIZE 256
+#define MEMO_MAX_SIZE (1 << 20)
+
+/* larger tables are freed at the end of a comparison */
+#define MEMO_KEEP_SIZE (1 << 12)
+
+/* Record of the comparison IR for a node of a compiled program: what
+   the comparators need of the node, in a layout which doesn't depend
+   on the Perl version, and its offsets (see GET_OFFSET, get_size and
+   get_jump_offset); 0 where not known. */
+typedef struct RcIrNode
+{
+    /* chars of a literal node (in RcIr.literals) and their count,
+       null for other nodes */
+    char *literal;
+    int length;
+
+    /* minimal & maximal count of a curly */
+    short min;
+    short max;
+
+    int offset;
+    int size;
+    int jump;
+
+    /* charset of a class node (see intern_charset), 0 for none */
+    int charset;
+
+    /* 1 + what convert_map returned for an ANYOF node with data
+       beyond the bitmap (0 when not known), and the map it set */
+    int map_known;
+    U32 map;
+} IrNode;
+
+/* Comparison IR of a compiled program (see index_nodes): a record
+   for every regnode position (only nodes reachable from the start of
+   the program are filled) and the chars of all literal nodes, one
+   run after another. */
+typedef struct RcIr
+{
+    IrNode *nodes;
+    char *literals;
+} Ir;
+
+/* What the class comparators see of a class node: its type & flags
+   and, for ANYOF, the bitmap and what convert_map makes of the rest
+   (map_known being its return value). Unused fields are zero. */
+typedef struct
+{
+    U8 type;
+    U8 flags;
+    U8 nonbitmap;
+    I8 map_known;
+    U32 map;
+    unsigned char bitmap[ANYOF_BITMAP_SIZE];
+} Charset;
+
+/* Distinct charsets of the indexed programs, identified by their
+   index + 1 and never removed, hashed into slots (of indices, -1 for
+   empty). Filled by index_nodes (under charsets_lock, as regexps may
+   be compiled by several threads); comparisons just compare the
+   identifiers. */
+typedef struct
+{
+    Charset *sets;
+    int count;
+    int alloc;
+    int *slots;
+    int nslots;
+} CharsetTable;
+
+#define MAX_CHARSETS (1 << 16)
+
+/* Result of a set test of the class comparators for a pair of
+   charsets; charset1 is 0 for an empty entry. */
+typedef struct
+{
+    int charset1;
+    int charset2;
+    int subset;
+} SubsetEntry;
+
+/* size of the (direct-mapped) cache of SubsetEntry */
+#define SUBSET_CACHE_SIZE 4096
+
+/* IR records of the compared programs (see RcCompiled.ir);
+   temporary copies of nodes aren't covered. */
+typedef struct
+{
+    /* null outside of comparisons */
+    regnode *start1;
+    int size1;
+    IrNode *nodes1;
+    regnode *start2;
+    int size2;
+    IrNode *nodes2;
+
+    /* set while index_nodes fills nodes1 - comparisons just read the
+       entries, as other threads may be reading them too */
+    int filling;
+} NodeTable;
+
+/* Private part of RcContext, allocated by the first comparison. */
+typedef struct RcState
+{
+    Memo memo;
+    Arena arena;
+    NodeTable nodes;
+
+    /* set tests of class nodes, null until the first one */
+    SubsetEntry *subsets;
+
+    /* nesting of compare calls */
+    int depth;
+
+    /* where compare_tails returning RC_TAIL continues */
+    Arrow tail1;
+    Arrow tail2;
+
+    /* comparator calls made by the current comparison */
+    long steps;
+
+    /* when the current comparison must end (from now_ms), 0 for never */
+    double deadline;
+} RcState;
 
 /* Place of a char in regexp bitmap. */
 typedef struct
@@ -112,7 +315,21 @@ typedef struct
   unsigned char nbitmap[ANYOF_BITMAP_SIZE];
 } ByteClass;
 
-char *rc_error = 0;
+/* set by rc_init */
+static int initialized = 0;
+
+char rc_perl_needed[] = "Comparison needs the Perl interpreter";
+
+static CharsetTable charsets;
+
+#ifdef I_PTHREAD
+static pthread_mutex_t charsets_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_CHARSETS pthread_mutex_lock(&charsets_lock)
+#define UNLOCK_CHARSETS pthread_mutex_unlock(&charsets_lock)
+#else
+#define LOCK_CHARSETS
+#define UNLOCK_CHARSETS
+#endif
 
 unsigned char forced_byte[ANYOF_BITMAP_SIZE];
 
@@ -257,11 +474,13 @@ static unsigned char *posix_regclass_nbitmaps[] = { word_bc.nbitmap,
 
 static unsigned char trivial_nodes[REGNODE_MAX];
 
+
 static FCompare dispatch[REGNODE_MAX][REGNODE_MAX];
 
-static int compare(int anchored, Arrow *a1, Arrow *a2);
-static int compare_right_branch(int anchored, Arrow *a1, Arrow *a2);
-static int compare_right_curly(int anchored, Arrow *a1, Arrow *a2);
+static int compare(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2);
+static int resume_skip(RcContext *ctx, int rv, Arrow *a1, Arrow *a2);
+static int compare_right_branch(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2);
+static int compare_right_curly(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2);
 
 static void init_bit_flag(BitFlag *bf, int c)
 {
@@ -359,7 +578,7 @@ static U32 extend_mask(U32 mask)
     return mask;
 }
 
-static int convert_desc_to_map(char *desc, int invert, U32 *map)
+static int convert_desc_to_map(RcContext *ctx, char *desc, int invert, U32 *map)
 {
     int i;
     U32 mask = 0;
@@ -371,7 +590,7 @@ static int convert_desc_to_map(char *desc, int invert, U32 *map)
     /* make sure *(p - 1) is valid */
     if (p == desc)
     {
-        rc_error = "no inversion flag before character class description";
+        ctx->error = "no inversion flag before character class description";
 	return -1;
     }
 
@@ -404,7 +623,7 @@ static int convert_desc_to_map(char *desc, int invert, U32 *map)
 		}
 		else
 		{
-		    rc_error = "unknown inversion flag before character class description";
+		    ctx->error = "unknown inversion flag before character class description";
 		    return -1;
 		}
 	    }
@@ -3016,8 +3235,85 @@ static int convert_invlist_to_map(SV *invlist, int invert, U32 *map)
     return 0;
 }
 
-static int convert_regclass_map(Arrow *a, U32 *map)
+static IrNode *get_ir_node(RcContext *ctx, regnode *rn)
+{
+    NodeTable *nt;
+
+    if (!ctx->state || !ctx->state->nodes.start1)
+    {
+	return 0;
+    }
+
+    nt = &(ctx->state->nodes);
+    if (nt->nodes1 && (rn >= nt->start1) && (rn < nt->start1 + nt->size1))
+    {
+	return nt->nodes1 + (rn - nt->start1);
+    }
+    else if (nt->nodes2 && (rn >= nt->start2) &&
+	(rn < nt->start2 + nt->size2))
+    {
+	return nt->nodes2 + (rn - nt->start2);
+    }
+
+    return 0;
+}
+
+/* entry to fill in, null outside of index_nodes */
+static IrNode *fill_ir_node(RcContext *ctx, IrNode *ni)
+{
+    return (ni && ctx->state->nodes.filling) ? ni : 0;
+}
+
+/* Returns the current char of the literal node a points to (from its
+   IR record when it has one), setting *left (unless null) to the
+   number of chars from it to the end of the node. */
+static char *get_literal(RcContext *ctx, Arrow *a, int *left)
+{
+    IrNode *ni;
+
+    ni = get_ir_node(ctx, a->rn);
+    if (ni && ni->literal)
+    {
+	if (left)
+	{
+	    *left = ni->length - a->spent;
+	}
+
+	return ni->literal + a->spent;
+    }
+
+    if (left)
+    {
+	*left = a->rn->flags - a->spent;
+    }
+
+    return ((char *)(a->rn + 1)) + a->spent;
+}
+
+/* Copies the minimal & maximal count of curly p (from its IR record
+   when it has one - a zero maximum isn't worth a record) to cnt. */
+static void get_counts(RcContext *ctx, regnode *p, short *cnt)
+{
+    IrNode *ni;
+    short *raw;
+
+    ni = get_ir_node(ctx, p);
+    if (ni && ni->max)
+    {
+	cnt[0] = ni->min;
+	cnt[1] = ni->max;
+    }
+    else
+    {
+	raw = (short *)(p + 1);
+	cnt[0] = raw[0];
+	cnt[1] = raw[1];
+    }
+}
+
+static int convert_regclass_map(RcContext *ctx, Arrow *a, U32 *map)
 {
+    dTHX;
     regexp_internal *pr;
     U32 n;
     struct reg_data *rdata;
@@ -3027,19 +3323,26 @@ static int convert_regclass_map(Arrow *a, U32 *map)
     assert(a->rn->type == ANYOF);
     assert(ANYOF_NONBITMAP(a->rn));
 
+    /* SvPV & co. may call (and modify) the interpreter */
+    if (ctx->no_perl)
+    {
+	ctx->error = rc_perl_needed;
+	return -1;
+    }
+
     /* basically copied from regexec.c:regclass_swash */
     n = ARG_LOC(a->rn);
     pr = RXi_GET(a->origin);
     if (!pr) /* this should have been tested by find_internal during
 		initialization, but just in case... */
     {
-        rc_error = "regexp_internal not found";
+        ctx->error = "regexp_internal not found";
 	return -1;
     }
 
     rdata = pr->data;
 
-    if ((n < rdata->count) &&
+    if (rdata && (n < rdata->count) &&
 	(rdata->what[n] == 's')) {
         SV *rv = (SV *)(rdata->data[n]);
 	AV *av = (AV *)SvRV(rv);
@@ -3052,7 +3355,7 @@ static int convert_regclass_map(Arrow *a, U32 *map)
 	       character class description in its textual form. It isn't
 	       very clear what exactly the textual form is, but we hope
 	       it's 0-terminated. */
-	  return convert_desc_to_map(SvPV_nolen(*ary),
+	  return convert_desc_to_map(ctx, SvPV_nolen(*ary),
 	      !!(a->rn->flags & ANYOF_INVERT),
 	      map);
 	}
@@ -3080,14 +3383,17 @@ static int convert_regclass_map(Arrow *a, U32 *map)
 	}
     }
 
-    rc_error = "regclass not found";
+    ctx->error = "regclass not found";
     return -1;
 }
 
 /* returns 1 OK (map set), 0 map not recognized/representable, -1
-   unexpected input (rc_error set) */
-static int convert_map(Arrow *a, U32 *map)
+   unexpected input (ctx->error set) */
+static int convert_map(RcContext *ctx, Arrow *a, U32 *map)
 {
+    IrNode *ni;
+    int rv;
+
     /* fprintf(stderr, "enter convert_map\n"); */
 
     assert(a->rn->type == ANYOF);
@@ -3095,7 +3401,22 @@ static int convert_map(Arrow *a, U32 *map)
 
     if (ANYOF_NONBITMAP(a->rn))
     {
-        return convert_regclass_map(a, map);
+	ni = get_ir_node(ctx, a->rn);
+	if (ni && ni->map_known)
+	{
+	    *map = ni->map;
+	    return ni->map_known - 1;
+	}
+
+        rv = convert_regclass_map(ctx, a, map);
+	ni = fill_ir_node(ctx, ni);
+	if (ni && (rv >= 0))
+	{
+	    ni->map_known = rv + 1;
+	    ni->map = rv ? *map : 0;
+	}
+
+	return rv;
     }
     else
     {
@@ -3156,21 +3477,21 @@ static int convert_negative_class(Arrow *a, U32 *map)
 }
 #endif
 
-static int get_assertion_offset(regnode *p)
+static int get_assertion_offset(RcContext *ctx, regnode *p)
 {
     int offs;
 
     offs = ARG_LOC(p);
     if (offs <= 2)
     {
-        rc_error = "Assertion offset too small";
+        ctx->error = "Assertion offset too small";
 	return -1;
     }
 
     return offs;
 }
 
-static int get_synth_offset(regnode *p)
+static int compute_synth_offset(RcContext *ctx, regnode *p)
 {
     assert(!p->next_off);
 
@@ -3210,7 +3531,7 @@ static int get_synth_offset(regnode *p)
 	    /* p[10] seems always 0 on Linux, but 0xfbfaf9f8 seen on
 	       Windows; for '[\\w\\-_.]+\\.', both 0 and 0x20202020
 	       observed in p[11] - wonder what those are... */
-	    rc_error = "Unknown bitmap format";
+	    ctx->error = "Unknown bitmap format";
 	    return -1;
 	}
 
@@ -3218,36 +3539,93 @@ static int get_synth_offset(regnode *p)
     }
     else if ((p->type == IFMATCH) || (p->type == UNLESSM))
     {
-	return get_assertion_offset(p);
+	return get_assertion_offset(ctx, p);
     }
 
     /* fprintf(stderr, "type %d\n", p->type); */
-    rc_error = "Offset not set";
+    ctx->error = "Offset not set";
     return -1;
 }
 
-static int get_size(regnode *rn)
+static int get_synth_offset(RcContext *ctx, regnode *p)
 {
+    IrNode *ni;
     int offs;
+
+    ni = get_ir_node(ctx, p);
+    if (ni && ni->offset)
+    {
+	return ni->offset;
+    }
+
+    offs = compute_synth_offset(ctx, p);
+    ni = fill_ir_node(ctx, ni);
+    if (ni && (offs > 0))
+    {
+	ni->offset = offs;
+    }
+
+    return offs;
+}
+
+int rc_node_offset(RcContext *ctx, regnode *p)
+{
+    return GET_OFFSET(p);
+}
+
+static int get_size(RcContext *ctx, regnode *rn)
+{
+    IrNode *ni;
+    int offs, sz, rv;
     regnode *e = rn;
 
-    while (e->type != END)
+    /* stops at END or at a node whose size is known */
+    sz = 0;
+    while (!sz && (e->type != END))
     {
-        offs = GET_OFFSET(e);
-	if (offs <= 0)
+	ni = get_ir_node(ctx, e);
+	if (ni && ni->size)
 	{
-	    return -1;
+	    sz = (e - rn) + ni->size;
+	}
+	else
+	{
+	    offs = GET_OFFSET(e);
+	    if (offs <= 0)
+	    {
+		return -1;
+	    }
+
+	    e += offs;
+	}
+    }
+
+    if (!sz)
+    {
+	sz = e - rn + 1;
+    }
+
+    /* all nodes passed end at the same END */
+    rv = sz;
+    while (rn != e)
+    {
+	offs = GET_OFFSET(rn);
+	ni = fill_ir_node(ctx, get_ir_node(ctx, rn));
+	if (ni)
+	{
+	    ni->size = sz;
 	}
 
-        e += offs;
+	sz -= offs;
+	rn += offs;
     }
 
-    return e - rn + 1;
+    return rv;
 }
 
 /* #define DEBUG_dump_data */
 
-static regnode *find_internal(regexp *pt)
+static regnode *find_internal(RcContext *ctx, regexp *pt)
 {
     regexp_internal *pr;
     regnode *p;
@@ -3263,7 +3641,7 @@ static regnode *find_internal(regexp *pt)
 #if !defined(ACTIVEPERL_PRODUCT)
     if (pt->engine && (pt->engine != &PL_core_reg_engine))
     {
-        rc_error = "Alternative regexp engine not supported";
+        ctx->error = "Alternative regexp engine not supported";
 	return 0;
     }
 #endif
@@ -3271,14 +3649,14 @@ static regnode *find_internal(regexp *pt)
     pr = RXi_GET(pt);
     if (!pr)
     {
-        rc_error = "Internal regexp not set";
+        ctx->error = "Internal regexp not set";
 	return 0;
     }
 
     p = pr->program;
     if (!p)
     {
-        rc_error = "Compiled regexp not set";
+        ctx->error = "Compiled regexp not set";
 	return 0;
     }
 
@@ -3286,7 +3664,7 @@ static regnode *find_internal(regexp *pt)
 	(p->next_off == 0)))
     {
         /* fprintf(stderr, "%d %d %d\n", p->flags, p->type, p->next_off); */
-        rc_error = "Invalid regexp signature";
+        ctx->error = "Invalid regexp signature";
 	return 0;
     }
 
@@ -3346,7 +3724,8 @@ static unsigned get_forced_semantics(REGEXP *pt)
 
     /* fprintf(stderr, "precomp = %*s\n", (int)prelen, precomp); */
 
-    for (i = 0; i < prelen; ++i)
+    /* once both flags are set, the rest can't change anything */
+    for (i = 0; (i < prelen) && (forced != FORCED_MISMATCH); ++i)
     {
 	c = precomp[i];
 	
@@ -3433,14 +3812,183 @@ static unsigned get_forced_semantics(REGEXP *pt)
     return forced;
 }
 
-static regnode *alloc_alt(regnode *p, int sz)
+static ArenaChunk *new_arena_chunk(size_t size)
+{
+    ArenaChunk *chunk;
+
+    chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+    if (!chunk)
+    {
+	return 0;
+    }
+
+    chunk->next = 0;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static ArenaMark arena_mark(RcContext *ctx)
+{
+    Arena *arena = &ctx->state->arena;
+    ArenaMark mark;
+
+    mark.chunk = arena->current;
+    mark.used = arena->current ? arena->current->used : 0;
+    return mark;
+}
+
+/* frees everything allocated after mark was taken */
+static void arena_release(RcContext *ctx, ArenaMark mark)
+{
+    Arena *arena = &ctx->state->arena;
+    if (mark.chunk)
+    {
+        arena->current = mark.chunk;
+	arena->current->used = mark.used;
+    }
+    else if (arena->first)
+    {
+        arena->current = arena->first;
+	arena->current->used = 0;
+    }
+}
+
+static void arena_reset(RcContext *ctx)
+{
+    Arena *arena = &ctx->state->arena;
+    ArenaChunk *chunk, *next;
+
+    if (!arena->first)
+    {
+	return;
+    }
+
+    /* keep just the first chunk, so that a single huge comparison
+       doesn't hold its memory forever */
+    chunk = arena->first->next;
+    while (chunk)
+    {
+	next = chunk->next;
+	free(chunk);
+	chunk = next;
+    }
+
+    arena->first->next = 0;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+static void *arena_alloc(RcContext *ctx, size_t size)
+{
+    Arena *arena = &ctx->state->arena;
+    ArenaChunk *chunk, *next;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    chunk = arena->current;
+    if (!chunk)
+    {
+	chunk = new_arena_chunk((size > ARENA_CHUNK_SIZE) ? size :
+	    ARENA_CHUNK_SIZE);
+	if (!chunk)
+	{
+	    return 0;
+	}
+
+	arena->first = arena->current = chunk;
+    }
+
+    while (chunk->used + size > chunk->size)
+    {
+	next = chunk->next;
+	if (!next || (next->size < size))
+	{
+	    /* unused successors are dropped; the new chunk takes
+	       their place */
+	    while (next)
+	    {
+		chunk->next = next->next;
+		free(next);
+		next = chunk->next;
+	    }
+
+	    next = new_arena_chunk((size > ARENA_CHUNK_SIZE) ? size :
+		ARENA_CHUNK_SIZE);
+	    if (!next)
+	    {
+		return 0;
+	    }
+
+	    chunk->next = next;
+	}
+
+	next->used = 0;
+	chunk = next;
+    }
+
+    arena->current = chunk;
+    p = ((char *)(chunk + 1)) + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static double now_ms()
+{
+#ifdef HAS_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+    return time(0) * 1000.0;
+#endif
+}
+
+int rc_over_budget(RcContext *ctx)
+{
+    RcState *st;
+
+    st = ctx->state;
+    ++st->steps;
+    if (ctx->limits.max_steps && (st->steps > ctx->limits.max_steps))
+    {
+        ctx->error = "Comparison step limit exceeded";
+	return 1;
+    }
+
+    if (st->deadline && !(st->steps % RC_DEADLINE_STEPS) &&
+	(now_ms() >= st->deadline))
+    {
+        ctx->error = "Comparison deadline passed";
+	return 1;
+    }
+
+    return 0;
+}
+
+static regnode *alloc_nodes(RcContext *ctx, int sz)
+{
+    regnode *alt;
+
+    alt = (regnode *)arena_alloc(ctx, sizeof(regnode) * sz);
+    if (!alt)
+    {
+	ctx->error = "Could not allocate memory for regexp copy";
+	return 0;
+    }
+
+    return alt;
+}
+
+static regnode *alloc_alt(RcContext *ctx, regnode *p, int sz)
 {
     regnode *alt;
 
-    alt = (regnode *)malloc(sizeof(regnode) * sz);
+    alt = alloc_nodes(ctx, sz);
     if (!alt)
     {
-	rc_error = "Could not allocate memory for regexp copy";
 	return 0;
     }
 
@@ -3449,7 +3997,7 @@ static regnode *alloc_alt(regnode *p, int sz)
     return alt;
 }
 
-static regnode *alloc_terminated(regnode *p, int sz)
+static regnode *alloc_terminated(RcContext *ctx, regnode *p, int sz)
 {
     regnode *alt;
     int last;
@@ -3457,7 +4005,7 @@ static regnode *alloc_terminated(regnode *p, int sz)
     /* fprintf(stderr, "enter alloc_terminated(, %d\n", sz); */
 
     assert(sz > 0);
-    alt = alloc_alt(p, sz);
+    alt = alloc_alt(ctx, p, sz);
     if (!alt)
     {
 	return 0;
@@ -3467,7 +4015,7 @@ static regnode *alloc_terminated(regnode *p, int sz)
     /* fprintf(stderr, "type: %d\n", last); */
     if ((last >= REGNODE_MAX) || !trivial_nodes[last])
     {
-	rc_error = "Alternative doesn't end like subexpression";
+	ctx->error = "Alternative doesn't end like subexpression";
 	return 0;
     }
 
@@ -3475,9 +4023,35 @@ static regnode *alloc_terminated(regnode *p, int sz)
     return alt;
 }
 
-static int bump_exact(Arrow *a)
+/* copies the node repeated by a simple (i.e. single-node) repeat,
+   terminated by END */
+static regnode *alloc_body(RcContext *ctx, regnode *p)
 {
-    int offs;
+    regnode *alt;
+    int sz;
+
+    sz = GET_OFFSET(p);
+    if (sz <= 0)
+    {
+	return 0;
+    }
+
+    alt = alloc_nodes(ctx, sz + 1);
+    if (!alt)
+    {
+	return 0;
+    }
+
+    memcpy(alt, p, sizeof(regnode) * sz);
+    alt[sz].flags = 0;
+    alt[sz].type = END;
+    alt[sz].next_off = 0;
+    return alt;
+}
+
+static int bump_exact(RcContext *ctx, Arrow *a)
+{
+    int offs, left;
 
     assert((a->rn->type == EXACT) || (a->rn->type == EXACTF) || (a->rn->type == EXACTFU));
 
@@ -3487,16 +4061,21 @@ static int bump_exact(Arrow *a)
 	return -1;
     }
 
-    if (++(a->spent) >= a->rn->flags)
+    get_literal(ctx, a, &left);
+    if (left <= 1)
     {
 	a->spent = 0;
 	a->rn += offs;
     }
+    else
+    {
+	++(a->spent);
+    }
 
     return 1;
 }
 
-static int bump_regular(Arrow *a)
+static int bump_regular(RcContext *ctx, Arrow *a)
 {
     int offs;
 
@@ -3515,7 +4094,7 @@ static int bump_regular(Arrow *a)
     return 1;
 }
 
-static int bump_with_check(Arrow *a)
+static int bump_with_check(RcContext *ctx, Arrow *a)
 {
     if (a->rn->type == END)
     {
@@ -3523,21 +4102,28 @@ static int bump_with_check(Arrow *a)
     }
     else if ((a->rn->type == EXACT) || (a->rn->type == EXACTF) || (a->rn->type == EXACTFU))
     {
-        return bump_exact(a);
+        return bump_exact(ctx, a);
     }
     else
     {
-        return bump_regular(a);
+        return bump_regular(ctx, a);
     }
 }
 
-static int get_jump_offset(regnode *p)
+static int get_jump_offset(RcContext *ctx, regnode *p)
 {
+    IrNode *ni;
     int offs;
     regnode *q;
 
     assert(p->type != END);
 
+    ni = get_ir_node(ctx, p);
+    if (ni && ni->jump)
+    {
+	return ni->jump;
+    }
+
     offs = GET_OFFSET(p);
     if (offs <= 0)
     {
@@ -3556,11 +4142,18 @@ static int get_jump_offset(regnode *p)
 	q += offs;
     }
 
+    ni = fill_ir_node(ctx, ni);
+    if (ni)
+    {
+	ni->jump = q - p;
+    }
+
     return q - p;
 }
 
 REGEXP *rc_regcomp(SV *rs)
 {
+    dTHX;
     REGEXP *rx;
 
     if (!rs)
@@ -3579,13 +4172,21 @@ REGEXP *rc_regcomp(SV *rs)
 
 void rc_regfree(REGEXP *rx)
 {
+    dTHX;
+
     if (rx)
     {
         pregfree(rx);
     }
 }
 
-static int compare_mismatch(int anchored, Arrow *a1, Arrow *a2)
+/* Skips a node of the left regexp (when not anchored) and restarts
+   the comparison from the next one. Instead of recursing (which for
+   long regexps could exhaust the stack), it returns RC_SKIP, telling
+   compare to loop; callers must either return that value unchanged
+   (when a1 and a2 are the arrows they were called with), or pass it
+   through resume_skip. */
+static int compare_mismatch(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     int rv;
 
@@ -3597,78 +4198,76 @@ static int compare_mismatch(int anchored, Arrow *a1, Arrow *a2)
     }
     else
     {
-        rv = bump_with_check(a1);
+        rv = bump_with_check(ctx, a1);
 	if (rv <= 0)
 	{
 	    return rv;
 	}
 
-	return compare(0, a1, a2);
+	return RC_SKIP;
     }
 }
 
-static int compare_tails(int anchored, Arrow *a1, Arrow *a2)
+/* finishes the comparison of a1 & a2 if a comparator called on them
+   returned RC_SKIP */
+static int resume_skip(RcContext *ctx, int rv, Arrow *a1, Arrow *a2)
 {
-    Arrow tail1, tail2;
-    int rv;
+    assert(rv != RC_TAIL);
+    return (rv == RC_SKIP) ? compare(ctx, 0, a1, a2) : rv;
+}
+
+/* Compares the tails after the current nodes (anchored), falling
+   back to compare_mismatch if they don't match. This happens once
+   per matched node (or char), so instead of recursing (which would
+   nest as deep as the regexps are long), it leaves the tails in
+   ctx->state and returns RC_TAIL, telling compare to continue with
+   them; a1 and a2 stay unchanged until then. */
+static int compare_tails(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
+{
+    RcState *st = ctx->state;
+    int rv;
 
     /* is it worth using StructCopy? */
-    tail1 = *a1;
-    rv = bump_with_check(&tail1);
+    st->tail1 = *a1;
+    rv = bump_with_check(ctx, &(st->tail1));
     if (rv <= 0)
     {
         return rv;
     }
 
-    tail2 = *a2;
-    rv = bump_with_check(&tail2);
+    st->tail2 = *a2;
+    rv = bump_with_check(ctx, &(st->tail2));
     if (rv <= 0)
     {
         return rv;
     }
 
-    rv = compare(1, &tail1, &tail2);
-    if (rv < 0)
-    {
-        return rv;
-    }
-
-    if (!rv)
-    {
-	rv = compare_mismatch(anchored, a1, a2);
-    }
-    else
-    {
-	*a1 = tail1;
-	*a2 = tail2;
-    }
-
-    return rv;
+    return RC_TAIL;
 }
 
-static int compare_left_tail(int anchored, Arrow *a1, Arrow *a2)
+static int compare_left_tail(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     Arrow tail1;
     int rv;
 
     tail1 = *a1;
-    rv = bump_with_check(&tail1);
+    rv = bump_with_check(ctx, &tail1);
     if (rv <= 0)
     {
         return rv;
     }
 
-    return compare(anchored, &tail1, a2);
+    return compare(ctx, anchored, &tail1, a2);
 }
 
-static int compare_after_assertion(int anchored, Arrow *a1, Arrow *a2)
+static int compare_after_assertion(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     Arrow tail1;
     int offs;
 
     assert((a1->rn->type == IFMATCH) || (a1->rn->type == UNLESSM));
 
-    offs = get_assertion_offset(a1->rn);
+    offs = get_assertion_offset(ctx, a1->rn);
     if (offs < 0)
     {
 	return offs;
@@ -3677,42 +4276,43 @@ static int compare_after_assertion(int anchored, Arrow *a1, Arrow *a2)
     tail1.origin = a1->origin;
     tail1.rn = a1->rn + offs;
     tail1.spent = 0;
-    return compare(anchored, &tail1, a2);
+    return compare(ctx, anchored, &tail1, a2);
 }
 
-static int compare_positive_assertions(int anchored, Arrow *a1, Arrow *a2)
+static int compare_positive_assertions(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *alt1, *p2, *alt2;
     int rv, sz1, sz2;
     Arrow left, right;
+    ArenaMark mark;
 
     p1 = a1->rn;
     p2 = a2->rn;
     assert(p1->type == IFMATCH);
     assert(p2->type == IFMATCH);
 
-    sz1 = get_assertion_offset(p1);
+    sz1 = get_assertion_offset(ctx, p1);
     if (sz1 < 0)
     {
 	return -1;
     }
 
-    sz2 = get_assertion_offset(p2);
+    sz2 = get_assertion_offset(ctx, p2);
     if (sz2 < 0)
     {
 	return -1;
     }
 
-    alt1 = alloc_terminated(p1 + 2, sz1 - 2);
+    mark = arena_mark(ctx);
+    alt1 = alloc_terminated(ctx, p1 + 2, sz1 - 2);
     if (!alt1)
     {
 	return -1;
     }
 
-    alt2 = alloc_terminated(p2 + 2, sz2 - 2);
+    alt2 = alloc_terminated(ctx, p2 + 2, sz2 - 2);
     if (!alt2)
     {
-        free(alt1);
 	return -1;
     }
 
@@ -3722,10 +4322,9 @@ static int compare_positive_assertions(int anchored, Arrow *a1, Arrow *a2)
     right.origin = a2->origin;
     right.rn = alt2;
     right.spent = 0;
-    rv = compare(0, &left, &right);
+    rv = compare(ctx, 0, &left, &right);
 
-    free(alt1);
-    free(alt2);
+    arena_release(ctx, mark);
 
     if (rv <= 0)
     {
@@ -3737,42 +4336,43 @@ static int compare_positive_assertions(int anchored, Arrow *a1, Arrow *a2)
     left.spent = 0;
     right.rn = p2 + sz2;
     right.spent = 0;
-    return compare(anchored, &left, &right);
+    return compare(ctx, anchored, &left, &right);
 }
 
-static int compare_negative_assertions(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_assertions(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *alt1, *p2, *alt2;
     int rv, sz1, sz2;
     Arrow left, right;
+    ArenaMark mark;
 
     p1 = a1->rn;
     p2 = a2->rn;
     assert(p1->type == UNLESSM);
     assert(p2->type == UNLESSM);
 
-    sz1 = get_assertion_offset(p1);
+    sz1 = get_assertion_offset(ctx, p1);
     if (sz1 < 0)
     {
 	return -1;
     }
 
-    sz2 = get_assertion_offset(p2);
+    sz2 = get_assertion_offset(ctx, p2);
     if (sz2 < 0)
     {
 	return -1;
     }
 
-    alt1 = alloc_terminated(p1 + 2, sz1 - 2);
+    mark = arena_mark(ctx);
+    alt1 = alloc_terminated(ctx, p1 + 2, sz1 - 2);
     if (!alt1)
     {
 	return -1;
     }
 
-    alt2 = alloc_terminated(p2 + 2, sz2 - 2);
+    alt2 = alloc_terminated(ctx, p2 + 2, sz2 - 2);
     if (!alt2)
     {
-        free(alt1);
 	return -1;
     }
 
@@ -3782,10 +4382,9 @@ static int compare_negative_assertions(int anchored, Arrow *a1, Arrow *a2)
     right.origin = a2->origin;
     right.rn = alt2;
     right.spent = 0;
-    rv = compare(0, &right, &left);
+    rv = compare(ctx, 0, &right, &left);
 
-    free(alt1);
-    free(alt2);
+    arena_release(ctx, mark);
 
     if (rv <= 0)
     {
@@ -3797,10 +4396,10 @@ static int compare_negative_assertions(int anchored, Arrow *a1, Arrow *a2)
     left.spent = 0;
     right.rn = p2 + sz2;
     right.spent = 0;
-    return compare(anchored, &left, &right);
+    return compare(ctx, anchored, &left, &right);
 }
 
-static int compare_bol(int anchored, Arrow *a1, Arrow *a2)
+static int compare_bol(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     int rv;
 
@@ -3812,15 +4411,15 @@ static int compare_bol(int anchored, Arrow *a1, Arrow *a2)
         return 0;
     }
 
-    if (bump_regular(a1) <= 0)
+    if (bump_regular(ctx, a1) <= 0)
     {
         return -1;
     }
 
-    rv = compare(1, a1, a2);
+    rv = compare(ctx, 1, a1, a2);
     if (!rv)
     {
-	rv = compare_mismatch(0, a1, a2);
+	rv = compare_mismatch(ctx, 0, a1, a2);
     }
 
     return rv;
@@ -3843,41 +4442,155 @@ static unsigned char get_bitmap_byte(regnode *p, int i)
     return loc;
 }
 
-static int compare_bitmaps(int anchored, Arrow *a1, Arrow *a2,
-    unsigned char *b1, unsigned char *b2)
+/* Returns 1 when every bit set in the first n bytes of b1 (negated
+   if inv1 is set) is also set in b2 (negated if inv2 is set). Works
+   a word at a time, so n must be a multiple of sizeof(UV) (bitmaps
+   are 16 or 32 bytes). */
+static int bitmap_subset(const unsigned char *b1, int inv1,
+    const unsigned char *b2, int inv2, int n)
 {
-    unsigned char loc1, loc2;
-    int i, sz;
+    UV w1, w2, m1, m2;
+    int i;
 
-    /* fprintf(stderr, "enter compare_bitmaps(%d, %d, %d)\n", anchored,
-        a1->rn->type, a2->rn->type); */
+    m1 = inv1 ? ~(UV)0 : 0;
+    m2 = inv2 ? ~(UV)0 : 0;
+    for (i = 0; i < n; i += sizeof(UV))
+    {
+	/* memcpy, because the bitmap of a regnode needn't be aligned
+	   for UV */
+	memcpy(&w1, b1 + i, sizeof(UV));
+	memcpy(&w2, b2 + i, sizeof(UV));
+	if ((w1 ^ m1) & ~(w2 ^ m2))
+	{
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/* bitmap_subset for the (possibly inverted) bitmap of an ANYOF node */
+static int anyof_subset(regnode *p, const unsigned char *b2, int inv2, int n)
+{
+    assert(p->type == ANYOF);
+
+    return bitmap_subset((unsigned char *)(p + 2), p->flags & ANYOF_INVERT,
+	b2, inv2, n);
+}
+
+/* Returns 1 when the ANYOF node matches just the byte of bf. */
+static int anyof_single(regnode *p, BitFlag *bf)
+{
+    unsigned char req[ANYOF_BITMAP_SIZE];
+
+    memset(req, 0, sizeof(req));
+    req[bf->offs] = bf->mask;
+    return anyof_subset(p, req, 0, ANYOF_BITMAP_SIZE) &&
+	bitmap_subset(req, 0, (unsigned char *)(p + 2),
+	    p->flags & ANYOF_INVERT, ANYOF_BITMAP_SIZE);
+}
+
+/* Returns 1 when the chars of b1 (or, when b1 is null, of the
+   bitmap of a1) are a subset of those of b2 (or the bitmap of a2). */
+static int bitmaps_subset(Arrow *a1, Arrow *a2,
+    unsigned char *b1, unsigned char *b2)
+{
+    int sz, inv1, inv2;
 
     sz = (((a1->rn->flags & ANYOF_INVERT) &&
 	    (a1->rn->flags & ANYOF_NON_UTF8_LATIN1_ALL)) ||
 	(!(a2->rn->flags & ANYOF_INVERT) &&
 	    (a2->rn->flags & ANYOF_NON_UTF8_LATIN1_ALL))) ? 16
         : ANYOF_BITMAP_SIZE;
-    for (i = 0; i < sz; ++i)
+    inv1 = !b1 && (a1->rn->flags & ANYOF_INVERT);
+    inv2 = !b2 && (a2->rn->flags & ANYOF_INVERT);
+    return bitmap_subset(b1 ? b1 : (unsigned char *)(a1->rn + 2), inv1,
+	b2 ? b2 : (unsigned char *)(a2->rn + 2), inv2, sz);
+}
+
+static int compare_bitmaps(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
+    unsigned char *b1, unsigned char *b2)
+{
+    /* fprintf(stderr, "enter compare_bitmaps(%d, %d, %d)\n", anchored,
+        a1->rn->type, a2->rn->type); */
+
+    if (!bitmaps_subset(a1, a2, b1, b2))
+    {
+	return compare_mismatch(ctx, anchored, a1, a2);
+    }
+
+    return compare_tails(ctx, anchored, a1, a2);
+}
+
+/* Set test of a class comparator: returns 1 when a2 matches every
+   char a1 matches, 0 when it doesn't (or the test can't tell) and
+   -1 on error. Must depend only on what intern_charset keeps of the
+   nodes. */
+typedef int (*FSubset)(RcContext *ctx, Arrow *a1, Arrow *a2);
+
+/* Compares single-char class nodes by subset. Nodes with interned
+   charsets (see index_nodes) are tested once per context; later
+   comparisons of the same charsets just look up the result. */
+static int compare_classes(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
+    FSubset subset)
+{
+    IrNode *ni1, *ni2;
+    SubsetEntry *se;
+    int hit, rv;
+
+    se = 0;
+    hit = 0;
+    ni1 = get_ir_node(ctx, a1->rn);
+    ni2 = get_ir_node(ctx, a2->rn);
+    if (ni1 && ni1->charset && ni2 && ni2->charset)
+    {
+	if (!ctx->state->subsets)
+	{
+	    ctx->state->subsets = (SubsetEntry *)calloc(SUBSET_CACHE_SIZE,
+		sizeof(SubsetEntry));
+	    if (!ctx->state->subsets)
+	    {
+		ctx->error = "Could not allocate memory for class cache";
+		return -1;
+	    }
+	}
+
+	se = ctx->state->subsets +
+	    ((unsigned)(ni1->charset * 40503 + ni2->charset) %
+		SUBSET_CACHE_SIZE);
+	if ((se->charset1 == ni1->charset) &&
+	    (se->charset2 == ni2->charset))
+	{
+	    ++ctx->stats.class_hits;
+	    rv = se->subset;
+	    hit = 1;
+	}
+    }
+
+    if (!hit)
     {
-        loc1 = b1 ? b1[i] : get_bitmap_byte(a1->rn, i); 
-        loc2 = b2 ? b2[i] : get_bitmap_byte(a2->rn, i); 
-	if (loc1 & ~loc2)
+	rv = subset(ctx, a1, a2);
+	if (rv < 0)
+	{
+	    return rv;
+	}
+
+	if (se)
 	{
-	    /* fprintf(stderr, "compare_bitmaps fails at %d: %d does not imply %d\n",
-	        i, loc1, loc2); */
-	    return compare_mismatch(anchored, a1, a2);
-        }
+	    se->charset1 = ni1->charset;
+	    se->charset2 = ni2->charset;
+	    se->subset = rv;
+	}
     }
 
-    return compare_tails(anchored, a1, a2);
+    return rv ? compare_tails(ctx, anchored, a1, a2) :
+	compare_mismatch(ctx, anchored, a1, a2);
 }
 
-static int compare_anyof_multiline(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_multiline(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     BitFlag bf;
     Arrow tail1, tail2;
-    unsigned char req;
-    int i;
 
     /* fprintf(stderr, "enter compare_anyof_multiline\n"); */
 
@@ -3886,39 +4599,35 @@ static int compare_anyof_multiline(int anchored, Arrow *a1, Arrow *a2)
 
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     init_bit_flag(&bf, '\n');
-    for (i = 0; i < ANYOF_BITMAP_SIZE; ++i)
+    if (!anyof_single(a1->rn, &bf))
     {
-        req = (i != bf.offs) ? 0 : bf.mask;
-	if (get_bitmap_byte(a1->rn, i) != req)
-	{
-	    return compare_mismatch(anchored, a1, a2);
-	}
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     tail1 = *a1;
-    if (bump_regular(&tail1) <= 0)
+    if (bump_regular(ctx, &tail1) <= 0)
     {
 	return -1;
     }
 
     tail2 = *a2;
-    if (bump_regular(&tail2) <= 0)
+    if (bump_regular(ctx, &tail2) <= 0)
     {
 	return -1;
     }
 
-    return compare(1, &tail1, &tail2);
+    return compare(ctx, 1, &tail1, &tail2);
 }
 
-static int compare_anyof_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int anyof_anyof_subset(RcContext *ctx, Arrow *a1, Arrow *a2)
 {
     int extra_left;
 
-    /* fprintf(stderr, "enter compare_anyof_anyof(%d\n", anchored); */
+    /* fprintf(stderr, "enter anyof_anyof_subset\n"); */
 
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == ANYOF);
@@ -3930,13 +4639,13 @@ static int compare_anyof_anyof(int anchored, Arrow *a1, Arrow *a2)
         U32 m1, m2;
 	int cr1, cr2;
 
-	cr1 = convert_map(a1, &m1);
+	cr1 = convert_map(ctx, a1, &m1);
 	if (cr1 == -1)
 	{
 	    return -1;
 	}
 
-	cr2 = convert_map(a2, &m2);
+	cr2 = convert_map(ctx, a2, &m2);
 	if (cr2 == -1)
 	{
 	    return -1;
@@ -3954,17 +4663,24 @@ static int compare_anyof_anyof(int anchored, Arrow *a1, Arrow *a2)
 	{
             /* fprintf(stderr, "cr1 = %d, cr2 = %d, m1 = 0x%x, m2 = 0x%x\n",
                 cr1, cr2, (unsigned)m1, (unsigned)m2); */
-            return compare_mismatch(anchored, a1, a2);
+            return 0;
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, 0);
+    return bitmaps_subset(a1, a2, 0, 0);
+}
+
+static int compare_anyof_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
+{
+    /* fprintf(stderr, "enter compare_anyof_anyof(%d\n", anchored); */
+
+    return compare_classes(ctx, anchored, a1, a2, anyof_anyof_subset);
 }
 
 /* compare_bitmaps could replace this method, but when a class
    contains just a few characters, it seems more natural to compare
    them explicitly */
-static int compare_short_byte_class(int anchored, Arrow *a1, Arrow *a2,
+static int compare_short_byte_class(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     ByteClass *left)
 {
     BitFlag bf;
@@ -3975,15 +4691,15 @@ static int compare_short_byte_class(int anchored, Arrow *a1, Arrow *a2,
         init_bit_flag(&bf, (unsigned char)left->expl[i]);
 	if (!(get_bitmap_byte(a2->rn, bf.offs) & bf.mask))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
 #ifndef RC_POSIX_NODES
-static int compare_alnum_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_alnum_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ALNUM);
     assert(a2->rn->type == ANYOF);
@@ -3993,7 +4709,7 @@ static int compare_alnum_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4001,22 +4717,22 @@ static int compare_alnum_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(map & ALNUM_BLOCK))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, word_bc.bitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, word_bc.bitmap, 0);
 }
 
-static int compare_alnuma_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_alnuma_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ALNUMA);
     assert(a2->rn->type == ANYOF);
 
-    return compare_bitmaps(anchored, a1, a2, word_bc.bitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, word_bc.bitmap, 0);
 }
 
-static int compare_nalnum_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_nalnum_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NALNUM);
     assert(a2->rn->type == ANYOF);
@@ -4024,7 +4740,7 @@ static int compare_nalnum_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4032,14 +4748,14 @@ static int compare_nalnum_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(map & NOT_ALNUM_BLOCK))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, word_bc.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, word_bc.nbitmap, 0);
 }
 
-static int compare_nalnuma_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_nalnuma_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NALNUMA);
     assert(a2->rn->type == ANYOF);
@@ -4047,21 +4763,21 @@ static int compare_nalnuma_anyof(int anchored, Arrow *a1, Arrow *a2)
     /* from perlre: all non-ASCII characters match ... "\W" */
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, word_bc.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, word_bc.nbitmap, 0);
 }
 
-static int compare_space_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_space_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == SPACE) || (a1->rn->type == SPACEA));
     assert(a2->rn->type == ANYOF);
 
-    return compare_short_byte_class(anchored, a1, a2,  &whitespace);
+    return compare_short_byte_class(ctx, anchored, a1, a2,  &whitespace);
 }
 
-static int compare_nspace_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_nspace_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NSPACE);
     assert(a2->rn->type == ANYOF);
@@ -4069,7 +4785,7 @@ static int compare_nspace_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4077,14 +4793,14 @@ static int compare_nspace_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(map & NOT_SPACE_BLOCK))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, whitespace.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, whitespace.nbitmap, 0);
 }
 
-static int compare_nspacea_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_nspacea_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NSPACEA);
     assert(a2->rn->type == ANYOF);
@@ -4092,13 +4808,13 @@ static int compare_nspacea_anyof(int anchored, Arrow *a1, Arrow *a2)
     /* from perlre: all non-ASCII characters match ... "\S" */
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, whitespace.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, whitespace.nbitmap, 0);
 }
 
-static int compare_horizontal_space_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_horizontal_space_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == HORIZWS);
     assert(a2->rn->type == ANYOF);
@@ -4106,7 +4822,7 @@ static int compare_horizontal_space_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4115,14 +4831,14 @@ static int compare_horizontal_space_anyof(int anchored, Arrow *a1, Arrow *a2)
 	if (!cr || !(map & HORIZONTAL_SPACE_BLOCK))
 	{
 	    /* fprintf(stderr, "cr = %d, map = 0x%x\n", cr, (unsigned)map); */
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_short_byte_class(anchored, a1, a2,  &horizontal_whitespace);
+    return compare_short_byte_class(ctx, anchored, a1, a2,  &horizontal_whitespace);
 }
 
-static int compare_negative_horizontal_space_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_horizontal_space_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NHORIZWS);
     assert(a2->rn->type == ANYOF);
@@ -4130,7 +4846,7 @@ static int compare_negative_horizontal_space_anyof(int anchored, Arrow *a1, Arro
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4139,14 +4855,14 @@ static int compare_negative_horizontal_space_anyof(int anchored, Arrow *a1, Arro
 	if (!cr || !(map & NOT_HORIZONTAL_SPACE_BLOCK))
 	{
 	    /* fprintf(stderr, "cr = %d, map = 0x%x\n", cr, (unsigned)map); */
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, horizontal_whitespace.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, horizontal_whitespace.nbitmap, 0);
 }
 
-static int compare_vertical_space_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_vertical_space_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == VERTWS);
     assert(a2->rn->type == ANYOF);
@@ -4154,7 +4870,7 @@ static int compare_vertical_space_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4163,14 +4879,14 @@ static int compare_vertical_space_anyof(int anchored, Arrow *a1, Arrow *a2)
 	if (!cr || !(map & VERTICAL_SPACE_BLOCK))
 	{
 	    /* fprintf(stderr, "cr = %d, map = 0x%x\n", cr, (unsigned)map); */
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_short_byte_class(anchored, a1, a2,  &vertical_whitespace);
+    return compare_short_byte_class(ctx, anchored, a1, a2,  &vertical_whitespace);
 }
 
-static int compare_negative_vertical_space_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_vertical_space_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NVERTWS);
     assert(a2->rn->type == ANYOF);
@@ -4178,7 +4894,7 @@ static int compare_negative_vertical_space_anyof(int anchored, Arrow *a1, Arrow
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4187,14 +4903,14 @@ static int compare_negative_vertical_space_anyof(int anchored, Arrow *a1, Arrow
 	if (!cr || !(map & NOT_VERTICAL_SPACE_BLOCK))
 	{
 	    /* fprintf(stderr, "cr = %d, map = 0x%x\n", cr, (unsigned)map); */
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, vertical_whitespace.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, vertical_whitespace.nbitmap, 0);
 }
 #else
-static int compare_posix_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_posix_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     U32 m1, m2;
     int cr1, cr2;
@@ -4205,13 +4921,13 @@ static int compare_posix_posix(int anchored, Arrow *a1, Arrow *a2)
     cr2 = convert_class(a2, &m2);
     if (!cr1 || !cr2 || (m1 & ~m2))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_posix_negative_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_posix_negative_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     U32 m1, m2;
     int cr1, cr2;
@@ -4222,7 +4938,7 @@ static int compare_posix_negative_posix(int anchored, Arrow *a1, Arrow *a2)
     cr2 = convert_class(a2, &m2);
     if (!cr1 || !cr2)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     /* vertical space is not a strict subset of space, but it does
@@ -4234,13 +4950,13 @@ static int compare_posix_negative_posix(int anchored, Arrow *a1, Arrow *a2)
 
     if (m1 & m2)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_negative_posix_negative_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_posix_negative_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     U32 m1, m2;
     int cr1, cr2;
@@ -4256,13 +4972,13 @@ static int compare_negative_posix_negative_posix(int anchored, Arrow *a1, Arrow
     cr2 = convert_negative_class(a2, &m2);
     if (!cr2 || !cr2 || (m1 & ~m2))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exact_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
 
@@ -4275,13 +4991,13 @@ static int compare_exact_posix(int anchored, Arrow *a1, Arrow *a2)
 
     if (!_generic_isCC_A(*seq, a2->rn->flags))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exactf_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exactf_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
     char unf[2];
@@ -4297,14 +5013,14 @@ static int compare_exactf_posix(int anchored, Arrow *a1, Arrow *a2)
     {
 	if (!_generic_isCC_A(unf[i], a2->rn->flags))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exact_negative_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_negative_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
 
@@ -4316,13 +5032,13 @@ static int compare_exact_negative_posix(int anchored, Arrow *a1, Arrow *a2)
 
     if (_generic_isCC_A(*seq, a2->rn->flags))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exactf_negative_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exactf_negative_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
     char unf[2];
@@ -4339,24 +5055,24 @@ static int compare_exactf_negative_posix(int anchored, Arrow *a1, Arrow *a2)
     {
 	if (_generic_isCC_A(unf[i], a2->rn->flags))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 #endif
 
-static int compare_reg_any_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_reg_any_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == REG_ANY);
     assert(a2->rn->type == ANYOF);
 
-    return compare_bitmaps(anchored, a1, a2, ndot.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, ndot.nbitmap, 0);
 }
 
 #ifndef RC_POSIX_NODES
-static int compare_digit_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_digit_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     /* fprintf(stderr, "enter compare_digit_anyof\n"); */
 
@@ -4368,7 +5084,7 @@ static int compare_digit_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4376,14 +5092,14 @@ static int compare_digit_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(map & NUMBER_BLOCK))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, digit.bitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, digit.bitmap, 0);
 }
 
-static int compare_ndigit_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_ndigit_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NDIGIT);
     assert(a2->rn->type == ANYOF);
@@ -4391,7 +5107,7 @@ static int compare_ndigit_anyof(int anchored, Arrow *a1, Arrow *a2)
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
         U32 map;
-	int cr = convert_map(a2, &map);
+	int cr = convert_map(ctx, a2, &map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4399,14 +5115,14 @@ static int compare_ndigit_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(map & NOT_NUMBER_BLOCK))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, digit.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, digit.nbitmap, 0);
 }
 
-static int compare_ndigita_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_ndigita_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == NDIGITA);
     assert(a2->rn->type == ANYOF);
@@ -4414,18 +5130,18 @@ static int compare_ndigita_anyof(int anchored, Arrow *a1, Arrow *a2)
     /* from perlre: all non-ASCII characters match "\D"	*/
     if (!(a2->rn->flags & ANYOF_UNICODE_ALL))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, digit.nbitmap, 0);
+    return compare_bitmaps(ctx, anchored, a1, a2, digit.nbitmap, 0);
 }
 #else
-static int compare_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int posix_anyof_subset(RcContext *ctx, Arrow *a1, Arrow *a2)
 {
     U32 left_block;
     unsigned char *b;
 
-    /* fprintf(stderr, "enter compare_posix_anyof\n"); */
+    /* fprintf(stderr, "enter posix_anyof_subset\n"); */
 
     assert((a1->rn->type == POSIXD) || (a1->rn->type == POSIXU) ||
 	(a1->rn->type == POSIXA));
@@ -4433,7 +5149,7 @@ static int compare_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
 
     if (!convert_class_narrow(a1, &left_block))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
     /* fprintf(stderr, "right flags = %d\n", a2->rn->flags); */
@@ -4445,10 +5161,10 @@ static int compare_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
 	/* apparently a special case... */
 	if (a2->rn->flags & ANYOF_INVERT)
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return 0;
 	}
 
-	int cr = convert_map(a2, &right_map);
+	int cr = convert_map(ctx, a2, &right_map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4456,30 +5172,37 @@ static int compare_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(right_map & left_block))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return 0;
 	}
     }
 
     if (a1->rn->flags >= SIZEOF_ARRAY(posix_regclass_bitmaps))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
     b = posix_regclass_bitmaps[a1->rn->flags];
     if (!b)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
-    return compare_bitmaps(anchored, a1, a2, b, 0);
+    return bitmaps_subset(a1, a2, b, 0);
+}
+
+static int compare_posix_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
+{
+    /* fprintf(stderr, "enter compare_posix_anyof\n"); */
+
+    return compare_classes(ctx, anchored, a1, a2, posix_anyof_subset);
 }
 
-static int compare_negative_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int negative_posix_anyof_subset(RcContext *ctx, Arrow *a1, Arrow *a2)
 {
     U32 left_block;
     unsigned char *b;
 
-    /* fprintf(stderr, "enter compare_negative_posix_anyof\n"); */
+    /* fprintf(stderr, "enter negative_posix_anyof_subset\n"); */
 
     assert((a1->rn->type == NPOSIXD) || (a1->rn->type == NPOSIXU) ||
         (a1->rn->type == NPOSIXA));
@@ -4487,7 +5210,7 @@ static int compare_negative_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
 
     if (!convert_class_narrow(a1, &left_block))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
     left_block = EVERY_BLOCK & ~left_block;
@@ -4498,13 +5221,13 @@ static int compare_negative_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
     {
         U32 right_map;
 
-	/* analogically with compare_posix_anyof but untested */
+	/* analogically with posix_anyof_subset but untested */
 	if (a2->rn->flags & ANYOF_INVERT)
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return 0;
 	}
 
-	int cr = convert_map(a2, &right_map);
+	int cr = convert_map(ctx, a2, &right_map);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4514,26 +5237,34 @@ static int compare_negative_posix_anyof(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!cr || !(right_map & left_block))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return 0;
 	}
     }
 
     if (a1->rn->flags >= SIZEOF_ARRAY(posix_regclass_bitmaps))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
     b = posix_regclass_nbitmaps[a1->rn->flags];
     if (!b)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return 0;
     }
 
-    return compare_bitmaps(anchored, a1, a2, b, 0);
+    return bitmaps_subset(a1, a2, b, 0);
+}
+
+static int compare_negative_posix_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
+{
+    /* fprintf(stderr, "enter compare_negative_posix_anyof\n"); */
+
+    return compare_classes(ctx, anchored, a1, a2,
+	negative_posix_anyof_subset);
 }
 #endif
 
-static int compare_exact_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     BitFlag bf;
     char *seq;
@@ -4548,13 +5279,13 @@ static int compare_exact_anyof(int anchored, Arrow *a1, Arrow *a2)
 
     if (!(get_bitmap_byte(a2->rn, bf.offs) & bf.mask))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exactf_anyof(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exactf_anyof(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     BitFlag bf;
     char *seq;
@@ -4574,14 +5305,14 @@ static int compare_exactf_anyof(int anchored, Arrow *a1, Arrow *a2)
         init_bit_flag(&bf, (unsigned char)unf[i]);
 	if (!(get_bitmap_byte(a2->rn, bf.offs) & bf.mask))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exact_byte_class(int anchored, Arrow *a1, Arrow *a2,
+static int compare_exact_byte_class(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     char *lookup)
 {
     char *seq;
@@ -4592,140 +5323,140 @@ static int compare_exact_byte_class(int anchored, Arrow *a1, Arrow *a2,
 
     if (!lookup[(unsigned char)(*seq)])
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exact_multiline(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_multiline(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF) ||
 	(a1->rn->type == EXACTFU));
     assert((a2->rn->type == MBOL) || (a2->rn->type == MEOL));
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         ndot.lookup);
 }
 
 #ifndef RC_POSIX_NODES
-static int compare_exact_alnum(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_alnum(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == ALNUM) || (a2->rn->type == ALNUMA));
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         word_bc.lookup);
 }
 
-static int compare_exact_nalnum(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_nalnum(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == NALNUM) || (a2->rn->type == NALNUMA));
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         word_bc.nlookup);
 }
 
-static int compare_exact_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == SPACE) || (a2->rn->type == SPACEA));
 
-    return compare_exact_byte_class(anchored, a1, a2, whitespace.lookup);
+    return compare_exact_byte_class(ctx, anchored, a1, a2, whitespace.lookup);
 }
 
-static int compare_exact_nspace(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_nspace(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == NSPACE) || (a2->rn->type == NSPACEA));
 
-    return compare_exact_byte_class(anchored, a1, a2, whitespace.nlookup);
+    return compare_exact_byte_class(ctx, anchored, a1, a2, whitespace.nlookup);
 }
 
-static int compare_exact_horizontal_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_horizontal_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert(a2->rn->type == HORIZWS);
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         horizontal_whitespace.lookup);
 }
 
-static int compare_exact_negative_horizontal_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_negative_horizontal_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert(a2->rn->type == NHORIZWS);
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         horizontal_whitespace.nlookup);
 }
 
-static int compare_exact_vertical_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_vertical_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert(a2->rn->type == VERTWS);
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         vertical_whitespace.lookup);
 }
 
-static int compare_exact_negative_vertical_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_negative_vertical_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert(a2->rn->type == NVERTWS);
 
-    return compare_exact_byte_class(anchored, a1, a2,
+    return compare_exact_byte_class(ctx, anchored, a1, a2,
         vertical_whitespace.nlookup);
 }
 
-static int compare_exact_digit(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_digit(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == DIGIT) || (a2->rn->type == DIGITA));
 
-    return compare_exact_byte_class(anchored, a1, a2, digit.lookup);
+    return compare_exact_byte_class(ctx, anchored, a1, a2, digit.lookup);
 }
 
-static int compare_exact_ndigit(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_ndigit(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF));
     assert((a2->rn->type == NDIGIT) || (a2->rn->type == NDIGITA));
 
-    return compare_exact_byte_class(anchored, a1, a2, digit.nlookup);
+    return compare_exact_byte_class(ctx, anchored, a1, a2, digit.nlookup);
 }
 #endif
 
-static int compare_anyof_reg_any(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_reg_any(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == REG_ANY);
 
-    return compare_bitmaps(anchored, a1, a2, 0, ndot.nbitmap);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, ndot.nbitmap);
 }
 
-static int compare_exact_reg_any(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_reg_any(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == EXACT) || (a1->rn->type == EXACTF) || (a1->rn->type == EXACTFU));
     assert(a2->rn->type == REG_ANY);
 
-    return compare_exact_byte_class(anchored, a1, a2, ndot.nlookup);
+    return compare_exact_byte_class(ctx, anchored, a1, a2, ndot.nlookup);
 }
 
 #ifndef RC_POSIX_NODES
-static int compare_anyof_class(int anchored, Arrow *a1, Arrow *a2,
+static int compare_anyof_class(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     U32 acceptable_mask, unsigned char *required_bitmap)
 {
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     if (ANYOF_NONBITMAP(a1->rn))
     {
         U32 m;
 
-	int cr = convert_map(a1, &m);
+	int cr = convert_map(ctx, a1, &m);
 	if (cr == -1)
 	{
 	    return -1;
@@ -4734,160 +5465,160 @@ static int compare_anyof_class(int anchored, Arrow *a1, Arrow *a2,
 	/* fprintf(stderr, "m = 0x%x\n", (unsigned)m); */
 	if (!cr || (m & ~acceptable_mask))
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, required_bitmap);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, required_bitmap);
 }
 
-static int compare_anyof_ascii_class(int anchored, Arrow *a1, Arrow *a2,
+static int compare_anyof_ascii_class(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     unsigned char *required_bitmap)
 {
     if (ANYOF_NONBITMAP(a1->rn))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, required_bitmap);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, required_bitmap);
 }
 
-static int compare_anyof_alnum(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_alnum(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == ALNUM);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	ALNUM_BLOCK | ALPHA_BLOCK | NUMBER_BLOCK | UPPER_BLOCK | 
 	    LOWER_BLOCK | HEX_DIGIT_BLOCK,
 	word_bc.bitmap);
 }
 
-static int compare_anyof_alnuma(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_alnuma(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == ALNUMA);
 
-    return compare_anyof_ascii_class(anchored, a1, a2,
+    return compare_anyof_ascii_class(ctx, anchored, a1, a2,
 	word_bc.bitmap);
 }
 
-static int compare_anyof_nalnum(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_nalnum(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert((a2->rn->type == NALNUM) || (a2->rn->type == NALNUMA));
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	SPACE_BLOCK | HORIZONTAL_SPACE_BLOCK | NOT_ALNUM_BLOCK,
 	word_bc.nbitmap);
 }
 
-static int compare_anyof_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == SPACE);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	SPACE_BLOCK | HORIZONTAL_SPACE_BLOCK,
 	whitespace.bitmap);
 }
 
-static int compare_anyof_spacea(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_spacea(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == SPACEA);
 
-    return compare_anyof_ascii_class(anchored, a1, a2,
+    return compare_anyof_ascii_class(ctx, anchored, a1, a2,
 	whitespace.bitmap);
 }
 
-static int compare_anyof_nspace(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_nspace(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert((a2->rn->type == NSPACE) || (a2->rn->type == NSPACEA));
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	ALNUM_BLOCK | ALPHA_BLOCK | NUMBER_BLOCK | UPPER_BLOCK |
 	    LOWER_BLOCK | HEX_DIGIT_BLOCK | NOT_HORIZONTAL_SPACE_BLOCK |
 	    NOT_SPACE_BLOCK,
 	whitespace.nbitmap);
 }
 
-static int compare_anyof_horizontal_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_horizontal_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == HORIZWS);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	HORIZONTAL_SPACE_BLOCK,
 	horizontal_whitespace.bitmap);
 }
 
-static int compare_anyof_negative_horizontal_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_negative_horizontal_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == NHORIZWS);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	ALNUM_BLOCK | ALPHA_BLOCK | NUMBER_BLOCK | UPPER_BLOCK |
 	    LOWER_BLOCK | HEX_DIGIT_BLOCK | NOT_HORIZONTAL_SPACE_BLOCK |
 	    NOT_SPACE_BLOCK,
 	horizontal_whitespace.nbitmap);
 }
 
-static int compare_anyof_vertical_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_vertical_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == VERTWS);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	VERTICAL_SPACE_BLOCK,
 	vertical_whitespace.bitmap);
 }
 
-static int compare_anyof_negative_vertical_space(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_negative_vertical_space(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == NVERTWS);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	ALNUM_BLOCK | ALPHA_BLOCK | NUMBER_BLOCK | UPPER_BLOCK |
 	    LOWER_BLOCK | HEX_DIGIT_BLOCK | NOT_VERTICAL_SPACE_BLOCK |
 	    NOT_SPACE_BLOCK,
 	vertical_whitespace.nbitmap);
 }
 
-static int compare_anyof_digit(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_digit(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == DIGIT);
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	NUMBER_BLOCK,
 	digit.bitmap);
 }
 
-static int compare_anyof_digita(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_digita(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == DIGITA);
 
-    return compare_anyof_ascii_class(anchored, a1, a2,
+    return compare_anyof_ascii_class(ctx, anchored, a1, a2,
 	digit.bitmap);
 }
 
-static int compare_anyof_ndigit(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_ndigit(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert((a2->rn->type == NDIGIT) || (a2->rn->type == NDIGITA));
 
-    return compare_anyof_class(anchored, a1, a2,
+    return compare_anyof_class(ctx, anchored, a1, a2,
 	SPACE_BLOCK | HORIZONTAL_SPACE_BLOCK | VERTICAL_SPACE_BLOCK |
 	NOT_ALNUM_BLOCK | NOT_NUMBER_BLOCK | NOT_HEX_DIGIT_BLOCK,
 	digit.nbitmap);
 }
 #else
-static int compare_anyof_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     unsigned char *b;
 
@@ -4899,20 +5630,20 @@ static int compare_anyof_posix(int anchored, Arrow *a1, Arrow *a2)
     if (a2->rn->flags >= SIZEOF_ARRAY(posix_regclass_bitmaps))
     {
         /* fprintf(stderr, "flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     b = posix_regclass_bitmaps[a2->rn->flags];
     if (!b)
     {
         /* fprintf(stderr, "no bitmap for flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, b);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, b);
 }
 
-static int compare_anyof_posixa(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_posixa(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     unsigned char *b;
 
@@ -4923,26 +5654,26 @@ static int compare_anyof_posixa(int anchored, Arrow *a1, Arrow *a2)
 
     if (ANYOF_NONBITMAP(a1->rn))
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     if (a2->rn->flags >= SIZEOF_ARRAY(posix_regclass_bitmaps))
     {
         /* fprintf(stderr, "flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     b = posix_regclass_bitmaps[a2->rn->flags];
     if (!b)
     {
         /* fprintf(stderr, "no bitmap for flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, b);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, b);
 }
 
-static int compare_anyof_negative_posix(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_negative_posix(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     unsigned char *b;
 
@@ -4955,20 +5686,20 @@ static int compare_anyof_negative_posix(int anchored, Arrow *a1, Arrow *a2)
     if (a2->rn->flags >= SIZEOF_ARRAY(posix_regclass_nbitmaps))
     {
         /* fprintf(stderr, "flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     b = posix_regclass_nbitmaps[a2->rn->flags];
     if (!b)
     {
         /* fprintf(stderr, "no negative bitmap for flags = %d\n", a2->rn->flags); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, b);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, b);
 }
 
-static int compare_posix_reg_any(int anchored, Arrow *a1, Arrow *a2)
+static int compare_posix_reg_any(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == POSIXD) || (a1->rn->type == POSIXU) ||
 	(a1->rn->type == POSIXA));
@@ -4978,19 +5709,19 @@ static int compare_posix_reg_any(int anchored, Arrow *a1, Arrow *a2)
     if (flags >= SIZEOF_ARRAY(newline_posix_regclasses))
     {
         /* fprintf(stderr, "unknown POSIX character class %d\n", flags); */
-        rc_error = "unknown POSIX character class";
+        ctx->error = "unknown POSIX character class";
         return -1;
     }
 
     if (newline_posix_regclasses[flags])
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_negative_posix_reg_any(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_posix_reg_any(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == NPOSIXD) || (a1->rn->type == NPOSIXU) ||
         (a1->rn->type == NPOSIXA));
@@ -4999,50 +5730,43 @@ static int compare_negative_posix_reg_any(int anchored, Arrow *a1, Arrow *a2)
     U8 flags = a1->rn->flags;
     if (flags >= SIZEOF_ARRAY(newline_posix_regclasses))
     {
-        rc_error = "unknown negative POSIX character class";
+        ctx->error = "unknown negative POSIX character class";
         return -1;
     }
 
     if (!newline_posix_regclasses[flags])
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 #endif
 
-static int compare_anyof_exact(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_exact(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     BitFlag bf;
     char *seq;
-    int i;
-    unsigned char req;
 
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == EXACT);
 
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     seq = GET_LITERAL(a2);
     init_bit_flag(&bf, *((unsigned char *)seq));
-
-    for (i = 0; i < ANYOF_BITMAP_SIZE; ++i)
+    if (!anyof_single(a1->rn, &bf))
     {
-        req = (i != bf.offs) ? 0 : bf.mask;
-	if (get_bitmap_byte(a1->rn, i) != req)
-	{
-	    return compare_mismatch(anchored, a1, a2);
-	}
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_anyof_exactf(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_exactf(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
     char unf[2];
@@ -5055,7 +5779,7 @@ static int compare_anyof_exactf(int anchored, Arrow *a1, Arrow *a2)
 
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     seq = GET_LITERAL(a2);
@@ -5077,31 +5801,50 @@ static int compare_anyof_exactf(int anchored, Arrow *a1, Arrow *a2)
         right[bf[i].offs] = bf[i].mask;
     }
 
-    return compare_bitmaps(anchored, a1, a2, 0, right);
+    return compare_bitmaps(ctx, anchored, a1, a2, 0, right);
 }
 
-static int compare_exact_exact(int anchored, Arrow *a1, Arrow *a2)
+/* Matches the common run of both literals at once: a char-by-char
+   comparison would continue anchored after each matched char, so
+   a mismatch anywhere in the run means the same as one at its
+   start. */
+static int compare_exact_exact(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *q1, *q2;
+    int n1, n2, i;
+    Arrow left, right;
 
     assert(a1->rn->type == EXACT);
     assert(a2->rn->type == EXACT);
 
-    q1 = GET_LITERAL(a1);
-    q2 = GET_LITERAL(a2);
+    q1 = get_literal(ctx, a1, &n1);
+    q2 = get_literal(ctx, a2, &n2);
 
     /* fprintf(stderr, "compare_exact_exact(%d, '%c', '%c')\n", anchored,
      *q1, *q2); */
 
-    if (*q1 != *q2)
+    if (n2 < n1)
+    {
+	n1 = n2;
+    }
+
+    for (i = 0; (i < n1) && (q1[i] == q2[i]); ++i)
+    {
+    }
+
+    if (!i || (i < n1))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    left = *a1;
+    left.spent += i - 1;
+    right = *a2;
+    right.spent += i - 1;
+    return compare_tails(ctx, anchored, &left, &right);
 }
 
-static int compare_exact_exactf(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_exactf(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *q1, *q2;
     char unf[2];
@@ -5115,13 +5858,13 @@ static int compare_exact_exactf(int anchored, Arrow *a1, Arrow *a2)
 
     if ((*q1 != unf[0]) && (*q1 != unf[1]))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exactf_exact(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exactf_exact(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *q1, *q2;
     char unf[2];
@@ -5135,13 +5878,13 @@ static int compare_exactf_exact(int anchored, Arrow *a1, Arrow *a2)
 
     if ((unf[0] != *q2) || (unf[1] != *q2))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_exactf_exactf(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exactf_exactf(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *q1, *q2;
     char l1, l2;
@@ -5157,13 +5900,13 @@ static int compare_exactf_exactf(int anchored, Arrow *a1, Arrow *a2)
 
     if (l1 != l2)
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_left_branch(int anchored, Arrow *a1, Arrow *a2)
+static int compare_left_branch(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     int rv, tsz;
     regnode *p1;
@@ -5181,7 +5924,7 @@ static int compare_left_branch(int anchored, Arrow *a1, Arrow *a2)
     {
         if (p1->next_off == 0)
 	{
-	    rc_error = "Branch with zero offset";
+	    ctx->error = "Branch with zero offset";
 	    return -1;
 	}
 
@@ -5191,7 +5934,7 @@ static int compare_left_branch(int anchored, Arrow *a1, Arrow *a2)
 	right.rn = a2->rn;
 	right.spent = a2->spent;
 
-	rv = compare(anchored, &left, &right);
+	rv = compare(ctx, anchored, &left, &right);
 	/* fprintf(stderr, "rv = %d\n", rv); */
 
 	if (rv < 0)
@@ -5202,16 +5945,41 @@ static int compare_left_branch(int anchored, Arrow *a1, Arrow *a2)
 	if (!rv)
 	{
   	    /* fprintf(stderr, "compare_left_branch doesn't match\n"); */
-	    return compare_mismatch(anchored, a1, a2);
+	    break;
 	}
 
 	p1 += p1->next_off;
     }
 
+    if (p1->type == BRANCH)
+    {
+        if (anchored)
+	{
+	    return 0;
+	}
+
+	/* skipping the branch must skip the whole alternation -
+	   compare_mismatch would only move to the next alternative */
+	while (p1->type == BRANCH)
+	{
+	    if (p1->next_off == 0)
+	    {
+		ctx->error = "Branch with zero offset";
+		return -1;
+	    }
+
+	    p1 += p1->next_off;
+	}
+
+	a1->rn = p1;
+	a1->spent = 0;
+	return RC_SKIP;
+    }
+
     a1->rn = p1;
     a1->spent = 0;
 
-    tsz = get_size(a2->rn);
+    tsz = get_size(ctx, a2->rn);
     if (tsz <= 0)
     {
 	return -1;
@@ -5223,11 +5991,12 @@ static int compare_left_branch(int anchored, Arrow *a1, Arrow *a2)
     return 1;
 }
 
-static int compare_anyof_branch(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_branch(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *alt, *t1;
     Arrow left, right;
     int i, j, power, rv, sz, offs;
+    ArenaMark mark;
 
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == BRANCH);
@@ -5239,16 +6008,16 @@ static int compare_anyof_branch(int anchored, Arrow *a1, Arrow *a2)
     }
 
     t1 = a1->rn + offs;
-    sz = get_size(t1);
+    sz = get_size(ctx, t1);
     if (sz < 0)
     {
 	return sz;
     }
 
-    alt = (regnode *)malloc(sizeof(regnode) * (2 + sz));
+    mark = arena_mark(ctx);
+    alt = alloc_nodes(ctx, 2 + sz);
     if (!alt)
     {
-        rc_error = "Couldn't allocate memory for alternative copy";
 	return -1;
     }
 
@@ -5275,17 +6044,17 @@ static int compare_anyof_branch(int anchored, Arrow *a1, Arrow *a2)
 		right.rn = a2->rn;
 		right.spent = a2->spent;
 
-		rv = compare_right_branch(anchored, &left, &right);
+		rv = resume_skip(ctx, compare_right_branch(ctx, anchored, &left, &right),
+		    &left, &right);
 		if (rv < 0)
 		{
-		    free(alt);
 		    return rv;
 		}
 
 		if (!rv)
 		{
-		    free(alt);
-		    return compare_mismatch(anchored, a1, a2);
+		    arena_release(ctx, mark);
+		    return compare_mismatch(ctx, anchored, a1, a2);
 		}
 	    }
 
@@ -5293,11 +6062,11 @@ static int compare_anyof_branch(int anchored, Arrow *a1, Arrow *a2)
 	}
     }
 
-    free(alt);
+    arena_release(ctx, mark);
 
     if (!right.rn)
     {
-	rc_error = "Empty mask not supported";
+	ctx->error = "Empty mask not supported";
 	return -1;
     }
 
@@ -5311,7 +6080,7 @@ static int compare_anyof_branch(int anchored, Arrow *a1, Arrow *a2)
     return 1;
 }
 
-static int compare_right_branch(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_branch(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     int rv;
     regnode *p2;
@@ -5335,14 +6104,14 @@ static int compare_right_branch(int anchored, Arrow *a1, Arrow *a2)
 
         if (p2->next_off == 0)
 	{
-	    rc_error = "Branch with offset zero";
+	    ctx->error = "Branch with offset zero";
 	    return -1;
 	}
 
 	right.rn = p2 + 1;
 	right.spent = 0;
 
-	rv = compare(anchored, &left, &right);
+	rv = compare(ctx, anchored, &left, &right);
 	/* fprintf(stderr, "got %d\n", rv); */
 
 	p2 += p2->next_off;
@@ -5355,7 +6124,7 @@ static int compare_right_branch(int anchored, Arrow *a1, Arrow *a2)
 
     if (!rv)
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     a1->rn = left.rn;
@@ -5367,7 +6136,7 @@ static int compare_right_branch(int anchored, Arrow *a1, Arrow *a2)
     return 1;
 }
 
-static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_star(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p2;
     Arrow left, right;
@@ -5378,7 +6147,7 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
     p2 = a2->rn;
     assert(p2->type == STAR);
 
-    sz = get_size(p2);
+    sz = get_size(ctx, p2);
     if (sz < 0)
     {
 	return sz;
@@ -5398,7 +6167,7 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + offs;
     right.spent = 0;
 
-    rv = compare(anchored, &left, &right);
+    rv = compare(ctx, anchored, &left, &right);
     if (rv < 0)
     {
 	return rv;
@@ -5409,7 +6178,7 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
 	right.rn = p2 + 1;
 	right.spent = 0;
 
-	rv = compare(anchored, a1, &right);
+	rv = compare(ctx, anchored, a1, &right);
 	if (rv < 0)
 	{
 	    return rv;
@@ -5417,7 +6186,7 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!rv)
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
 
 	right.rn = p2;
@@ -5425,7 +6194,7 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
 
 	if (!anchored)
 	{
-	    rv = compare_right_star(1, a1, &right);
+	    rv = resume_skip(ctx, compare_right_star(ctx, 1, a1, &right), a1, &right);
 	}
     }
 
@@ -5441,28 +6210,49 @@ static int compare_right_star(int anchored, Arrow *a1, Arrow *a2)
     return rv;
 }
 
-static int compare_plus_plus(int anchored, Arrow *a1, Arrow *a2)
+static int compare_plus_plus(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2;
     Arrow left, right;
+    int rv;
+    ArenaMark mark;
 
     p1 = a1->rn;
     assert(p1->type == PLUS);
     p2 = a2->rn;
     assert(p2->type == PLUS);
 
+    if ((p1[1].type >= REGNODE_MAX) || (p2[1].type >= REGNODE_MAX) ||
+	!dispatch[p1[1].type][p2[1].type])
+    {
+	/* compare wouldn't get past them either */
+	return 0;
+    }
+
+    /* the repeated nodes continue physically with whatever follows
+       the repeat - for a repeat ending an alternative, that's the
+       next alternative rather than its tail - so they're compared
+       as terminated copies, followed by the real tails */
+    mark = arena_mark(ctx);
     left.origin = a1->origin;
-    left.rn = p1 + 1;
+    left.rn = alloc_body(ctx, p1 + 1);
     left.spent = 0;
 
     right.origin = a2->origin;
-    right.rn = p2 + 1;
+    right.rn = alloc_body(ctx, p2 + 1);
     right.spent = 0;
 
-    return compare(1, &left, &right);
+    rv = (left.rn && right.rn) ? compare(ctx, 1, &left, &right) : -1;
+    arena_release(ctx, mark);
+    if (rv <= 0)
+    {
+	return rv;
+    }
+
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_repeat_star(int anchored, Arrow *a1, Arrow *a2)
+static int compare_repeat_star(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2;
     Arrow left, right;
@@ -5483,7 +6273,7 @@ static int compare_repeat_star(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + 1;
     right.spent = 0;
 
-    rv = compare(1, &left, &right);
+    rv = compare(ctx, 1, &left, &right);
     /* fprintf(stderr, "inclusive compare returned %d\n", rv); */
     if (rv)
     {
@@ -5500,26 +6290,28 @@ static int compare_repeat_star(int anchored, Arrow *a1, Arrow *a2)
     right.origin = a2->origin;
     right.rn = p2 + offs;
     right.spent = 0;
-    return compare(1, &left, &right);
+    return compare(ctx, 1, &left, &right);
 }
 
-static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_curly_from_zero(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p2, *alt;
-    short n, *cnt;
+    short n, counts[2], *cnt;
     Arrow left, right;
     int sz, rv, offs;
+    ArenaMark mark;
 
     p2 = a2->rn;
 
-    n = ((short *)(p2 + 1))[1];
+    get_counts(ctx, p2, counts);
+    n = counts[1];
     if (n <= 0)
     {
-	rc_error = "Curly must have positive maximum";
+	ctx->error = "Curly must have positive maximum";
 	return -1;
     }
 
-    sz = get_size(p2);
+    sz = get_size(ctx, p2);
     if (sz < 0)
     {
 	return sz;
@@ -5539,7 +6331,7 @@ static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + offs;
     right.spent = 0;
 
-    rv = compare(anchored, &left, &right);
+    rv = compare(ctx, anchored, &left, &right);
     if (rv < 0)
     {
 	return rv;
@@ -5547,7 +6339,8 @@ static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
 
     if (rv == 0)
     {
-        alt = alloc_alt(p2, sz);
+        mark = arena_mark(ctx);
+        alt = alloc_alt(ctx, p2, sz);
 	if (!alt)
 	{
 	    return -1;
@@ -5556,17 +6349,16 @@ static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
 	right.rn = alt + 2;
 	right.spent = 0;
 
-	rv = compare(anchored, a1, &right);
+	rv = compare(ctx, anchored, a1, &right);
 	if (rv < 0)
 	{
-	    free(alt);
 	    return rv;
 	}
 
 	if (!rv)
 	{
-	    free(alt);
-	    return compare_mismatch(anchored, a1, a2);
+	    arena_release(ctx, mark);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
 
 	cnt = (short *)(alt + 1);
@@ -5580,14 +6372,15 @@ static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
 	    right.rn = alt;
 	    right.spent = 0;
 
-	    rv = compare_right_curly_from_zero(1, a1, &right);
+	    rv = resume_skip(ctx, compare_right_curly_from_zero(ctx, 1, a1, &right),
+		a1, &right);
 	}
 	else
 	{
   	    rv = 1;
 	}
 
-	free(alt);
+	arena_release(ctx, mark);
     }
 
     if (rv <= 0)
@@ -5602,17 +6395,18 @@ static int compare_right_curly_from_zero(int anchored, Arrow *a1, Arrow *a2)
     return rv;
 }
 
-static int compare_left_plus(int anchored, Arrow *a1, Arrow *a2)
+static int compare_left_plus(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *alt, *q;
     Arrow left, right;
     int sz, rv, offs, end_offs;
     unsigned char orig_type;
+    ArenaMark mark;
 
     p1 = a1->rn;
     assert(p1->type == PLUS);
 
-    sz = get_size(p1);
+    sz = get_size(ctx, p1);
     if (sz < 0)
     {
 	return -1;
@@ -5620,11 +6414,12 @@ static int compare_left_plus(int anchored, Arrow *a1, Arrow *a2)
 
     if (sz < 2)
     {
-	rc_error = "Left plus offset too small";
+	ctx->error = "Left plus offset too small";
 	return -1;
     }
 
-    alt = alloc_alt(p1 + 1, sz - 1);
+    mark = arena_mark(ctx);
+    alt = alloc_alt(ctx, p1 + 1, sz - 1);
     if (!alt)
     {
 	return -1;
@@ -5632,7 +6427,7 @@ static int compare_left_plus(int anchored, Arrow *a1, Arrow *a2)
 
     if (anchored)
     {
-	offs = get_jump_offset(p1);
+	offs = get_jump_offset(ctx, p1);
 	if (offs <= 0)
 	{
 	    return -1;
@@ -5658,11 +6453,11 @@ static int compare_left_plus(int anchored, Arrow *a1, Arrow *a2)
 
 	    /* fprintf(stderr, "comparing %d to %d\n", left.rn->type,
 	       right.rn->type); */
-	    rv = compare(1, &left, &right);
+	    rv = compare(ctx, 1, &left, &right);
 	    /* fprintf(stderr, "compare returned %d\n", rv); */
 	    if (rv <= 0)
 	    {
-		free(alt);
+		arena_release(ctx, mark);
 		return rv;
 	    }
 
@@ -5673,12 +6468,12 @@ static int compare_left_plus(int anchored, Arrow *a1, Arrow *a2)
     left.origin = a1->origin;
     left.rn = alt;
     left.spent = 0;
-    rv = compare(anchored, &left, a2);
-    free(alt);
+    rv = compare(ctx, anchored, &left, a2);
+    arena_release(ctx, mark);
     return rv;
 }
 
-static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_plus(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p2;
     Arrow right;
@@ -5689,7 +6484,7 @@ static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
 
     /* fprintf(stderr, "enter compare_right_plus\n"); */
 
-    sz = get_size(p2);
+    sz = get_size(ctx, p2);
     if (sz < 0)
     {
 	return -1;
@@ -5697,7 +6492,7 @@ static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
 
     if (sz < 2)
     {
-	rc_error = "Plus offset too small";
+	ctx->error = "Plus offset too small";
 	return -1;
     }
 
@@ -5707,7 +6502,7 @@ static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + 1;
     right.spent = 0;
 
-    rv = compare(anchored, a1, &right);
+    rv = compare(ctx, anchored, a1, &right);
 
     if (rv < 0)
     {
@@ -5716,7 +6511,7 @@ static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
 
     if (!rv)
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     a2->rn += sz - 1;
@@ -5726,21 +6521,21 @@ static int compare_right_plus(int anchored, Arrow *a1, Arrow *a2)
     return rv;
 }
 
-static int compare_next(int anchored, Arrow *a1, Arrow *a2)
+static int compare_next(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    if (bump_regular(a2) <= 0)
+    if (bump_regular(ctx, a2) <= 0)
     {
         return -1;
     }
 
-    return compare(anchored, a1, a2);
+    return compare(ctx, anchored, a1, a2);
 }
 
-static int compare_curly_plus(int anchored, Arrow *a1, Arrow *a2)
+static int compare_curly_plus(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2;
     Arrow left, right;
-    short *cnt;
+    short cnt[2];
 
     p1 = a1->rn;
     assert((p1->type == CURLY) || (p1->type == CURLYM) ||
@@ -5748,16 +6543,16 @@ static int compare_curly_plus(int anchored, Arrow *a1, Arrow *a2)
     p2 = a2->rn;
     assert(p2->type == PLUS);
 
-    cnt = (short *)(p1 + 1);
+    get_counts(ctx, p1, cnt);
     if (cnt[0] < 0)
     {
-	rc_error = "Left curly has negative minimum";
+	ctx->error = "Left curly has negative minimum";
 	return -1;
     }
 
     if (!cnt[0])
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     left.origin = a1->origin;
@@ -5773,10 +6568,10 @@ static int compare_curly_plus(int anchored, Arrow *a1, Arrow *a2)
 	anchored = 1;
     }
 
-    return compare(anchored, &left, &right);
+    return compare(ctx, anchored, &left, &right);
 }
 
-static int compare_curly_star(int anchored, Arrow *a1, Arrow *a2)
+static int compare_curly_star(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2;
     Arrow left, right;
@@ -5796,20 +6591,20 @@ static int compare_curly_star(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + 1;
     right.spent = 0;
 
-    rv = compare(1, &left, &right);
+    rv = compare(ctx, 1, &left, &right);
     if (!rv)
     {
-	rv = compare_next(anchored, a1, a2);
+	rv = compare_next(ctx, anchored, a1, a2);
     }
 
     return rv;
 }
 
-static int compare_plus_curly(int anchored, Arrow *a1, Arrow *a2)
+static int compare_plus_curly(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2, *e2;
     Arrow left, right;
-    short *cnt;
+    short cnt[2];
     int rv, offs;
 
     p1 = a1->rn;
@@ -5818,16 +6613,16 @@ static int compare_plus_curly(int anchored, Arrow *a1, Arrow *a2)
     assert((p2->type == CURLY) || (p2->type == CURLYM) ||
 	   (p2->type == CURLYX));
 
-    cnt = (short *)(p2 + 1);
+    get_counts(ctx, p2, cnt);
     if (cnt[0] < 0)
     {
-	rc_error = "Negative minimum for curly";
+	ctx->error = "Negative minimum for curly";
 	return -1;
     }
 
     if (cnt[0] > 1) /* FIXME: fails '(?:aa)+' => 'a{2,}' */
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     left.origin = a1->origin;
@@ -5836,7 +6631,7 @@ static int compare_plus_curly(int anchored, Arrow *a1, Arrow *a2)
 
     if (cnt[1] != INFINITE_COUNT)
     {
-        offs = get_jump_offset(p2);
+        offs = get_jump_offset(ctx, p2);
 	if (offs <= 0)
 	{
 	    return -1;
@@ -5845,7 +6640,7 @@ static int compare_plus_curly(int anchored, Arrow *a1, Arrow *a2)
 	e2 = p2 + offs;
 	if (e2->type != END)
 	{
-	    return compare_mismatch(anchored, a1, a2);	    
+	    return compare_mismatch(ctx, anchored, a1, a2);	    
 	}
     }
 
@@ -5853,8 +6648,8 @@ static int compare_plus_curly(int anchored, Arrow *a1, Arrow *a2)
     right.rn = p2 + 2;
     right.spent = 0;
 
-    rv = compare(1, &left, &right);
-    return (!rv && !cnt[0]) ? compare_next(anchored, a1, a2) : rv;
+    rv = compare(ctx, 1, &left, &right);
+    return (!rv && !cnt[0]) ? compare_next(ctx, anchored, a1, a2) : rv;
 }
 
 static void dec_curly_counts(short *altcnt)
@@ -5866,12 +6661,13 @@ static void dec_curly_counts(short *altcnt)
     }
 }
 
-static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
+static int compare_left_curly(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *alt, *q;
     Arrow left, right;
     int sz, rv, offs, end_offs;
-    short *cnt;
+    short cnt[2];
+    ArenaMark mark;
 
     /* fprintf(stderr, "enter compare_left_curly(%d, %d, %d)\n", anchored,
        a1->rn->type, a2->rn->type); */
@@ -5880,14 +6676,14 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
     assert((p1->type == CURLY) || (p1->type == CURLYM) ||
 	   (p1->type == CURLYX));
 
-    cnt = (short *)(p1 + 1);
+    get_counts(ctx, p1, cnt);
     if (!cnt[0])
     {
         /* fprintf(stderr, "curly from 0\n"); */
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    sz = get_size(p1);
+    sz = get_size(ctx, p1);
     if (sz < 0)
     {
 	return -1;
@@ -5895,7 +6691,7 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
 
     if (sz < 3)
     {
-	rc_error = "Left curly offset too small";
+	ctx->error = "Left curly offset too small";
 	return -1;
     }
 
@@ -5911,14 +6707,14 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
 	
 	if (offs < 3)
 	{
-	    rc_error = "Left curly offset is too small";
+	    ctx->error = "Left curly offset is too small";
 	    return -1;
 	}
 
-        alt = (regnode *)malloc(sizeof(regnode) * (offs - 2 + sz));
+	mark = arena_mark(ctx);
+        alt = alloc_nodes(ctx, offs - 2 + sz);
 	if (!alt)
 	{
-	    rc_error = "Could not allocate memory for unrolled curly";
 	    return -1;
 	}
 
@@ -5930,8 +6726,8 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
 	left.origin = a1->origin;
 	left.rn = alt;
 	left.spent = 0;
-	rv = compare(1, &left, a2);
-	free(alt);
+	rv = compare(ctx, 1, &left, a2);
+	arena_release(ctx, mark);
 	return rv;
     }
 
@@ -5939,13 +6735,14 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
     {
         /* fprintf(stderr, "anchored curly with variable length\n"); */
 
-	alt = alloc_alt(p1 + 2, sz - 2);
+	mark = arena_mark(ctx);
+	alt = alloc_alt(ctx, p1 + 2, sz - 2);
 	if (!alt)
 	{
 	    return -1;
 	}
 
-	offs = get_jump_offset(p1);
+	offs = get_jump_offset(ctx, p1);
 	if (offs <= 0)
 	{
 	    return -1;
@@ -5970,37 +6767,40 @@ static int compare_left_curly(int anchored, Arrow *a1, Arrow *a2)
 
 	    /* fprintf(stderr, "comparing %d to %d\n", left.rn->type,
 	       right.rn->type); */
-	    rv = compare(1, &left, &right);
-	    free(alt);
+	    rv = compare(ctx, 1, &left, &right);
 	    /* fprintf(stderr, "compare returned %d\n", rv); */
 	    if (rv <= 0)
 	    {
 		return rv;
 	    }
 	}
+
+	arena_release(ctx, mark);
     }
 
     left.origin = a1->origin;
     left.rn = p1 + 2;
     left.spent = 0;
-    return compare(anchored, &left, a2);
+    return compare(ctx, anchored, &left, a2);
 }
 
-static int compare_right_curly(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_curly(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    regnode *p2, *alt;
+    regnode *p2, *alt, *unrolled;
     Arrow right;
-    short *cnt, *altcnt;
+    short counts[2], *cnt;
     int sz, rv, offs, nanch;
+    ArenaMark mark, unrolled_mark;
 
     /* fprintf(stderr, "enter compare_right_curly(%d...: a1->spent = %d, a2->spent = %d\n", anchored, a1->spent, a2->spent); */
 
     p2 = a2->rn;
 
-    cnt = (short *)(p2 + 1);
+    get_counts(ctx, p2, counts);
+    cnt = counts;
     if (cnt[0] < 0)
     {
-	rc_error = "Curly has negative minimum";
+	ctx->error = "Curly has negative minimum";
 	return -1;
     }
 
@@ -6011,7 +6811,7 @@ static int compare_right_curly(int anchored, Arrow *a1, Arrow *a2)
     if (cnt[0] > 0)
     {
         /* the repeated expression is mandatory: */
-        sz = get_size(p2);
+        sz = get_size(ctx, p2);
 	if (sz < 0)
 	{
 	    return sz;
@@ -6019,129 +6819,147 @@ static int compare_right_curly(int anchored, Arrow *a1, Arrow *a2)
 
 	if (sz < 3)
 	{
-	    rc_error = "Right curly offset too small";
+	    ctx->error = "Right curly offset too small";
 	    return -1;
 	}
 
-	right.origin = a2->origin;
-	right.rn = p2 + 2;
-	right.spent = 0;
-
-	rv = compare(anchored, a1, &right);
-	/* fprintf(stderr, "compare_right_curly: compare returned %d\n", rv); */
-	if (rv < 0)
+	/* matches a repeat per iteration; after the first one, p2
+	   points to a copy of the curly whose counts are decremented
+	   in place (rather than recursing with a new copy, which for
+	   large counts would nest too deep) */
+	mark = arena_mark(ctx);
+	alt = 0;
+	for (;;)
 	{
-	    return rv;
-	}
+	    right.origin = a2->origin;
+	    right.rn = p2 + 2;
+	    right.spent = 0;
 
-	if (!rv)
-	{
-	    /* ...or (if we aren't anchored yet) just do the left tail... */
-	    rv = compare_mismatch(anchored, a1, a2);
-	    if (rv)
+	    rv = compare(ctx, nanch, a1, &right);
+	    /* fprintf(stderr, "compare_right_curly: compare returned %d\n", rv); */
+	    if (rv < 0)
 	    {
-		return rv;
+		break;
 	    }
 
-	    /* ...or (last try) unroll the repeat (works for e.g.
-	       'abbc' vs. 'ab{2}c' */
-	    if (cnt[0] > 1)
+	    if (!rv)
 	    {
-		offs = GET_OFFSET(p2);
-		if (offs < 0)
+		/* ...or (if we aren't anchored yet) just do the left
+		   tail... */
+		rv = resume_skip(ctx, compare_mismatch(ctx, nanch, a1, a2), a1,
+		    a2);
+		if (rv)
 		{
-		    return -1;
+		    break;
 		}
 
-		if (offs < 3)
+		/* ...or (last try) unroll the repeat (works for e.g.
+		   'abbc' vs. 'ab{2}c' */
+		if (cnt[0] > 1)
 		{
-		    rc_error = "Left curly offset is too small";
-		    return -1;
-		}
+		    offs = GET_OFFSET(p2);
+		    if (offs < 0)
+		    {
+			rv = -1;
+			break;
+		    }
 
-		alt = (regnode *)malloc(sizeof(regnode) * (offs - 2 + sz));
-		if (!alt)
-		{
-		    rc_error = "Couldn't allocate memory for unrolled curly";
-		    return -1;
-		}
+		    if (offs < 3)
+		    {
+			ctx->error = "Left curly offset is too small";
+			rv = -1;
+			break;
+		    }
 
-		memcpy(alt, p2 + 2, (offs - 2) * sizeof(regnode));
-		memcpy(alt + offs - 2, p2, sz * sizeof(regnode));
+		    unrolled_mark = arena_mark(ctx);
+		    unrolled = alloc_nodes(ctx, offs - 2 + sz);
+		    if (!unrolled)
+		    {
+			rv = -1;
+			break;
+		    }
 
-		dec_curly_counts((short *)(alt + offs - 1));
+		    memcpy(unrolled, p2 + 2, (offs - 2) * sizeof(regnode));
+		    memcpy(unrolled + offs - 2, p2, sz * sizeof(regnode));
 
-		right.origin = a2->origin;
-		right.rn = alt;
-		right.spent = 0;
+		    dec_curly_counts((short *)(unrolled + offs - 1));
 
-		rv = compare(anchored, a1, &right);
-		free(alt);
-		return rv;
-	    }
+		    right.origin = a2->origin;
+		    right.rn = unrolled;
+		    right.spent = 0;
 
-	    return 0;
-	}
+		    rv = compare(ctx, nanch, a1, &right);
+		    arena_release(ctx, unrolled_mark);
+		}
 
-	if (cnt[0] == 1)
-	{
-	    return 1;
-	}
+		break;
+	    }
 
-	if (a1->rn->type == END)
-	{
-	    /* we presume the repeated argument matches something, which
-	       isn't guaranteed, but it is conservative */
-	    return 0;
-	}
+	    if (cnt[0] == 1)
+	    {
+		rv = 1;
+		break;
+	    }
 
-	/* strictly speaking, matching one repeat didn't *necessarily*
-	   anchor the match, but we'll ignore such cases as
-	   pathological */
-	nanch = 1;
+	    if (a1->rn->type == END)
+	    {
+		/* we presume the repeated argument matches something,
+		   which isn't guaranteed, but it is conservative */
+		rv = 0;
+		break;
+	    }
 
-	alt = alloc_alt(p2, sz);
-	if (!alt)
-	{
-	    return -1;
-	}
+	    /* strictly speaking, matching one repeat didn't
+	       *necessarily* anchor the match, but we'll ignore such
+	       cases as pathological */
+	    nanch = 1;
 
-	altcnt = (short *)(alt + 1);
-	dec_curly_counts(altcnt);
-	if (altcnt[1] > 0)
-	{
-	    right.origin = a2->origin;
-	    right.rn = alt;
-	    right.spent = 0;
+	    if (!alt)
+	    {
+		alt = alloc_alt(ctx, p2, sz);
+		if (!alt)
+		{
+		    rv = -1;
+		    break;
+		}
 
-	    rv = compare_right_curly(nanch, a1, &right);
-	}
-	else
-	{
-	    rv = 1;
-	}
+		p2 = alt;
+		cnt = (short *)(alt + 1);
+	    }
 
-	free(alt);
+	    dec_curly_counts(cnt);
+	    if (cnt[1] <= 0)
+	    {
+		rv = 1;
+		break;
+	    }
+	}
 
+	arena_release(ctx, mark);
 	if (rv <= 0)
 	{
 	    return rv;
 	}
 
-	a2->rn += sz - 1;
-	assert(a2->rn->type == END);
-	a2->spent = 0;
+	/* matched past the first repeat - a2 moves past the curly */
+	if (alt)
+	{
+	    a2->rn += sz - 1;
+	    assert(a2->rn->type == END);
+	    a2->spent = 0;
+	}
+
 	return rv;
     }
 
-    return compare_right_curly_from_zero(nanch, a1, a2);
+    return compare_right_curly_from_zero(ctx, nanch, a1, a2);
 }
 
-static int compare_curly_curly(int anchored, Arrow *a1, Arrow *a2)
+static int compare_curly_curly(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     regnode *p1, *p2, *e2;
     Arrow left, right;
-    short *cnt1, *cnt2;
+    short cnt1[2], cnt2[2];
     int rv, offs;
 
     /* fprintf(stderr, "enter compare_curly_curly(%d...)\n", anchored); */
@@ -6153,26 +6971,26 @@ static int compare_curly_curly(int anchored, Arrow *a1, Arrow *a2)
     assert((p2->type == CURLY) || (p2->type == CURLYM) ||
 	   (p2->type == CURLYX));
 
-    cnt1 = (short *)(p1 + 1);
+    get_counts(ctx, p1, cnt1);
     /* fprintf(stderr, "*cnt1 = %d\n", cnt1[0]); */
     if (cnt1[0] < 0)
     {
-	rc_error = "Negative minimum for left curly";
+	ctx->error = "Negative minimum for left curly";
 	return -1;
     }
 
-    cnt2 = (short *)(p2 + 1);
+    get_counts(ctx, p2, cnt2);
     /* fprintf(stderr, "*cnt2 = %d\n", cnt2[0]); */
     if (cnt2[0] < 0)
     {
-	rc_error = "Negative minimum for right curly";
+	ctx->error = "Negative minimum for right curly";
 	return -1;
     }
 
     if (cnt2[0] > cnt1[0]) /* FIXME: fails '(?:aa){1,}' => 'a{2,}' */
     {
         /* fprintf(stderr, "curly mismatch\n"); */
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     left.origin = a1->origin;
@@ -6181,7 +6999,7 @@ static int compare_curly_curly(int anchored, Arrow *a1, Arrow *a2)
 
     if (cnt1[1] > cnt2[1])
     {
-	offs = get_jump_offset(p2);
+	offs = get_jump_offset(ctx, p2);
         /* fprintf(stderr, "offs = %d\n", offs); */
 	if (offs <= 0)
 	{
@@ -6192,7 +7010,7 @@ static int compare_curly_curly(int anchored, Arrow *a1, Arrow *a2)
         /* fprintf(stderr, "e2->type = %d\n", e2->type); */
 	if (e2->type != END)
 	{
-	    return compare_mismatch(anchored, a1, a2);	    
+	    return compare_mismatch(ctx, anchored, a1, a2);	    
 	}
     }
 
@@ -6202,12 +7020,12 @@ static int compare_curly_curly(int anchored, Arrow *a1, Arrow *a2)
 
     /* fprintf(stderr, "comparing tails\n"); */
 
-    rv = compare(anchored, &left, &right);
+    rv = compare(ctx, anchored, &left, &right);
     /* fprintf(stderr, "tail compare returned %d\n", rv); */
-    return (!rv && !cnt2[0]) ? compare_next(anchored, a1, a2) : rv;
+    return (!rv && !cnt2[0]) ? compare_next(ctx, anchored, a1, a2) : rv;
 }
 
-static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
+static int compare_bound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     int move_left, unsigned char *bitmap, char *lookup,
     unsigned char *oktypes
 #ifdef RC_POSIX_NODES
@@ -6217,14 +7035,13 @@ static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
 {
     Arrow left, right;
     unsigned char t;
-    int i;
     char *seq;
 
     assert((a2->rn->type == BOUND) || (a2->rn->type == NBOUND));
 
     left = *a1;
 
-    if (bump_with_check(&left) <= 0)
+    if (bump_with_check(ctx, &left) <= 0)
     {
 	return -1;
     }
@@ -6232,7 +7049,7 @@ static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
     t = left.rn->type;
     if (t >= REGNODE_MAX)
     {
-        rc_error = "Invalid node type";
+        ctx->error = "Invalid node type";
         return -1;
     }
     else if (t == ANYOF)
@@ -6241,15 +7058,12 @@ static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
 
         if (left.rn->flags & ANYOF_UNICODE_ALL)
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
 
-	for (i = 0; i < ANYOF_BITMAP_SIZE; ++i)
+	if (!anyof_subset(left.rn, bitmap, 0, ANYOF_BITMAP_SIZE))
 	{
-	    if (get_bitmap_byte(left.rn, i) & ~bitmap[i])
-	    {
-		return compare_mismatch(anchored, a1, a2);
-	    }
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
     else if ((t == EXACT) || (t == EXACTF) || (t == EXACTFU))
@@ -6257,7 +7071,7 @@ static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
         seq = GET_LITERAL(&left);
 	if (!lookup[(unsigned char)(*seq)])
 	{
-	    return compare_mismatch(anchored, a1, a2);
+	    return compare_mismatch(ctx, anchored, a1, a2);
 	}
     }
 #ifdef RC_POSIX_NODES
@@ -6266,28 +7080,28 @@ static int compare_bound(int anchored, Arrow *a1, Arrow *a2,
       U8 flags = left.rn->flags;
       if ((flags >= regclasses_size) || !regclasses[flags])
       {
-	  return compare_mismatch(anchored, a1, a2);
+	  return compare_mismatch(ctx, anchored, a1, a2);
       }
     }
 #endif
     else if (!oktypes[t])
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     right = *a2;
-    if (bump_with_check(&right) <= 0)
+    if (bump_with_check(ctx, &right) <= 0)
     {
 	return -1;
     }
 
-    return move_left ? compare(1, &left, &right) : 
-        compare(anchored, a1, &right);
+    return move_left ? compare(ctx, 1, &left, &right) : 
+        compare(ctx, anchored, a1, &right);
 }
 
-static int compare_bol_word(int anchored, Arrow *a1, Arrow *a2)
+static int compare_bol_word(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_bound(anchored, a1, a2, 1, word_bc.bitmap,
+    return compare_bound(ctx, anchored, a1, a2, 1, word_bc.bitmap,
         word_bc.lookup, alphanumeric_classes
 #ifdef RC_POSIX_NODES
         , word_posix_regclasses, SIZEOF_ARRAY(word_posix_regclasses)
@@ -6295,9 +7109,9 @@ static int compare_bol_word(int anchored, Arrow *a1, Arrow *a2)
 	);
 }
 
-static int compare_bol_nword(int anchored, Arrow *a1, Arrow *a2)
+static int compare_bol_nword(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_bound(anchored, a1, a2, 1, word_bc.nbitmap,
+    return compare_bound(ctx, anchored, a1, a2, 1, word_bc.nbitmap,
         word_bc.nlookup, non_alphanumeric_classes
 #ifdef RC_POSIX_NODES
         , non_word_posix_regclasses, SIZEOF_ARRAY(non_word_posix_regclasses)
@@ -6305,9 +7119,9 @@ static int compare_bol_nword(int anchored, Arrow *a1, Arrow *a2)
 	);
 }
 
-static int compare_next_word(int anchored, Arrow *a1, Arrow *a2)
+static int compare_next_word(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_bound(anchored, a1, a2, 0, word_bc.bitmap,
+    return compare_bound(ctx, anchored, a1, a2, 0, word_bc.bitmap,
         word_bc.lookup, alphanumeric_classes
 #ifdef RC_POSIX_NODES
         , word_posix_regclasses, SIZEOF_ARRAY(word_posix_regclasses)
@@ -6315,9 +7129,9 @@ static int compare_next_word(int anchored, Arrow *a1, Arrow *a2)
 	);
 }
 
-static int compare_next_nword(int anchored, Arrow *a1, Arrow *a2)
+static int compare_next_nword(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_bound(anchored, a1, a2, 0, word_bc.nbitmap,
+    return compare_bound(ctx, anchored, a1, a2, 0, word_bc.nbitmap,
         word_bc.nlookup, non_alphanumeric_classes
 #ifdef RC_POSIX_NODES
         , non_word_posix_regclasses, SIZEOF_ARRAY(non_word_posix_regclasses)
@@ -6325,33 +7139,21 @@ static int compare_next_nword(int anchored, Arrow *a1, Arrow *a2)
 	);
 }
 
-static int compare_anyof_bounds(int anchored, Arrow *a1, Arrow *a2,
+static int compare_anyof_bounds(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
     unsigned char *bitmap)
 {
-    unsigned char loc;
     FCompare cmp[2];
     int i;
 
-    cmp[0] = compare_next_word;
-    cmp[1] = compare_next_nword;
-    for (i = 0; (i < ANYOF_BITMAP_SIZE) && (cmp[0] || cmp[1]); ++i)
-    {
-        loc = get_bitmap_byte(a1->rn, i);
-
-        if (loc & ~bitmap[i])
-	{
-	     cmp[0] = 0;
-	}
-
-        if (loc & bitmap[i])
-	{
-	     cmp[1] = 0;
-	}
-    }
+    /* all chars in bitmap, or none of them */
+    cmp[0] = anyof_subset(a1->rn, bitmap, 0, ANYOF_BITMAP_SIZE) ?
+	compare_next_word : 0;
+    cmp[1] = anyof_subset(a1->rn, bitmap, 1, ANYOF_BITMAP_SIZE) ?
+	compare_next_nword : 0;
 
     if (cmp[0] && cmp[1])
     {
-	rc_error = "Zero bitmap";
+	ctx->error = "Zero bitmap";
 	return -1;
     }
 
@@ -6359,43 +7161,43 @@ static int compare_anyof_bounds(int anchored, Arrow *a1, Arrow *a2,
     {
         if (cmp[i])
 	{
-	    return (cmp[i])(anchored, a1, a2);
+	    return (cmp[i])(ctx, anchored, a1, a2);
 	}
     }
 
     /* if would be more elegant to use compare_mismatch as a sentinel
        in cmp, but VC 2003 then warns that this function might be
        missing a return... */
-    return compare_mismatch(anchored, a1, a2);
+    return compare_mismatch(ctx, anchored, a1, a2);
 }
 
-static int compare_anyof_bound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_bound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == BOUND);
 
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_anyof_bounds(anchored, a1, a2, word_bc.nbitmap);
+    return compare_anyof_bounds(ctx, anchored, a1, a2, word_bc.nbitmap);
 }
 
-static int compare_anyof_nbound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_anyof_nbound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert(a1->rn->type == ANYOF);
     assert(a2->rn->type == NBOUND);
 
     if (a1->rn->flags & ANYOF_UNICODE_ALL)
     {
-	return compare_mismatch(anchored, a1, a2);
+	return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_anyof_bounds(anchored, a1, a2, word_bc.bitmap);
+    return compare_anyof_bounds(ctx, anchored, a1, a2, word_bc.bitmap);
 }
 
-static int compare_exact_bound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_bound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
     FCompare cmp;
@@ -6408,10 +7210,10 @@ static int compare_exact_bound(int anchored, Arrow *a1, Arrow *a2)
 
     cmp = word_bc.lookup[(unsigned char)(*seq)] ?
         compare_next_nword : compare_next_word;
-    return cmp(anchored, a1, a2);
+    return cmp(ctx, anchored, a1, a2);
 }
 
-static int compare_exact_nbound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_exact_nbound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     char *seq;
     FCompare cmp;
@@ -6424,11 +7226,11 @@ static int compare_exact_nbound(int anchored, Arrow *a1, Arrow *a2)
 
     cmp = word_bc.lookup[(unsigned char)(*seq)] ?
         compare_next_word : compare_next_nword;
-    return cmp(anchored, a1, a2);
+    return cmp(ctx, anchored, a1, a2);
 }
 
 #ifdef RC_POSIX_NODES
-static int compare_posix_bound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_posix_bound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == POSIXD) || (a1->rn->type == POSIXU) ||
 	(a1->rn->type == POSIXA));
@@ -6439,17 +7241,17 @@ static int compare_posix_bound(int anchored, Arrow *a1, Arrow *a2)
 	(flags >= SIZEOF_ARRAY(non_word_posix_regclasses)) ||
 	(!word_posix_regclasses[flags] && !non_word_posix_regclasses[flags]))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     assert(!word_posix_regclasses[flags] || !non_word_posix_regclasses[flags]);
 
     FCompare cmp = word_posix_regclasses[flags] ? 
         compare_next_nword : compare_next_word;
-    return cmp(anchored, a1, a2);
+    return cmp(ctx, anchored, a1, a2);
 }
 
-static int compare_posix_nbound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_posix_nbound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == POSIXD) || (a1->rn->type == POSIXU) ||
 	(a1->rn->type == POSIXA));
@@ -6460,17 +7262,17 @@ static int compare_posix_nbound(int anchored, Arrow *a1, Arrow *a2)
 	(flags >= SIZEOF_ARRAY(non_word_posix_regclasses)) ||
 	(!word_posix_regclasses[flags] && !non_word_posix_regclasses[flags]))
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
     assert(!word_posix_regclasses[flags] || !non_word_posix_regclasses[flags]);
 
     FCompare cmp = word_posix_regclasses[flags] ? 
         compare_next_word : compare_next_nword;
-    return cmp(anchored, a1, a2);
+    return cmp(ctx, anchored, a1, a2);
 }
 
-static int compare_negative_posix_word_bound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_posix_word_bound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == NPOSIXD) || (a1->rn->type == NPOSIXU) ||
 	(a1->rn->type == NPOSIXA));
@@ -6480,13 +7282,13 @@ static int compare_negative_posix_word_bound(int anchored, Arrow *a1, Arrow *a2)
        until we see the need */
     if (a1->rn->flags != _CC_WORDCHAR)
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_next_word(anchored, a1, a2);
+    return compare_next_word(ctx, anchored, a1, a2);
 }
 
-static int compare_negative_posix_word_nbound(int anchored, Arrow *a1, Arrow *a2)
+static int compare_negative_posix_word_nbound(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     assert((a1->rn->type == NPOSIXD) || (a1->rn->type == NPOSIXU) ||
 	(a1->rn->type == NPOSIXA));
@@ -6496,78 +7298,1295 @@ static int compare_negative_posix_word_nbound(int anchored, Arrow *a1, Arrow *a2
        until we see the need */
     if (a1->rn->flags != _CC_WORDCHAR)
     {
-        return compare_mismatch(anchored, a1, a2);
+        return compare_mismatch(ctx, anchored, a1, a2);
     }
 
-    return compare_next_nword(anchored, a1, a2);
+    return compare_next_nword(ctx, anchored, a1, a2);
 }
 #endif
 
-static int compare_open_open(int anchored, Arrow *a1, Arrow *a2)
+static int compare_open_open(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_tails(anchored, a1, a2);
+    return compare_tails(ctx, anchored, a1, a2);
 }
 
-static int compare_left_open(int anchored, Arrow *a1, Arrow *a2)
+static int compare_left_open(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_left_tail(anchored, a1, a2);
+    return compare_left_tail(ctx, anchored, a1, a2);
 }
 
-static int compare_right_open(int anchored, Arrow *a1, Arrow *a2)
+static int compare_right_open(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
-    return compare_next(anchored, a1, a2);
+    return compare_next(ctx, anchored, a1, a2);
 }
 
-static int success(int anchored, Arrow *a1, Arrow *a2)
+static int success(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
 {
     return 1;
 }
 
-/* #define DEBUG_dump */
-
-int rc_compare(REGEXP *pt1, REGEXP *pt2)
+/* allocates ctx->state when needed; null on error */
+static RcState *get_state(RcContext *ctx)
 {
-    Arrow a1, a2;
-    regnode *p1, *p2;
-#ifdef DEBUG_dump
-    unsigned char *p;
-    int i;    
-#endif
-
-    a1.origin = SvANY(pt1);
-    a2.origin = SvANY(pt2);
-
-    if ((get_forced_semantics(pt1) | get_forced_semantics(pt2)) == FORCED_MISMATCH)
+    if (!ctx->state)
     {
-	return 0;
+	ctx->state = (RcState *)calloc(1, sizeof(RcState));
+	if (!ctx->state)
+	{
+	    ctx->error = "Could not allocate memory for comparison state";
+	}
     }
 
-    p1 = find_internal(a1.origin);
-    if (!p1)
-    {
-	return -1;
-    }
+    return ctx->state;
+}
 
-    p2 = find_internal(a2.origin);
-    if (!p2)
+static void push_node(regnode **stack, int *n, unsigned char *seen,
+    RcCompiled *c, regnode *p)
+{
+    if ((p >= c->program) && (p < c->program + c->size) &&
+	!seen[p - c->program])
     {
-	return -1;
+	seen[p - c->program] = 1;
+	stack[(*n)++] = p;
     }
+}
 
-#ifdef DEBUG_dump
-    p = (unsigned char *)p1;
-    for (i = 1; i <= 64; ++i)
+/* Returns 1 when the nodes following p (see GET_OFFSET) stay in the
+   program up to its END. */
+static int chain_in_program(RcContext *ctx, RcCompiled *c, regnode *p)
+{
+    int offs;
+
+    while ((p->type < REGNODE_MAX) && (p->type != END))
     {
-	fprintf(stderr, " %02x", (int)p[i - 1]);
-	if (!(i % 4))
+	if (c->ir->nodes[p - c->program].size)
 	{
-	    fprintf(stderr, "\n");
+	    return 1;
+	}
+
+	offs = GET_OFFSET(p);
+	if ((offs <= 0) || (offs >= c->program + c->size - p))
+	{
+	    return 0;
+	}
+
+	p += offs;
+    }
+
+    return p->type == END;
+}
+
+#if UVSIZE == 8
+#define FNV_OFFSET_BASIS ((UV)UINT64_C(0xcbf29ce484222325))
+#define FNV_PRIME ((UV)UINT64_C(0x100000001b3))
+#else
+#define FNV_OFFSET_BASIS ((UV)2166136261U)
+#define FNV_PRIME ((UV)16777619U)
+#endif
+
+/* FNV-1a of n bytes at p, continuing from h (FNV_OFFSET_BASIS to
+   start) */
+static UV fnv1a(UV h, const unsigned char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+	h = (h ^ p[i]) * FNV_PRIME;
+    }
+
+    return h;
+}
+
+static unsigned hash_charset(const Charset *cs)
+{
+    return (unsigned)fnv1a(FNV_OFFSET_BASIS, (const unsigned char *)cs,
+	sizeof(Charset));
+}
+
+/* Rehashes charsets into twice as many slots; returns 0 when they
+   couldn't be allocated. */
+static int grow_charsets()
+{
+    int *slots;
+    int nslots, i;
+    unsigned j;
+
+    nslots = charsets.nslots ? 2 * charsets.nslots : 256;
+    slots = (int *)malloc(nslots * sizeof(int));
+    if (!slots)
+    {
+	return 0;
+    }
+
+    for (i = 0; i < nslots; ++i)
+    {
+	slots[i] = -1;
+    }
+
+    for (i = 0; i < charsets.count; ++i)
+    {
+	j = hash_charset(charsets.sets + i) & (nslots - 1);
+	while (slots[j] >= 0)
+	{
+	    j = (j + 1) & (nslots - 1);
+	}
+
+	slots[j] = i;
+    }
+
+    free(charsets.slots);
+    charsets.slots = slots;
+    charsets.nslots = nslots;
+    return 1;
+}
+
+/* Returns the identifier of the charset of p (interning it when
+   it's new), 0 when p isn't a class node compared by compare_classes
+   or its charset couldn't be interned. */
+static int intern_charset(RcContext *ctx, RcCompiled *c, regnode *p)
+{
+    Charset cs;
+    Charset *sets;
+    Arrow a;
+    unsigned j;
+    int id, alloc;
+
+    memset(&cs, 0, sizeof(Charset));
+    cs.type = p->type;
+    cs.flags = p->flags;
+    switch (p->type)
+    {
+    case ANYOF:
+	a.origin = SvANY(c->rx);
+	a.rn = p;
+	a.spent = 0;
+	cs.nonbitmap = ANYOF_NONBITMAP(p) ? 1 : 0;
+	/* -1 too - set tests converting the map fail (and aren't
+	   cached), others don't look at it */
+	cs.map_known = convert_map(ctx, &a, &cs.map);
+	if (cs.map_known != 1)
+	{
+	    cs.map = 0;
+	}
+
+	memcpy(cs.bitmap, p + 2, ANYOF_BITMAP_SIZE);
+	break;
+#ifdef RC_POSIX_NODES
+    case POSIXD:
+    case POSIXU:
+    case POSIXA:
+    case NPOSIXD:
+    case NPOSIXU:
+    case NPOSIXA:
+	break;
+#endif
+    default:
+	return 0;
+    }
+
+    id = 0;
+    LOCK_CHARSETS;
+    if (charsets.nslots)
+    {
+	j = hash_charset(&cs) & (charsets.nslots - 1);
+	while (charsets.slots[j] >= 0)
+	{
+	    if (!memcmp(charsets.sets + charsets.slots[j], &cs,
+		    sizeof(Charset)))
+	    {
+		id = charsets.slots[j] + 1;
+		break;
+	    }
+
+	    j = (j + 1) & (charsets.nslots - 1);
+	}
+    }
+
+    if (!id && (charsets.count < MAX_CHARSETS) &&
+	((2 * (charsets.count + 1) <= charsets.nslots) || grow_charsets()))
+    {
+	if (charsets.count == charsets.alloc)
+	{
+	    alloc = charsets.alloc ? 2 * charsets.alloc : 64;
+	    sets = (Charset *)realloc(charsets.sets,
+		alloc * sizeof(Charset));
+	    if (sets)
+	    {
+		charsets.sets = sets;
+		charsets.alloc = alloc;
+	    }
+	}
+
+	if (charsets.count < charsets.alloc)
+	{
+	    j = hash_charset(&cs) & (charsets.nslots - 1);
+	    while (charsets.slots[j] >= 0)
+	    {
+		j = (j + 1) & (charsets.nslots - 1);
+	    }
+
+	    charsets.sets[charsets.count] = cs;
+	    charsets.slots[j] = charsets.count;
+	    id = ++charsets.count;
+	}
+    }
+
+    UNLOCK_CHARSETS;
+    return id;
+}
+
+static void ir_free(Ir *ir)
+{
+    if (ir)
+    {
+	free(ir->nodes);
+	free(ir->literals);
+	free(ir);
+    }
+}
+
+/* Copies what the comparators need of p into its IR record, literal
+   chars to *literals (moving it past them). */
+static void fill_ir_record(IrNode *ni, regnode *p, char **literals)
+{
+    short *cnt;
+
+    switch (p->type)
+    {
+    case EXACT:
+    case EXACTF:
+    case EXACTFU:
+	ni->literal = *literals;
+	ni->length = p->flags;
+	memcpy(*literals, p + 1, p->flags);
+	*literals += p->flags;
+	break;
+    case CURLY:
+    case CURLYN:
+    case CURLYM:
+    case CURLYX:
+	cnt = (short *)(p + 1);
+	ni->min = cnt[0];
+	ni->max = cnt[1];
+	break;
+    }
+}
+
+/* Builds c->ir: records (including offsets and charsets of class
+   nodes) for the nodes reachable from the start of the program
+   (including the bodies of groups & repetitions); others are
+   computed whenever needed. Failure just leaves it null. */
+static void index_nodes(RcContext *ctx, RcCompiled *c)
+{
+    NodeTable *nt;
+    regnode **stack, *p;
+    unsigned char *seen;
+    char *error, *literals;
+    int n, offs;
+
+    c->ir = 0;
+    error = ctx->error;
+    if ((c->size <= 0) || !get_state(ctx))
+    {
+	ctx->error = error;
+	return;
+    }
+
+    /* literals are no longer than the program */
+    c->ir = (Ir *)calloc(1, sizeof(Ir));
+    if (c->ir)
+    {
+	c->ir->nodes = (IrNode *)calloc(c->size, sizeof(IrNode));
+	c->ir->literals = (char *)malloc(c->size * sizeof(regnode));
+    }
+
+    stack = (regnode **)malloc(c->size * sizeof(regnode *));
+    seen = (unsigned char *)calloc(c->size, 1);
+    if (!c->ir || !c->ir->nodes || !c->ir->literals || !stack || !seen)
+    {
+	ir_free(c->ir);
+	c->ir = 0;
+	free(stack);
+	free(seen);
+	return;
+    }
+
+    nt = &ctx->state->nodes;
+    memset(nt, 0, sizeof(NodeTable));
+    nt->start1 = c->program;
+    nt->size1 = c->size;
+    nt->nodes1 = c->ir->nodes;
+    nt->filling = 1;
+
+    literals = c->ir->literals;
+    n = 0;
+    push_node(stack, &n, seen, c, c->program);
+    while (n)
+    {
+	p = stack[--n];
+	if ((p->type >= REGNODE_MAX) || (p->type == END))
+	{
+	    continue;
+	}
+
+	offs = GET_OFFSET(p);
+	if (offs <= 0)
+	{
+	    continue;
+	}
+
+	push_node(stack, &n, seen, c, p + offs);
+	fill_ir_record(c->ir->nodes + (p - c->program), p, &literals);
+	if (chain_in_program(ctx, c, p))
+	{
+	    get_jump_offset(ctx, p);
+	    get_size(ctx, p);
+	    c->ir->nodes[p - c->program].charset = intern_charset(ctx, c, p);
+	}
+
+	switch (p->type)
+	{
+	case BRANCH:
+	case STAR:
+	case PLUS:
+	    push_node(stack, &n, seen, c, p + 1);
+	    break;
+	case CURLY:
+	case CURLYN:
+	case CURLYM:
+	case CURLYX:
+	case IFMATCH:
+	case UNLESSM:
+	    push_node(stack, &n, seen, c, p + 2);
+	    break;
+	}
+    }
+
+    memset(nt, 0, sizeof(NodeTable));
+    free(stack);
+    free(seen);
+
+    /* nodes which can't be indexed fail again in the comparison */
+    ctx->error = error;
+}
+
+/* Scans the source once; comparisons of compiled regexps just check
+   the stored flags. */
+static void init_compiled(RcContext *ctx, RcCompiled *c, REGEXP *rx)
+{
+    c->rx = rx;
+    c->forced = get_forced_semantics(rx);
+    c->program = find_internal(ctx, SvANY(rx));
+    c->error = c->program ? 0 : ctx->error;
+    c->hashed = 0;
+    memset(&(c->summary), 0, sizeof(RcSummary));
+    c->dfa = 0;
+
+    /* failure just disables memoization */
+    c->size = c->program ? get_size(ctx, c->program) : -1;
+    index_nodes(ctx, c);
+}
+
+static void memo_start(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    Memo *memo = &ctx->state->memo;
+    memo->start1 = 0;
+    if ((c1->size <= 0) || (c2->size <= 0))
+    {
+	return;
+    }
+
+    if (!memo->entries)
+    {
+        memo->entries = (MemoEntry *)calloc(MEMO_MIN_SIZE, sizeof(MemoEntry));
+	if (!memo->entries)
+	{
+	    return;
+	}
+
+	memo->size = MEMO_MIN_SIZE;
+    }
+
+    if (!++memo->generation)
+    {
+	/* wrapped around - old entries could look current */
+	memset(memo->entries, 0, memo->size * sizeof(MemoEntry));
+	memo->generation = 1;
+    }
+
+    memo->count = 0;
+    memo->origin1 = SvANY(c1->rx);
+    memo->start1 = c1->program;
+    memo->size1 = c1->size;
+    memo->origin2 = SvANY(c2->rx);
+    memo->start2 = c2->program;
+    memo->size2 = c2->size;
+}
+
+/* frees a table grown past MEMO_KEEP_SIZE, so that a single huge
+   comparison doesn't hold its memory forever (like arena_reset) */
+static void memo_reset(RcContext *ctx)
+{
+    Memo *memo = &ctx->state->memo;
+
+    if (memo->size > MEMO_KEEP_SIZE)
+    {
+	free(memo->entries);
+	memo->entries = 0;
+	memo->size = 0;
+    }
+}
+
+static void node_table_start(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    NodeTable *nt = &ctx->state->nodes;
+
+    nt->start1 = c1->program;
+    nt->size1 = c1->size;
+    nt->nodes1 = c1->ir ? c1->ir->nodes : 0;
+    nt->start2 = c2->program;
+    nt->size2 = c2->size;
+    nt->nodes2 = c2->ir ? c2->ir->nodes : 0;
+}
+
+/* Converts arrows to program offsets; returns 0 if they aren't
+   memoizable. */
+static int memo_offsets(RcContext *ctx, Arrow *a1, Arrow *a2, int *offs1, int *offs2)
+{
+    Memo *memo = &ctx->state->memo;
+    if (!memo->start1 || (a1->origin != memo->origin1) ||
+	(a2->origin != memo->origin2))
+    {
+	return 0;
+    }
+
+    *offs1 = a1->rn - memo->start1;
+    *offs2 = a2->rn - memo->start2;
+    return (*offs1 >= 0) && (*offs1 < memo->size1) &&
+	(*offs2 >= 0) && (*offs2 < memo->size2);
+}
+
+static MemoEntry *memo_slot(RcContext *ctx, int anchored, int offs1, int spent1,
+    int offs2, int spent2)
+{
+    Memo *memo = &ctx->state->memo;
+    MemoEntry *e;
+    U32 h;
+
+    h = (U32)offs1 * 0x9e3779b1U;
+    h = (h ^ (U32)spent1) * 0x85ebca6bU;
+    h = (h ^ (U32)offs2) * 0xc2b2ae35U;
+    h = (h ^ (U32)spent2) * 0x27d4eb2fU;
+    h ^= (U32)anchored;
+    h ^= h >> 15;
+
+    e = memo->entries + (h & (memo->size - 1));
+    while ((e->generation == memo->generation) &&
+	!((e->offs1 == offs1) && (e->spent1 == spent1) &&
+	    (e->offs2 == offs2) && (e->spent2 == spent2) &&
+	    (e->anchored == anchored)))
+    {
+        if (++e == memo->entries + memo->size)
+	{
+	    e = memo->entries;
+	}
+    }
+
+    return e;
+}
+
+static int memo_grow(RcContext *ctx)
+{
+    Memo *memo = &ctx->state->memo;
+    MemoEntry *old, *e, *n;
+    unsigned old_size, i;
+
+    old = memo->entries;
+    old_size = memo->size;
+
+    memo->entries = (MemoEntry *)calloc(2 * old_size, sizeof(MemoEntry));
+    if (!memo->entries)
+    {
+        memo->entries = old;
+	return 0;
+    }
+
+    memo->size = 2 * old_size;
+    for (i = 0; i < old_size; ++i)
+    {
+	e = old + i;
+	if (e->generation == memo->generation)
+	{
+	    n = memo_slot(ctx, e->anchored, e->offs1, e->spent1, e->offs2,
+		e->spent2);
+	    *n = *e;
+	}
+    }
+
+    free(old);
+    return 1;
+}
+
+/* returns 1 and sets rv & arrows if the comparison starting at
+   (already checked) offsets was made before */
+static int memo_find(RcContext *ctx, int anchored, int offs1, int offs2, Arrow *a1,
+    Arrow *a2, int *rv)
+{
+    Memo *memo = &ctx->state->memo;
+    MemoEntry *e;
+
+    e = memo_slot(ctx, anchored, offs1, a1->spent, offs2, a2->spent);
+    if (e->generation != memo->generation)
+    {
+	return 0;
+    }
+
+    *rv = e->rv;
+    a1->rn = memo->start1 + e->out_offs1;
+    a1->spent = e->out_spent1;
+    a2->rn = memo->start2 + e->out_offs2;
+    a2->spent = e->out_spent2;
+    return 1;
+}
+
+static void memo_store(RcContext *ctx, int anchored, int offs1, int spent1,
+    int offs2, int spent2, int rv, Arrow *a1, Arrow *a2)
+{
+    Memo *memo = &ctx->state->memo;
+    MemoEntry *e;
+    int out_offs1, out_offs2;
+
+    if (!memo_offsets(ctx, a1, a2, &out_offs1, &out_offs2))
+    {
+	return;
+    }
+
+    if (2 * (memo->count + 1) > memo->size)
+    {
+        if ((memo->size >= MEMO_MAX_SIZE) || !memo_grow(ctx))
+	{
+	    return;
+	}
+    }
+
+    e = memo_slot(ctx, anchored, offs1, spent1, offs2, spent2);
+    e->generation = memo->generation;
+    e->offs1 = offs1;
+    e->spent1 = spent1;
+    e->offs2 = offs2;
+    e->spent2 = spent2;
+    e->anchored = anchored;
+    e->rv = rv;
+    e->out_offs1 = out_offs1;
+    e->out_spent1 = a1->spent;
+    e->out_offs2 = out_offs2;
+    e->out_spent2 = a2->spent;
+    ++memo->count;
+}
+
+/* Synthetic tokens of the canonical form, following an 0xff byte
+   (node types are smaller). */
+#define TOKEN_GROUP_END 1
+#define TOKEN_STAR 2
+#define TOKEN_PLUS 3
+#define TOKEN_CURLY 4
+
+typedef struct
+{
+    UV h;
+
+    /* set when the program contains something not handled below */
+    int opaque;
+
+    int depth;
+} StructHash;
+
+static void hash_bytes(StructHash *sh, const unsigned char *p, size_t n)
+{
+    sh->h = fnv1a(sh->h, p, n);
+}
+
+static void hash_byte(StructHash *sh, unsigned char b)
+{
+    hash_bytes(sh, &b, 1);
+}
+
+static void hash_token(StructHash *sh, unsigned char token)
+{
+    hash_byte(sh, 0xff);
+    hash_byte(sh, token);
+}
+
+/* Hashes the sequence of nodes from p up to (not including) END or
+   end, whichever comes first, in a form which doesn't depend on
+   offsets. */
+static void hash_sequence(RcContext *ctx, StructHash *sh, regnode *p,
+    regnode *end)
+{
+    short *cnt;
+    int offs;
+
+    if (++sh->depth > ctx->limits.max_depth)
+    {
+	sh->opaque = 1;
+	return;
+    }
+
+    while (!sh->opaque && (p < end) && (p->type != END))
+    {
+	if (p->type >= REGNODE_MAX)
+	{
+	    sh->opaque = 1;
+	    break;
+	}
+
+	if ((p->type == IFMATCH) || (p->type == UNLESSM))
+	{
+	    /* the assertion is followed by its body, not by the next
+	       node */
+	    offs = get_assertion_offset(ctx, p);
+	}
+	else
+	{
+	    offs = GET_OFFSET(p);
+	}
+
+	if (offs <= 0)
+	{
+	    sh->opaque = 1;
+	    break;
+	}
+
+	if (trivial_nodes[p->type] || (p->type == OPTIMIZED))
+	{
+	    p += offs;
+	    continue;
+	}
+
+	if ((p->type == EXACT) || (p->type == EXACTF) ||
+	    (p->type == EXACTFU))
+	{
+	    hash_byte(sh, p->type);
+	    hash_byte(sh, p->flags);
+	    hash_bytes(sh, (unsigned char *)(p + 1), p->flags);
+	}
+	else if (p->type == ANYOF)
+	{
+	    if (ANYOF_NONBITMAP(p))
+	    {
+		/* class data isn't part of the program */
+		sh->opaque = 1;
+		break;
+	    }
+
+	    hash_byte(sh, p->type);
+	    hash_byte(sh, p->flags);
+	    hash_bytes(sh, (unsigned char *)(p + 2), ANYOF_BITMAP_SIZE);
+	}
+	else if ((p->type == OPEN) || (p->type == CLOSE))
+	{
+	    /* group numbers don't change what's matched */
+	    hash_byte(sh, p->type);
+	}
+	else if (p->type == BRANCH)
+	{
+	    hash_byte(sh, p->type);
+	    hash_sequence(ctx, sh, p + 1, p + offs);
+	    hash_token(sh, TOKEN_GROUP_END);
+	}
+	else if ((p->type == STAR) || (p->type == PLUS))
+	{
+	    hash_token(sh, (p->type == STAR) ? TOKEN_STAR : TOKEN_PLUS);
+	    hash_sequence(ctx, sh, p + 1, p + offs);
+	    hash_token(sh, TOKEN_GROUP_END);
+	}
+	else if ((p->type == CURLY) || (p->type == CURLYN) ||
+	    (p->type == CURLYM) || (p->type == CURLYX))
+	{
+	    /* a{1,} is a+ */
+	    cnt = (short *)(p + 1);
+	    if ((cnt[0] == 0) && (cnt[1] == REG_INFTY))
+	    {
+		hash_token(sh, TOKEN_STAR);
+	    }
+	    else if ((cnt[0] == 1) && (cnt[1] == REG_INFTY))
+	    {
+		hash_token(sh, TOKEN_PLUS);
+	    }
+	    else
+	    {
+		hash_token(sh, TOKEN_CURLY);
+		hash_bytes(sh, (unsigned char *)cnt, 2 * sizeof(short));
+	    }
+
+	    hash_sequence(ctx, sh, p + 2, p + offs);
+	    hash_token(sh, TOKEN_GROUP_END);
+	}
+	else if ((p->type == IFMATCH) || (p->type == UNLESSM))
+	{
+	    hash_byte(sh, p->type);
+	    hash_byte(sh, p->flags);
+	    hash_sequence(ctx, sh, p + 2, p + offs);
+	    hash_token(sh, TOKEN_GROUP_END);
+	}
+	else if (offs == 1)
+	{
+	    /* node without arguments */
+	    hash_byte(sh, p->type);
+	    hash_byte(sh, p->flags);
+	}
+	else
+	{
+	    sh->opaque = 1;
+	    break;
+	}
+
+	p += offs;
+    }
+
+    --sh->depth;
+}
+
+UV rc_structural_hash(RcContext *ctx, RcCompiled *c)
+{
+    StructHash sh;
+    char *error;
+
+    if (c->hashed)
+    {
+	return c->hash;
+    }
+
+    /* failures just make the regexp opaque */
+    error = ctx->error;
+
+    sh.h = FNV_OFFSET_BASIS;
+    sh.opaque = !c->program || (c->size <= 0);
+    sh.depth = 0;
+    hash_bytes(&sh, (unsigned char *)&(c->forced), sizeof(c->forced));
+    hash_byte(&sh, RX_UTF8(c->rx) ? 1 : 0);
+    if (!sh.opaque)
+    {
+	hash_sequence(ctx, &sh, c->program, c->program + c->size);
+    }
+
+    if (sh.opaque)
+    {
+	/* only equal to the same source */
+	sh.h = FNV_OFFSET_BASIS;
+	hash_token(&sh, 0);
+	hash_bytes(&sh, (unsigned char *)RX_PRECOMP(c->rx),
+	    RX_PRELEN(c->rx));
+	hash_bytes(&sh, (unsigned char *)&(c->forced), sizeof(c->forced));
+	hash_byte(&sh, RX_UTF8(c->rx) ? 1 : 0);
+    }
+
+    ctx->error = error;
+    c->hash = sh.h;
+    c->hashed = 1;
+    return c->hash;
+}
+
+#define WITNESS_MAX 256
+
+/* a byte unlikely to be required by other regexps, for dots */
+#define WITNESS_ANY '\001'
+
+typedef struct
+{
+    char buf[WITNESS_MAX];
+    STRLEN len;
+} WitnessBuf;
+
+/* ANYOF nodes whose bitmap describes everything they match (in
+   strings without UTF-8) */
+static int is_plain_anyof(regnode *p)
+{
+    return (p->type == ANYOF) && !ANYOF_NONBITMAP(p) &&
+	!(p->flags & ~(ANYOF_INVERT | ANYOF_LARGE));
+}
+
+static int witness_append(WitnessBuf *w, const char *p, STRLEN n)
+{
+    if (w->len + n > WITNESS_MAX)
+    {
+	return 0;
+    }
+
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+    return 1;
+}
+
+/* Appends a string which (hopefully - it's checked later) matches
+   the sequence from p up to END or end, whichever comes first;
+   returns 0 for unsupported constructs. */
+static int witness_sequence(RcContext *ctx, WitnessBuf *w, regnode *p,
+    regnode *end, int depth)
+{
+    regnode *q;
+    short *cnt;
+    char c;
+    int i, offs;
+
+    if (depth > ctx->limits.max_depth)
+    {
+	return 0;
+    }
+
+    while ((p < end) && (p->type != END))
+    {
+	if (p->type >= REGNODE_MAX)
+	{
+	    return 0;
+	}
+
+	offs = GET_OFFSET(p);
+	if (offs <= 0)
+	{
+	    return 0;
+	}
+
+	if (trivial_nodes[p->type] || (p->type == OPTIMIZED) ||
+	    (p->type == OPEN) || (p->type == CLOSE) ||
+	    (p->type == STAR) || (p->type == EOS) ||
+	    (p->type == SEOL) || (p->type == EOL))
+	{
+	    /* nothing to match (or repeated zero times) */
+	}
+	else if ((p->type == BOL) || (p->type == SBOL))
+	{
+	    if (w->len)
+	    {
+		return 0;
+	    }
+	}
+	else if ((p->type == EXACT) || (p->type == EXACTF) ||
+	    (p->type == EXACTFU))
+	{
+	    if (!witness_append(w, (char *)(p + 1), p->flags))
+	    {
+		return 0;
+	    }
+	}
+	else if (is_plain_anyof(p))
+	{
+	    for (i = 0; (i < 256) &&
+		!(get_bitmap_byte(p, i / 8) & (1 << (i % 8))); ++i)
+	    {
+	    }
+
+	    c = (char)i;
+	    if ((i == 256) || !witness_append(w, &c, 1))
+	    {
+		return 0;
+	    }
+	}
+	else if ((p->type == REG_ANY) || (p->type == SANY))
+	{
+	    c = WITNESS_ANY;
+	    if (!witness_append(w, &c, 1))
+	    {
+		return 0;
+	    }
+	}
+	else if (p->type == BRANCH)
+	{
+	    /* the first alternative, then whatever follows the last
+	       one */
+	    if (!witness_sequence(ctx, w, p + 1, p + offs, depth + 1))
+	    {
+		return 0;
+	    }
+
+	    q = p;
+	    while (q->type == BRANCH)
+	    {
+		offs = GET_OFFSET(q);
+		if (offs <= 0)
+		{
+		    return 0;
+		}
+
+		q += offs;
+	    }
+
+	    p = q;
+	    continue;
+	}
+	else if (p->type == PLUS)
+	{
+	    if (!witness_sequence(ctx, w, p + 1, p + offs, depth + 1))
+	    {
+		return 0;
+	    }
+	}
+	else if ((p->type == CURLY) || (p->type == CURLYN) ||
+	    (p->type == CURLYM) || (p->type == CURLYX))
+	{
+	    cnt = (short *)(p + 1);
+	    for (i = 0; i < cnt[0]; ++i)
+	    {
+		if (!witness_sequence(ctx, w, p + 2, p + offs, depth + 1))
+		{
+		    return 0;
+		}
+	    }
+	}
+	else
+	{
+	    return 0;
+	}
+
+	p += offs;
+    }
+
+    return 1;
+}
+
+/* skips nodes which don't match anything; returns null on error */
+static regnode *skip_trivial(RcContext *ctx, regnode *p, int skip_open)
+{
+    int offs;
+
+    while ((p->type < REGNODE_MAX) &&
+	(trivial_nodes[p->type] || (p->type == OPTIMIZED) ||
+	    (skip_open && ((p->type == OPEN) || (p->type == CLOSE)))))
+    {
+	offs = GET_OFFSET(p);
+	if (offs <= 0)
+	{
+	    return 0;
+	}
+
+	p += offs;
+    }
+
+    return p;
+}
+
+/* sets first_bytes & maxlen of regexps anchored at the start */
+static void init_anchored_summary(RcContext *ctx, RcCompiled *c)
+{
+    RcSummary *sm;
+    regnode *p;
+    STRLEN len;
+    unsigned char b;
+    int i, offs, end_type;
+
+    sm = &(c->summary);
+    p = skip_trivial(ctx, c->program, 0);
+    if (!p || ((p->type != BOL) && (p->type != SBOL)))
+    {
+	return;
+    }
+
+    p = skip_trivial(ctx, p + 1, 1);
+    if (!p)
+    {
+	return;
+    }
+
+    if ((p->type == EXACT) && p->flags)
+    {
+	b = ((unsigned char *)(p + 1))[0];
+	sm->first_bytes[b / 8] |= 1 << (b % 8);
+	sm->has_first_bytes = 1;
+    }
+    else if (is_plain_anyof(p))
+    {
+	for (i = 0; i < ANYOF_BITMAP_SIZE; ++i)
+	{
+	    sm->first_bytes[i] = get_bitmap_byte(p, i);
+	}
+
+	sm->has_first_bytes = 1;
+    }
+
+    /* fixed-width sequence up to the end of the string? */
+    len = 0;
+    while (p->type != END)
+    {
+	if ((p->type == EOS) || (p->type == SEOL) || (p->type == EOL))
+	{
+	    end_type = p->type;
+	    offs = GET_OFFSET(p);
+	    if (offs <= 0)
+	    {
+		return;
+	    }
+
+	    p = skip_trivial(ctx, p + offs, 1);
+	    if (p && (p->type == END))
+	    {
+		/* $ also matches before a newline at the end */
+		sm->maxlen = (end_type == EOS) ? len : len + 1;
+	    }
+
+	    return;
+	}
+
+	if (p->type == EXACT)
+	{
+	    len += p->flags;
+	}
+	else if (is_plain_anyof(p) || (p->type == REG_ANY) ||
+	    (p->type == SANY))
+	{
+	    ++len;
+	}
+	else
+	{
+	    return;
+	}
+
+	offs = GET_OFFSET(p);
+	if (offs <= 0)
+	{
+	    return;
+	}
+
+	p = skip_trivial(ctx, p + offs, 1);
+	if (!p)
+	{
+	    return;
+	}
+    }
+}
+
+/* copies a required substring of the regexp */
+static void init_summary_substr(RcSummary *sm, int k, SV *sv)
+{
+    STRLEN len;
+    char *str;
+
+    if (!sv || !SvPOK(sv))
+    {
+	return;
+    }
+
+    str = SvPVX(sv);
+    len = SvCUR(sv);
+
+    /* a trailing newline may stand for the end of the string (see
+       SvTAIL) */
+    if (len && (str[len - 1] == '\n'))
+    {
+	--len;
+    }
+
+    if (!len)
+    {
+	return;
+    }
+
+    sm->substr[k] = (char *)malloc(len);
+    if (sm->substr[k])
+    {
+	memcpy(sm->substr[k], str, len);
+	sm->substr_len[k] = len;
+    }
+}
+
+/* builds a witness and checks it with Perl's regexp engine */
+static void init_summary_witness(RcContext *ctx, RcCompiled *c)
+{
+    dTHX;
+    RcSummary *sm;
+    WitnessBuf w;
+    SV *sv;
+    char *str;
+    I32 matched;
+
+    sm = &(c->summary);
+    w.len = 0;
+    if (!witness_sequence(ctx, &w, c->program, c->program + c->size, 0))
+    {
+	return;
+    }
+
+    sv = newSVpvn(w.buf, w.len);
+    str = SvPVX(sv);
+    matched = pregexec(c->rx, str, str + w.len, str, 0, sv, 1);
+    SvREFCNT_dec(sv);
+    if (matched <= 0)
+    {
+	return;
+    }
+
+    sm->witness = (char *)malloc(w.len ? w.len : 1);
+    if (sm->witness)
+    {
+	memcpy(sm->witness, w.buf, w.len);
+	sm->witness_len = w.len;
+    }
+}
+
+static void init_summary(RcContext *ctx, RcCompiled *c)
+{
+    RcSummary *sm;
+    regexp *r;
+    char *error;
+
+    sm = &(c->summary);
+    memset(sm, 0, sizeof(RcSummary));
+    sm->maxlen = RC_UNBOUNDED;
+    if (!c->program || (c->size <= 0) || RX_UTF8(c->rx))
+    {
+	return;
+    }
+
+    /* failures just leave parts of the summary unknown */
+    error = ctx->error;
+
+    r = SvANY(c->rx);
+    sm->minlen = (r->minlen > 0) ? r->minlen : 0;
+    init_summary_substr(sm, 0, r->anchored_substr);
+    init_summary_substr(sm, 1, r->float_substr);
+    init_anchored_summary(ctx, c);
+    init_summary_witness(ctx, c);
+    sm->valid = 1;
+
+    ctx->error = error;
+}
+
+static void free_summary(RcSummary *sm)
+{
+    free(sm->witness);
+    free(sm->substr[0]);
+    free(sm->substr[1]);
+}
+
+/* Returns 1 when the witness of c1 is proven not to match c2, i.e.
+   c1 isn't less or equal to c2. */
+static int prefilter_mismatch(RcCompiled *c1, RcCompiled *c2)
+{
+    RcSummary *s1, *s2;
+    unsigned char b;
+    char *w;
+    STRLEN len;
+    int k;
+
+    s1 = &(c1->summary);
+    s2 = &(c2->summary);
+    if (!s1->witness || !s2->valid)
+    {
+	return 0;
+    }
+
+    w = s1->witness;
+    len = s1->witness_len;
+    if ((len < s2->minlen) || (len > s2->maxlen))
+    {
+	return 1;
+    }
+
+    if (s2->has_first_bytes)
+    {
+	if (!len)
+	{
+	    return 1;
+	}
+
+	b = (unsigned char)w[0];
+	if (!(s2->first_bytes[b / 8] & (1 << (b % 8))))
+	{
+	    return 1;
+	}
+    }
+
+    for (k = 0; k < 2; ++k)
+    {
+	if (s2->substr[k] && !ninstr(w, w + len, s2->substr[k],
+	    s2->substr[k] + s2->substr_len[k]))
+	{
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+RcCompiled *rc_compile(RcContext *ctx, SV *rs)
+{
+    RcCompiled *c;
+    REGEXP *rx;
+
+    rx = rc_regcomp(rs);
+
+    c = (RcCompiled *)malloc(sizeof(RcCompiled));
+    if (!c)
+    {
+	rc_regfree(rx);
+	croak("Could not allocate memory for compiled regexp");
+    }
+
+    init_compiled(ctx, c, rx);
+    init_summary(ctx, c);
+    return c;
+}
+
+void rc_compiled_free(RcCompiled *c)
+{
+    if (c)
+    {
+	rc_regfree(c->rx);
+	free_summary(&(c->summary));
+	ir_free(c->ir);
+	rc_dfa_free(c->dfa);
+	free(c);
+    }
+}
+
+/* #define DEBUG_dump */
+
+int rc_compare_compiled(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    Arrow a1, a2;
+    int rv;
+#ifdef DEBUG_dump
+    unsigned char *p;
+    int i;    
+#endif
+
+    if ((c1->forced | c2->forced) == FORCED_MISMATCH)
+    {
+	return 0;
+    }
+
+    if (!c1->program)
+    {
+        ctx->error = c1->error;
+	return -1;
+    }
+
+    if (!c2->program)
+    {
+        ctx->error = c2->error;
+	return -1;
+    }
+
+    if (prefilter_mismatch(c1, c2))
+    {
+	++ctx->stats.prefiltered;
+	return 0;
+    }
+
+#ifdef DEBUG_dump
+    p = (unsigned char *)(c1->program);
+    for (i = 1; i <= 64; ++i)
+    {
+	fprintf(stderr, " %02x", (int)p[i - 1]);
+	if (!(i % 4))
+	{
+	    fprintf(stderr, "\n");
 	}
     }
 
     fprintf(stderr, "\n\n");
 
-    p = (unsigned char *)p2;
+    p = (unsigned char *)(c2->program);
     for (i = 1; i <= 64; ++i)
     {
 	fprintf(stderr, " %02x", (int)p[i - 1]);
@@ -6580,41 +8599,304 @@ int rc_compare(REGEXP *pt1, REGEXP *pt2)
     fprintf(stderr, "\n\n");
 #endif
 
-    a1.rn = p1;
+    if (!get_state(ctx))
+    {
+	return -1;
+    }
+
+    memo_start(ctx, c1, c2);
+    node_table_start(ctx, c1, c2);
+
+    a1.origin = SvANY(c1->rx);
+    a1.rn = c1->program;
     a1.spent = 0;
-    a2.rn = p2;
+    a2.origin = SvANY(c2->rx);
+    a2.rn = c2->program;
     a2.spent = 0;
 
-    return compare(0, &a1, &a2);
+    ctx->state->depth = 0;
+    ctx->state->steps = 0;
+    ctx->state->deadline = (ctx->limits.deadline_ms > 0) ?
+	now_ms() + ctx->limits.deadline_ms : 0;
+    rv = compare(ctx, 0, &a1, &a2);
+    arena_reset(ctx);
+    memo_reset(ctx);
+    if (!rv)
+    {
+	/* no comparator matched - which may just mean there's none for
+	   the constructs involved */
+	rv = rc_nfa_compare(ctx, c1, c2);
+	if (rv == 1)
+	{
+	    ++ctx->stats.automaton;
+	}
+    }
+
+    ctx->state->nodes.start1 = 0;
+
+    ++ctx->stats.comparisons;
+    ctx->stats.steps += ctx->state->steps;
+    if (rv == RC_UNDECIDED)
+    {
+	++ctx->stats.undecided;
+    }
+
+    return rv;
+}
+
+void rc_stats_add(RcStats *to, const RcStats *from)
+{
+    to->comparisons += from->comparisons;
+    to->steps += from->steps;
+    to->memo_hits += from->memo_hits;
+    to->class_hits += from->class_hits;
+    to->undecided += from->undecided;
+    to->prefiltered += from->prefiltered;
+    to->automaton += from->automaton;
+    to->dfa_flushes += from->dfa_flushes;
+}
+
+void rc_context_init(RcContext *ctx)
+{
+    ctx->error = 0;
+    rc_default_limits(&ctx->limits);
+    memset(&ctx->stats, 0, sizeof(RcStats));
+    ctx->dfa_cache_size = RC_DEFAULT_DFA_CACHE_SIZE;
+    ctx->no_perl = 0;
+    ctx->state = 0;
+}
+
+void rc_context_free(RcContext *ctx)
+{
+    ArenaChunk *chunk, *next;
+
+    if (!ctx->state)
+    {
+	return;
+    }
+
+    free(ctx->state->memo.entries);
+    free(ctx->state->subsets);
+
+    chunk = ctx->state->arena.first;
+    while (chunk)
+    {
+        next = chunk->next;
+	free(chunk);
+	chunk = next;
+    }
+
+    free(ctx->state);
+    ctx->state = 0;
+}
+
+void rc_default_limits(RcLimits *limits)
+{
+    limits->max_depth = RC_DEFAULT_MAX_DEPTH;
+    limits->max_steps = 0;
+    limits->deadline_ms = 0;
+}
+
+int rc_compare(RcContext *ctx, REGEXP *pt1, REGEXP *pt2)
+{
+    RcCompiled c1, c2;
+    int rv;
+
+    init_compiled(ctx, &c1, pt1);
+    init_compiled(ctx, &c2, pt2);
+    rv = rc_compare_compiled(ctx, &c1, &c2);
+    ir_free(c1.ir);
+    ir_free(c2.ir);
+    rc_dfa_free(c2.dfa);
+    return rv;
 }
 
-static int compare(int anchored, Arrow *a1, Arrow *a2)
+/* One iteration of compare: looks a1 & a2 up in the memo (adding
+   their key to *pending unless found) and calls their comparator. */
+static int compare_step(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2,
+    PendingKey **pending)
 {
     FCompare cmp;
+    PendingKey *pk;
+    int rv, offs1, offs2;
 
     /* fprintf(stderr, "enter compare(%d, %d, %d)\n", anchored,
        a1->rn->type, a2->rn->type); */
 
     if ((a1->rn->type >= REGNODE_MAX) || (a2->rn->type >= REGNODE_MAX))
     {
-        rc_error = "Invalid regexp node type";
-        return -1;
+	ctx->error = "Invalid regexp node type";
+	return -1;
     }
 
     cmp = dispatch[a1->rn->type][a2->rn->type];
     if (!cmp)
     {
-        /* fprintf(stderr, "no comparator\n"); */
+	/* fprintf(stderr, "no comparator\n"); */
 	return 0;
     }
 
-    return cmp(anchored, a1, a2);
+    if (memo_offsets(ctx, a1, a2, &offs1, &offs2))
+    {
+	if (memo_find(ctx, anchored, offs1, offs2, a1, a2, &rv))
+	{
+	    ++ctx->stats.memo_hits;
+	    return rv;
+	}
+
+	pk = (PendingKey *)arena_alloc(ctx, sizeof(PendingKey));
+	if (!pk)
+	{
+	    ctx->error = "Could not allocate memory for memo key";
+	    return -1;
+	}
+
+	pk->next = *pending;
+	pk->anchored = anchored;
+	pk->offs1 = offs1;
+	pk->spent1 = a1->spent;
+	pk->offs2 = offs2;
+	pk->spent2 = a2->spent;
+	*pending = pk;
+    }
+
+    if (rc_over_budget(ctx))
+    {
+	return RC_UNDECIDED;
+    }
+
+    return cmp(ctx, anchored, a1, a2);
+}
+
+static void store_pending(RcContext *ctx, PendingKey *pending, int rv,
+    Arrow *a1, Arrow *a2)
+{
+    PendingKey *pk;
+
+    if (rv >= 0)
+    {
+	for (pk = pending; pk; pk = pk->next)
+	{
+	    memo_store(ctx, pk->anchored, pk->offs1, pk->spent1, pk->offs2,
+		pk->spent2, rv, a1, a2);
+	}
+    }
+}
+
+static int compare(RcContext *ctx, int anchored, Arrow *a1, Arrow *a2)
+{
+    ArenaMark mark;
+    PendingKey *pending;
+    TailFrame *frames, *spare, *f;
+    int rv;
+
+    if (ctx->state->depth >= ctx->limits.max_depth)
+    {
+	ctx->error = "Comparison nested too deep";
+	return RC_UNDECIDED;
+    }
+
+    ++ctx->state->depth;
+    mark = arena_mark(ctx);
+    pending = 0;
+    frames = 0;
+    spare = 0;
+
+    /* loops as long as the comparator skips nodes of the left regexp
+       (i.e. returns RC_SKIP; all positions passed through get the
+       same result) or continues with the tails (RC_TAIL - the
+       comparison waits on a frame for the result of the tails) */
+    for (;;)
+    {
+	rv = compare_step(ctx, anchored, a1, a2, &pending);
+	if (rv == RC_SKIP)
+	{
+	    anchored = 0;
+	    continue;
+	}
+
+	if (rv == RC_TAIL)
+	{
+	    f = spare;
+	    if (f)
+	    {
+		spare = f->next;
+	    }
+	    else
+	    {
+		f = (TailFrame *)arena_alloc(ctx, sizeof(TailFrame));
+		if (!f)
+		{
+		    ctx->error = "Could not allocate memory for tail frame";
+		    rv = -1;
+		}
+	    }
+
+	    if (f)
+	    {
+		f->next = frames;
+		f->a1 = *a1;
+		f->a2 = *a2;
+		f->anchored = anchored;
+		f->pending = pending;
+		frames = f;
+
+		*a1 = ctx->state->tail1;
+		*a2 = ctx->state->tail2;
+		anchored = 1;
+		pending = 0;
+		continue;
+	    }
+	}
+
+	/* rv is the result of the innermost comparison - pass it to
+	   the frames waiting on it, until one skips a node */
+	store_pending(ctx, pending, rv, a1, a2);
+	while (frames)
+	{
+	    f = frames;
+	    frames = f->next;
+	    f->next = spare;
+	    spare = f;
+
+	    pending = f->pending;
+	    if (!rv)
+	    {
+		/* tails don't match */
+		*a1 = f->a1;
+		*a2 = f->a2;
+		rv = compare_mismatch(ctx, f->anchored, a1, a2);
+		if (rv == RC_SKIP)
+		{
+		    break;
+		}
+	    }
+
+	    store_pending(ctx, pending, rv, a1, a2);
+	}
+
+	if (rv != RC_SKIP)
+	{
+	    break;
+	}
+
+	anchored = 0;
+    }
+
+    arena_release(ctx, mark);
+    --ctx->state->depth;
+    return rv;
 }
 
 void rc_init()
 {
     int i, wstart;
 
+    if (initialized)
+    {
+	return;
+    }
+
     /* could have used compile-time assertion, but why bother
        making it compatible... */
     assert(ANYOF_BITMAP_SIZE == 32);
@@ -8580,4 +10862,6 @@ void rc_init()
     dispatch[CLOSE][OPTIMIZED] = compare_tails;
     dispatch[MINMOD][OPTIMIZED] = compare_tails;
     dispatch[OPTIMIZED][OPTIMIZED] = compare_tails;
+
+    initialized = 1;
 }
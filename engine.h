@@ -1,17 +1,20 @@
 #ifndef engine_h
 #define engine_h
 
+/* Comparisons run in threads without an interpreter (see rc_matrix),
+   so code calling into Perl must get it explicitly (by dTHX), and
+   is only reached in those threads through RcContext.no_perl
+   checks. */
+#define PERL_NO_GET_CONTEXT
+
 #include "EXTERN.h"
 #include "perl.h"
 #include "XSUB.h"
 
-/* Set on error (i.e. failed memory allocation, unexpected regexp
-   construct), used by the XS glue as an argument to croak. Value
-   isn't freed - it must be a literal string. */
-extern char *rc_error;
-
 /* Initializes module tables. Doesn't fail, must be called before any
-   other function below. */
+   other function below. Calls after the first one do nothing; the
+   tables aren't modified afterwards, so they can be read by several
+   threads at once. */
 void rc_init();
 
 /* might croak but never returns null */
@@ -19,6 +22,198 @@ REGEXP *rc_regcomp(SV *rs);
 
 void rc_regfree(REGEXP *rx);
 
-int rc_compare(REGEXP *pt1, REGEXP *pt2);
+#define RC_UNDECIDED -2
+
+#define RC_DEFAULT_MAX_DEPTH 4096
+
+/* Revision of the comparison results - must be incremented by every
+   change which makes some comparison return something else, as it's
+   part of the key of persistently cached results. */
+#define RC_ENGINE_REVISION 1
+
+/* Bounds of a single comparison, used by the rc_compare* functions;
+   callers may change them between comparisons. */
+typedef struct
+{
+    /* maximal nesting of internal comparisons */
+    int max_depth;
+
+    /* maximal number of comparator calls, 0 for no limit */
+    long max_steps;
+
+    /* maximal run time in milliseconds, 0 for no limit; checked
+       every RC_DEADLINE_STEPS comparator calls */
+    double deadline_ms;
+} RcLimits;
+
+#define RC_DEADLINE_STEPS 1024
+
+void rc_default_limits(RcLimits *limits);
+
+/* totals over the comparisons made with a context */
+typedef struct
+{
+    UV comparisons;
+
+    /* comparator calls */
+    UV steps;
+
+    /* subcomparisons answered from the memo */
+    UV memo_hits;
+
+    /* set tests of class nodes answered from the class cache */
+    UV class_hits;
+
+    /* comparisons returning RC_UNDECIDED */
+    UV undecided;
+
+    /* comparisons decided by summaries alone */
+    UV prefiltered;
+
+    /* comparisons decided by automata (see nfa.h) */
+    UV automaton;
+
+    /* right automata which ran out of memory and were emptied */
+    UV dfa_flushes;
+} RcStats;
+
+/* adds the counters of from to to */
+void rc_stats_add(RcStats *to, const RcStats *from);
+
+typedef struct RcDfa RcDfa;
+
+/* Everything a comparison modifies. A context may be used by one
+   thread at a time; threads comparing in parallel need one context
+   each. */
+typedef struct
+{
+    /* Set on error (i.e. failed memory allocation, unexpected
+       regexp construct), used by the XS glue as an argument to
+       croak. Value isn't freed - it must be a literal string. */
+    char *error;
+
+    RcLimits limits;
+
+    RcStats stats;
+
+    /* Memory cap (in bytes) of the automaton kept by a compiled
+       regexp for rc_nfa_compare. 0 keeps none (and doesn't look at
+       the kept ones), which contexts of threads sharing compiled
+       regexps must set. */
+    size_t dfa_cache_size;
+
+    /* Set for contexts of threads other than the interpreter's (see
+       rc_matrix): comparisons which would need to call into the
+       interpreter (only to convert class maps rc_compile didn't)
+       fail, with error set to rc_perl_needed. */
+    int no_perl;
+
+    /* memo, arena & counters, private to engine.c */
+    struct RcState *state;
+} RcContext;
+
+extern char rc_perl_needed[];
+
+/* sets default limits and zero stats */
+void rc_context_init(RcContext *ctx);
+
+/* frees the private state; the context may be used again */
+void rc_context_free(RcContext *ctx);
+
+/* Returns 1 when pt1 is less than or equal to pt2, 0 when it isn't
+   (or the comparison can't decide), RC_UNDECIDED when a limit from
+   ctx->limits was exceeded and -1 on error. */
+int rc_compare(RcContext *ctx, REGEXP *pt1, REGEXP *pt2);
+
+/* Facts about the strings a regexp matches, used to reject
+   comparisons without looking at the program. Only computed by
+   rc_compile, for regexps without UTF-8. */
+typedef struct
+{
+    /* set when the fields below are known */
+    int valid;
+
+    /* a string the regexp matches (verified by Perl's regexp
+       engine), null if none was found */
+    char *witness;
+    STRLEN witness_len;
+
+    /* bounds of the length of a matching string; maxlen is
+       RC_UNBOUNDED unless the regexp is anchored at both ends */
+    STRLEN minlen;
+    STRLEN maxlen;
+
+    /* literals every matching string contains (either may be null) */
+    char *substr[2];
+    STRLEN substr_len[2];
+
+    /* set when the regexp is anchored at the start of the string
+       and first_bytes holds all bytes a matching string can start
+       with */
+    int has_first_bytes;
+    unsigned char first_bytes[32];
+} RcSummary;
+
+#define RC_UNBOUNDED ((STRLEN)-1)
+
+/* Regexp compiled once, for comparing with many others. */
+typedef struct
+{
+    REGEXP *rx;
+
+    /* start of the compiled program, null when the regexp can't be
+       compared */
+    regnode *program;
+
+    /* reason for null program (literal string, like
+       RcContext.error) */
+    char *error;
+
+    /* FORCED_* flags from the regexp source, computed once by
+       rc_compile */
+    unsigned forced;
+
+    /* number of regnodes in program, including END; -1 if unknown */
+    int size;
+
+    /* structural hash, valid when hashed is set */
+    int hashed;
+    UV hash;
+
+    RcSummary summary;
+
+    /* comparison IR of the program - fixed-size node records,
+       literal chars in one run and interned charsets - built once by
+       rc_compile (private to engine.c); null when it wasn't */
+    struct RcIr *ir;
+
+    /* automaton of rc_nfa_compare, null until needed */
+    RcDfa *dfa;
+} RcCompiled;
+
+/* might croak but never returns null */
+RcCompiled *rc_compile(RcContext *ctx, SV *rs);
+
+void rc_compiled_free(RcCompiled *c);
+
+/* Hash of the program's structure, ignoring nodes which don't match
+   anything and group numbers, so that e.g. /a{1,}/ and /(?:a)+/ get
+   the same value. Regexps whose programs can't be hashed get a hash
+   of their source. Computed on first call; not thread-safe. */
+UV rc_structural_hash(RcContext *ctx, RcCompiled *c);
+
+/* Same return value as rc_compare. Pairs which the summaries prove
+   incomparable return 0 without running the comparison. */
+int rc_compare_compiled(RcContext *ctx, RcCompiled *c1, RcCompiled *c2);
+
+/* For other deciders called by rc_compare_compiled: */
+
+/* Offset of the node following p (see regnext), -1 on error (with
+   ctx->error set). */
+int rc_node_offset(RcContext *ctx, regnode *p);
+
+/* Counts a step of the current comparison; returns true (with
+   ctx->error set) when it exceeded its budget. */
+int rc_over_budget(RcContext *ctx);
 
 #endif
@@ -0,0 +1,396 @@
+#include "index.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Keys are looked up by their first GRAM_MAX bytes (or all of them,
+   if shorter); the rest is compared when the witness is scanned. */
+#define GRAM_MAX 3
+
+#define INITIAL_TABLE_SIZE 64
+
+/* ids of entries whose keys start with the same gram */
+typedef struct
+{
+    /* bytes of the gram in the low 24 bits, its length in the high
+       byte; 0 for an empty slot */
+    U32 gram;
+
+    int *ids;
+    int count;
+    int alloc;
+} Posting;
+
+struct RcIndex
+{
+    RcCompiled **entries;
+    int count;
+    int alloc;
+
+    /* ids of entries without a key */
+    int *unkeyed;
+    int unkeyed_count;
+    int unkeyed_alloc;
+
+    /* open addressing, size is a power of 2 */
+    Posting *table;
+    int table_size;
+    int table_used;
+
+    /* mark[id] == stamp for entries already found by the current
+       query; has alloc elements */
+    unsigned *mark;
+    unsigned stamp;
+};
+
+static int push_id(int **v, int *count, int *alloc, int id)
+{
+    int *nv;
+    int na;
+
+    if (*count == *alloc)
+    {
+	na = *alloc ? 2 * *alloc : 4;
+	nv = (int *)realloc(*v, na * sizeof(int));
+	if (!nv)
+	{
+	    return -1;
+	}
+
+	*v = nv;
+	*alloc = na;
+    }
+
+    (*v)[(*count)++] = id;
+    return 0;
+}
+
+static void remove_id(int *v, int *count, int id)
+{
+    int i;
+
+    for (i = 0; i < *count; ++i)
+    {
+	if (v[i] == id)
+	{
+	    v[i] = v[--(*count)];
+	    return;
+	}
+    }
+}
+
+static U32 make_gram(const char *s, STRLEN len)
+{
+    U32 g;
+    STRLEN i;
+
+    g = (U32)len << 24;
+    for (i = 0; i < len; ++i)
+    {
+	g |= (U32)(unsigned char)s[i] << (8 * i);
+    }
+
+    return g;
+}
+
+static Posting *find_posting(Posting *table, int table_size, U32 gram)
+{
+    unsigned i;
+
+    i = (gram * 2654435761U) & (table_size - 1);
+    while (table[i].gram && (table[i].gram != gram))
+    {
+	i = (i + 1) & (table_size - 1);
+    }
+
+    return table + i;
+}
+
+static int grow_table(RcIndex *ix)
+{
+    Posting *nt, *p;
+    int ns, i;
+
+    ns = ix->table_size ? 2 * ix->table_size : INITIAL_TABLE_SIZE;
+    nt = (Posting *)calloc(ns, sizeof(Posting));
+    if (!nt)
+    {
+	return -1;
+    }
+
+    for (i = 0; i < ix->table_size; ++i)
+    {
+	if (ix->table[i].gram)
+	{
+	    p = find_posting(nt, ns, ix->table[i].gram);
+	    *p = ix->table[i];
+	}
+    }
+
+    free(ix->table);
+    ix->table = nt;
+    ix->table_size = ns;
+    return 0;
+}
+
+/* the longest literal from the summary, null if none is known */
+static char *entry_key(RcCompiled *c, STRLEN *len)
+{
+    RcSummary *sm;
+    int k;
+
+    sm = &(c->summary);
+    if (!sm->valid)
+    {
+	return 0;
+    }
+
+    k = (sm->substr_len[1] > sm->substr_len[0]) ? 1 : 0;
+    *len = sm->substr_len[k];
+    return sm->substr[k];
+}
+
+RcIndex *rc_index_new(void)
+{
+    return (RcIndex *)calloc(1, sizeof(RcIndex));
+}
+
+void rc_index_free(RcIndex *ix)
+{
+    int i;
+
+    if (!ix)
+    {
+	return;
+    }
+
+    for (i = 0; i < ix->table_size; ++i)
+    {
+	free(ix->table[i].ids);
+    }
+
+    free(ix->table);
+    free(ix->unkeyed);
+    free(ix->mark);
+    free(ix->entries);
+    free(ix);
+}
+
+int rc_index_size(RcIndex *ix)
+{
+    return ix->count;
+}
+
+RcCompiled *rc_index_entry(RcIndex *ix, int id)
+{
+    return ((id >= 0) && (id < ix->count)) ? ix->entries[id] : 0;
+}
+
+int rc_index_add(RcContext *ctx, RcIndex *ix, RcCompiled *c)
+{
+    RcCompiled **ne;
+    unsigned *nm;
+    Posting *p;
+    char *key;
+    STRLEN len;
+    U32 gram;
+    int id, na;
+
+    if (ix->count == ix->alloc)
+    {
+	na = ix->alloc ? 2 * ix->alloc : 16;
+	ne = (RcCompiled **)realloc(ix->entries, na * sizeof(RcCompiled *));
+	if (!ne)
+	{
+	    ctx->error = "Couldn't allocate memory for index";
+	    return -1;
+	}
+
+	ix->entries = ne;
+
+	nm = (unsigned *)realloc(ix->mark, na * sizeof(unsigned));
+	if (!nm)
+	{
+	    ctx->error = "Couldn't allocate memory for index";
+	    return -1;
+	}
+
+	memset(nm + ix->alloc, 0, (na - ix->alloc) * sizeof(unsigned));
+	ix->mark = nm;
+	ix->alloc = na;
+    }
+
+    id = ix->count;
+    key = entry_key(c, &len);
+    if (!key)
+    {
+	if (push_id(&(ix->unkeyed), &(ix->unkeyed_count),
+		&(ix->unkeyed_alloc), id) < 0)
+	{
+	    ctx->error = "Couldn't allocate memory for index";
+	    return -1;
+	}
+    }
+    else
+    {
+	/* keep the load under 1/2 */
+	if ((2 * (ix->table_used + 1) > ix->table_size) &&
+	    (grow_table(ix) < 0))
+	{
+	    ctx->error = "Couldn't allocate memory for index";
+	    return -1;
+	}
+
+	gram = make_gram(key, (len < GRAM_MAX) ? len : GRAM_MAX);
+	p = find_posting(ix->table, ix->table_size, gram);
+	if (push_id(&(p->ids), &(p->count), &(p->alloc), id) < 0)
+	{
+	    ctx->error = "Couldn't allocate memory for index";
+	    return -1;
+	}
+
+	if (!p->gram)
+	{
+	    p->gram = gram;
+	    ++(ix->table_used);
+	}
+    }
+
+    ix->entries[id] = c;
+    ++(ix->count);
+    return id;
+}
+
+void rc_index_remove(RcIndex *ix, int id)
+{
+    Posting *p;
+    char *key;
+    STRLEN len;
+
+    if (!rc_index_entry(ix, id))
+    {
+	return;
+    }
+
+    key = entry_key(ix->entries[id], &len);
+    if (!key)
+    {
+	remove_id(ix->unkeyed, &(ix->unkeyed_count), id);
+    }
+    else
+    {
+	p = find_posting(ix->table, ix->table_size,
+	    make_gram(key, (len < GRAM_MAX) ? len : GRAM_MAX));
+	remove_id(p->ids, &(p->count), id);
+    }
+
+    ix->entries[id] = 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+int rc_index_candidates(RcContext *ctx, RcIndex *ix, RcCompiled *c,
+    int *ids)
+{
+    Posting *p;
+    char *w, *key;
+    STRLEN len, key_len, glen, i;
+    int n, j, id;
+
+    if (!c->summary.witness)
+    {
+	n = 0;
+	for (j = 0; j < ix->count; ++j)
+	{
+	    if (ix->entries[j])
+	    {
+		ids[n++] = j;
+	    }
+	}
+
+	return n;
+    }
+
+    /* stamps wrap around after 2^32 queries - start over */
+    if (!++(ix->stamp))
+    {
+	memset(ix->mark, 0, ix->alloc * sizeof(unsigned));
+	ix->stamp = 1;
+    }
+
+    memcpy(ids, ix->unkeyed, ix->unkeyed_count * sizeof(int));
+    n = ix->unkeyed_count;
+
+    w = c->summary.witness;
+    len = c->summary.witness_len;
+    for (i = 0; (i < len) && ix->table_size; ++i)
+    {
+	for (glen = 1; (glen <= GRAM_MAX) && (i + glen <= len); ++glen)
+	{
+	    p = find_posting(ix->table, ix->table_size,
+		make_gram(w + i, glen));
+	    for (j = 0; j < p->count; ++j)
+	    {
+		id = p->ids[j];
+		if (ix->mark[id] == ix->stamp)
+		{
+		    continue;
+		}
+
+		key = entry_key(ix->entries[id], &key_len);
+		if ((glen < GRAM_MAX) && (key_len != glen))
+		{
+		    continue;
+		}
+
+		if ((i + key_len <= len) && !memcmp(w + i, key, key_len))
+		{
+		    ix->mark[id] = ix->stamp;
+		    ids[n++] = id;
+		}
+	    }
+	}
+    }
+
+    qsort(ids, n, sizeof(int), compare_ids);
+    return n;
+}
+
+int rc_index_supersets(RcContext *ctx, RcIndex *ix, RcCompiled *c,
+    int *ids)
+{
+    int i, k, n, rv;
+
+    n = rc_index_candidates(ctx, ix, c, ids);
+    if (n < 0)
+    {
+	return n;
+    }
+
+    k = 0;
+    for (i = 0; i < n; ++i)
+    {
+	rv = rc_compare_compiled(ctx, c, ix->entries[ids[i]]);
+	if (rv < 0)
+	{
+	    if (rv == RC_UNDECIDED)
+	    {
+		continue;
+	    }
+
+	    return rv;
+	}
+
+	if (rv)
+	{
+	    ids[k++] = ids[i];
+	}
+    }
+
+    return k;
+}
@@ -0,0 +1,47 @@
+#ifndef index_h
+#define index_h
+
+#include "engine.h"
+
+/* Compiled regexps keyed by a literal every string they match must
+   contain (the longest substring from the summary), for finding the
+   ones which can be greater or equal to a given regexp without
+   comparing it to all of them: a regexp matching the witness of c
+   must find its literal in the witness. Entries get consecutive ids
+   starting at 0. The index doesn't own the entries, which must stay
+   alive (and unmodified) while they're in it. */
+typedef struct RcIndex RcIndex;
+
+/* returns null on failed memory allocation */
+RcIndex *rc_index_new(void);
+
+void rc_index_free(RcIndex *ix);
+
+/* number of ids given out so far (including removed entries) */
+int rc_index_size(RcIndex *ix);
+
+/* null for ids which were removed (or never given out) */
+RcCompiled *rc_index_entry(RcIndex *ix, int id);
+
+/* Returns the id of the added entry, -1 on error (with ctx->error
+   set). */
+int rc_index_add(RcContext *ctx, RcIndex *ix, RcCompiled *c);
+
+/* The id isn't reused. */
+void rc_index_remove(RcIndex *ix, int id);
+
+/* Stores ids of the entries which may be greater or equal to c (in
+   ascending order) into ids, which must have room for
+   rc_index_size(ix) elements. Entries with no literal known are
+   always included, as are all entries when c has no witness. Returns
+   the number of ids stored, -1 on error (with ctx->error set). */
+int rc_index_candidates(RcContext *ctx, RcIndex *ix, RcCompiled *c,
+    int *ids);
+
+/* Like rc_index_candidates, but keeps just the entries which c is
+   actually less or equal to (undecided comparisons count as not less
+   or equal). */
+int rc_index_supersets(RcContext *ctx, RcIndex *ix, RcCompiled *c,
+    int *ids);
+
+#endif
@@ -8,10 +8,11 @@ require Exporter;
 
 our @ISA = qw(Exporter);
 
-our @EXPORT_OK = qw(is_less_or_equal);
+our @EXPORT_OK = qw(is_less_or_equal is_less_or_equal_compiled
+    subsumption_matrix minimize_blacklist merge_blacklist);
 our @EXPORT = qw();
 
-our $VERSION = '0.23';
+our $VERSION = '0.24';
 
 require XSLoader;
 XSLoader::load('Regexp::Compare', $VERSION);
@@ -21,6 +22,230 @@ sub is_less_or_equal {
     return Regexp::Compare::_is_less_or_equal(@_);
 }
 
+sub subsumption_matrix {
+    my ($rx, @opts) = @_;
+
+    # options may be passed as a hash reference or a list
+    my $opts = (@opts == 1) ? $opts[0] : { @opts };
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return Regexp::Compare::_subsumption_matrix($rx, $opts);
+}
+
+sub minimize_blacklist {
+    my ($rx, $stats, $opts) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    my @keep = Regexp::Compare::_minimize_blacklist($rx, $stats, $opts);
+    return @$rx[@keep];
+}
+
+# a character matching itself, unless followed by a quantifier
+my $literal = qr/[^\\^\$.|?*+()\[\]{}]|\\[^\w\s]/;
+
+# Splits a regexp into the literal characters it starts with and the
+# rest. Regexps with alternation at the top level have no prefix.
+sub _literal_prefix {
+    my $rx = shift;
+
+    my ($depth, $class) = (0, 0);
+    for (my $i = 0; $i < length($rx); ++$i) {
+	my $c = substr($rx, $i, 1);
+	if ($c eq '\\') {
+	    ++$i;
+	} elsif ($class) {
+	    $class = 0 if $c eq ']';
+	} elsif ($c eq '[') {
+	    $class = 1;
+	    ++$i if substr($rx, $i + 1, 1) eq '^';
+	    ++$i if substr($rx, $i + 1, 1) eq ']';
+	} elsif ($c eq '(') {
+	    ++$depth;
+	} elsif ($c eq ')') {
+	    --$depth;
+	} elsif (($c eq '|') && !$depth) {
+	    return ([], $rx);
+	}
+    }
+
+    my @chars;
+    while ($rx =~ /\G($literal)(?![?*+{])/gc) {
+	push @chars, substr($1, -1);
+    }
+
+    return (\@chars, substr($rx, pos($rx) || 0));
+}
+
+# alternatives matching the union of regexps in a trie node
+sub _trie_branches {
+    my $node = shift;
+
+    my @branches;
+    for my $c (sort keys %{$node->{next}}) {
+	my @sub = _trie_branches($node->{next}{$c});
+	push @branches, quotemeta($c) .
+	    ((@sub == 1) ? $sub[0] : '(?:' . join('|', @sub) . ')');
+    }
+
+    # rests are grouped, so inline modifiers can't leak into the
+    # next branch
+    for my $rest (@{$node->{rest}}) {
+	push @branches, ($rest =~ /^(?:$literal)*\z/) ? $rest : "(?:$rest)";
+    }
+
+    return @branches;
+}
+
+sub merge_blacklist {
+    my ($rx, $stats, $opts) = @_;
+
+    my @min = minimize_blacklist($rx, $stats, $opts);
+    for (@min) {
+	die "Regexp::Compare: merge_blacklist takes strings" if ref;
+    }
+
+    if (!@min) {
+	$stats->{verified} = 1 if $stats;
+	return '(?!)';
+    }
+
+    my $root = {};
+    for my $r (@min) {
+	my ($chars, $rest) = _literal_prefix($r);
+	my $node = $root;
+	$node = $node->{next}{$_} ||= {} for @$chars;
+	push @{$node->{rest}}, $rest;
+    }
+
+    my $merged = join('|', _trie_branches($root));
+    my $union = join('|', map { "(?:$_)" } @min);
+
+    my $verified = is_less_or_equal($merged, $union, $opts) &&
+	is_less_or_equal($union, $merged, $opts);
+    $stats->{verified} = $verified ? 1 : 0 if $stats;
+
+    return $verified ? $merged : $union;
+}
+
+package Regexp::Compare::Compiled;
+
+sub new {
+    my ($class, $rx) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return Regexp::Compare::Compiled::_compile($rx);
+}
+
+# the wrapped regexp isn't shared between threads
+sub CLONE_SKIP { 1 }
+
+package Regexp::Compare::Index;
+
+sub new {
+    return Regexp::Compare::Index::_new();
+}
+
+sub add {
+    my ($self, $rx) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return $self->_add($rx);
+}
+
+sub candidates {
+    my ($self, $rx) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return $self->_candidates($rx, 0);
+}
+
+sub supersets {
+    my ($self, $rx, $opts) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return $self->_candidates($rx, 1, $opts);
+}
+
+# entries are compiled regexps
+sub CLONE_SKIP { 1 }
+
+package Regexp::Compare::Set;
+
+sub new {
+    return Regexp::Compare::Set::_new();
+}
+
+sub add {
+    my ($self, $rx, $opts) = @_;
+
+    local ${^RE_TRIE_MAXBUF} = -1;
+    return $self->_add($rx, $opts);
+}
+
+sub CLONE_SKIP { 1 }
+
+package Regexp::Compare::Matcher;
+
+sub new {
+    my ($class, $rx, $opts) = @_;
+
+    my $set = Regexp::Compare::Set->new;
+    $set->add($_, $opts) for @$rx;
+
+    my $self = bless {
+	qr => [ map { qr/$_/ } @$rx ],
+	maximal => [ $set->maximal ],
+	lower => [],
+	nup => [],
+	executions => 0,
+    }, $class;
+
+    for my $id (0 .. $#$rx) {
+	$self->{lower}[$id] = [ $set->lower($id) ];
+	$self->{nup}[$id] = () = $set->upper($id);
+    }
+
+    return $self;
+}
+
+sub match {
+    my ($self, $str) = @_;
+
+    # whatever matches, some maximal element above it matches as well
+    for my $id (@{$self->{maximal}}) {
+	++$self->{executions};
+	return 1 if $str =~ $self->{qr}[$id];
+    }
+
+    return 0;
+}
+
+sub matching {
+    my ($self, $str) = @_;
+
+    # an element is tried only after all elements immediately above
+    # it matched
+    my @queue = @{$self->{maximal}};
+    my (@matched, @hits);
+    while (@queue) {
+	my $id = shift @queue;
+
+	++$self->{executions};
+	next unless $str =~ $self->{qr}[$id];
+
+	push @matched, $id;
+	for my $d (@{$self->{lower}[$id]}) {
+	    push @queue, $d if ++$hits[$d] == $self->{nup}[$d];
+	}
+    }
+
+    return sort { $a <=> $b } @matched;
+}
+
+sub executions {
+    return $_[0]->{executions};
+}
+
 1;
 __END__
 
@@ -54,6 +279,226 @@ probably won't do what you want - use
 
 instead.
 
+When the same regexp is compared with many others, it's faster to
+compile it just once:
+
+  use Regexp::Compare qw(is_less_or_equal_compiled);
+
+  @c = map { Regexp::Compare::Compiled->new($_) } @rx;
+  $rv = is_less_or_equal_compiled($c[0], $c[1]);
+
+C<Regexp::Compare::Compiled-E<gt>new> takes the same string as
+C<is_less_or_equal> and dies if it can't be compiled;
+C<is_less_or_equal_compiled> returns the same value as
+C<is_less_or_equal> would for the original strings. Compiled regexps
+(without UTF-8) also remember a few cheap facts - a string they
+match, the minimal and maximal length of a match, literals every
+match contains and bytes it may start with - which quickly reject
+most pairs of unrelated regexps.
+
+  $s = Regexp::Compare::stats();
+
+returns a hash reference of counters accumulated by the current
+interpreter: C<comparisons>, C<steps>, C<memo_hits>, C<class_hits>
+(character classes compared by a table lookup, because the same
+pair of classes was compared before), C<undecided>,
+C<prefiltered> (comparisons decided by the facts above),
+C<automaton> (see below), C<cache_hits> and C<cache_misses> (see
+below).
+
+Pairs the node-by-node comparison can't decide (e.g. C<(?:aa)+>
+against C<a{2,}>) get a second chance: when both regexps consist
+only of literals, character classes, alternation, repetition and
+anchors at either end, they're translated into finite automata and
+checked for inclusion. Where the meaning of a construct depends on
+the Unicode rules, the check assumes the worst, so it may fail to
+prove a relation but doesn't claim a false one. C<automaton> counts
+the comparisons it decided.
+
+The automaton of the second regexp is built lazily, and a compiled
+regexp keeps it for later comparisons, so comparing many regexps with
+the same one doesn't translate it again. Its memory is capped at 1MB
+by default:
+
+  Regexp::Compare::set_dfa_cache_size($bytes);
+
+changes the cap (for automata growing afterwards); when an automaton
+reaches it, its states are dropped and the comparison starts over,
+and a comparison reaching it twice gives up (returning false).
+C<stats> counts these in C<dfa_flushes>. C<set_dfa_cache_size(0)>
+stops keeping automata.
+
+Results of C<is_less_or_equal> can be kept in a file, so that
+repeated runs (or several processes) don't compute them again:
+
+  Regexp::Compare::open_cache($path, { slots => 1 << 20 });
+  ...
+  Regexp::Compare::close_cache();
+
+The file is created (with the given number of slots, about 24 bytes
+each) if it doesn't exist and mapped into memory; when it does
+exist, it keeps its size. It's keyed by a 128-bit hash of both
+regexps and the versions of this module (and of its comparison
+engine) and Perl, and holds only decided results - an undecided
+comparison is computed again next time. Results overwrite each other when the table gets full. With
+C<read_only =E<gt> 1>, the file is just read, and any number of
+processes can share it. The cache belongs to the interpreter which
+opened it - new threads start without one.
+
+Applications comparing the same strings over and over can instead
+(or as well) keep recent results in memory:
+
+  Regexp::Compare::set_lru_size(10000);
+
+makes C<is_less_or_equal> remember that many decided results, keyed
+the same way, and answer repeated comparisons without compiling the
+regexps; when full, the least recently used result is dropped.
+C<set_lru_size(0)> turns it off. C<stats> reports C<lru_hits>,
+C<lru_misses> and C<lru_hit_rate> (undefined before the first
+lookup). New threads get an empty LRU of the same size.
+
+To compare all pairs of a list in one call, use
+
+  use Regexp::Compare qw(subsumption_matrix);
+
+  $m = subsumption_matrix(\@rx);
+  if (vec($m, $i * @rx + $j, 1)) {
+      print "$rx[$i] <= $rx[$j]\n";
+  }
+
+Elements of C<@rx> may be strings or C<Regexp::Compare::Compiled>
+objects. Every string is compiled just once and all comparisons run
+without returning to Perl; the bits on the diagonal (comparing a
+regexp with itself) are left clear. On perls with thread support,
+the comparisons can be spread over several native threads:
+
+  $m = subsumption_matrix(\@rx, threads => 16);
+
+(the options may also be passed as a hash reference). Regexps are
+compiled by the calling thread before the workers start; workers
+which run out of pairs take over part of the remaining ones from
+the others.
+
+Usually, what you really want is just to remove the redundant
+elements of a blacklist:
+
+  use Regexp::Compare qw(minimize_blacklist);
+
+  @short = minimize_blacklist(\@rx, \%stats);
+
+returns the elements of C<@rx> (strings or
+C<Regexp::Compare::Compiled> objects, in their original order) which
+aren't less or equal to any other element - of equivalent regexps,
+the first one is kept. Regexps already found to be redundant aren't
+compared any further, so the call typically needs far fewer than
+C<@rx * (@rx - 1)> comparisons; when the optional hash reference is
+passed, its C<comparisons> element is set to the number of
+comparisons made and C<saved> to the number of comparisons skipped.
+Regexps compiling to the same program as an earlier element (say,
+C<a{1,}> and C<(?:a)+>) are just compared with it (in case their
+hashes merely collide) and then dropped; their number is stored in
+C<duplicates>. The hash used for finding them is also available as
+
+  $h = Regexp::Compare::Compiled->new($rx)->structural_hash;
+
+It ignores group numbers and nodes which don't match anything;
+regexps which can't be hashed structurally get a hash of their
+source.
+
+When a regexp is added to an already minimized blacklist, it only
+needs to be compared with the elements which may match all its
+strings:
+
+  $ix = Regexp::Compare::Index->new;
+  $ix->add($_) for @rx;
+  @ids = $ix->supersets($new_rx);
+  print "redundant\n" if @ids;
+
+C<add> takes a string or a C<Regexp::Compare::Compiled> object and
+returns its id (ids are consecutive, starting at 0); the object is
+available as C<$ix-E<gt>entry($id)> and the number of entries as
+C<$ix-E<gt>size>. C<supersets> returns the ids of the entries which
+the argument is less or equal to (it takes the same hash reference
+of limits as C<is_less_or_equal_compiled>, with undecided pairs
+treated as not less or equal), while C<candidates> just returns the
+ids which might be - without any comparison. The index keys every
+entry by a literal all its matches contain and looks the keys up in
+a string matched by the argument, so the candidates are usually a
+small fraction of the entries; entries without a known literal are
+always candidates.
+
+A blacklist which changes over time can be kept minimized
+incrementally:
+
+  $set = Regexp::Compare::Set->new;
+  ($id, $redundant) = $set->add($rx);
+  $released = $set->remove($old_id);
+  @short = map { $set->entry($_) } $set->maximal;
+
+The set keeps its elements (strings are compiled by C<add>) together
+with the Hasse diagram of their order - edges lead from every element
+to the elements immediately greater, which C<$set-E<gt>upper($id)>
+lists (C<$set-E<gt>lower($id)> lists the immediately smaller ones).
+Of equivalent elements, the one added first counts as greater.
+C<add> looks for greater elements just among the candidates found by
+an index (as above), skips the elements below any element found to
+be smaller, doesn't touch the edges of unrelated elements and
+returns its id together with a reference to the list of ids which
+became redundant (i.e. got a greater element), including the new one
+if it is; it takes the same limits as C<is_less_or_equal_compiled>.
+C<remove> returns a reference to the list of ids which stopped being
+redundant. Ids aren't reused; C<$set-E<gt>ids> lists the current ones
+and C<maximal> those which aren't redundant.
+
+To run a single regexp instead of the whole list,
+
+  use Regexp::Compare qw(merge_blacklist);
+
+  $rx = merge_blacklist(\@rx, \%stats);
+
+minimizes C<@rx> (which must consist of strings) and joins the
+remaining elements into one alternation, with common literal
+prefixes factored out into nested groups - C<foobar>, C<foobaz> and
+C<fooqux\d+> become C<foo(?:ba(?:r|z)|qux(?:\d+))>. The result is
+compared with the plain alternation of the elements both ways; when
+the comparison can't prove them equivalent, the plain alternation is
+returned instead. C<%stats> gets the same elements as for
+C<minimize_blacklist>, plus C<verified> telling which happened; an
+optional hash reference of limits may follow.
+
+The order can also speed up matching against the blacklist:
+
+  $m = Regexp::Compare::Matcher->new(\@rx);
+  print "banned\n" if $m->match($url);
+  @hits = $m->matching($url);
+
+C<match> tries just the maximal elements of C<@rx> - when a regexp
+matches, so does every regexp greater than it. C<matching> returns
+the indices of all elements of C<@rx> matching its argument, trying
+the most general regexps first and every other one only after all
+the regexps immediately greater than it matched; when a regexp
+doesn't match, nothing less than it is tried. C<$m-E<gt>executions>
+returns the number of regexp executions so far. The optional second
+argument of C<new> is a hash reference of limits for building the
+order, as for C<Regexp::Compare::Set>.
+
+Both C<is_less_or_equal> and C<is_less_or_equal_compiled> take an
+optional hash reference of limits as their third argument:
+
+  $rv = is_less_or_equal($rx1, $rx2,
+      { max_depth => 1000, max_steps => 100000, deadline_ms => 50 });
+
+C<max_depth> bounds the nesting of the comparison (the default is
+4096), protecting the C stack from deeply nested regexps (the length
+of a regexp, or a repeat count, doesn't add to the nesting). C<max_steps> bounds the number of internal comparison steps
+and C<deadline_ms> the run time in milliseconds (checked every 1024
+steps); neither is limited by default. When a limit is exceeded, the
+functions return C<undef> instead of dying. C<subsumption_matrix>
+and C<minimize_blacklist> take the same hash reference as their last
+argument (pass C<undef> for the statistics of C<minimize_blacklist>
+when they aren't wanted), apply the limits to each comparison and
+treat undecided pairs as not less or equal.
+
 False return value does I<not> imply that there's a string matched by
 the first regexp which isn't matched by the second - many regular
 expressions (i.e. those containing Perl code) are impossible to
@@ -0,0 +1,1775 @@
+#include "nfa.h"
+#include "regapi.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Symbols of the automata are bytes (standing for characters
+   0 - 0xff, in strings with or without UTF-8), NFA_WIDE, standing
+   for all characters above 0xff, and the keys after it, standing for
+   the non-ASCII members of POSIX classes (which depend on the Unicode
+   rules and, for /d, on the matched string) - one for each class and
+   rules (see class_key). A character stands for the first key of a
+   class it's a member of, and for its byte or NFA_WIDE only when it
+   isn't a member of any. */
+#define NFA_WIDE 256
+#define NFA_KEYS 14
+#define NFA_SYMBOLS (NFA_WIDE + 1 + NFA_KEYS)
+
+#define TOLOWER(c) ((((c) >= 'A') && ((c) <= 'Z')) ? ((c) - 'A' + 'a') : (c))
+
+#define SET_SIZE ((NFA_SYMBOLS + 7) / 8)
+#define SET_HAS(set, c) (((set)[(c) / 8] >> ((c) % 8)) & 1)
+#define SET_ADD(set, c) ((set)[(c) / 8] |= 1 << ((c) % 8))
+
+/* NfaState.kind */
+#define NFA_CHAR 0
+#define NFA_SPLIT 1
+#define NFA_BOS 2
+#define NFA_EOS 3
+/* accepts, and stays on any symbol */
+#define NFA_MATCH 4
+
+/* flags of close_states */
+#define CLOSE_BOS 1
+#define CLOSE_EOS 2
+
+/* DfaState.flags */
+#define DFA_START 1
+#define DFA_ACCEPT 2
+/* contains NFA_MATCH, i.e. accepts whatever follows */
+#define DFA_UNIVERSAL 4
+
+/* character classes of POSIX nodes, ordered so that (the non-ASCII
+   members of) a class come before its superclasses */
+#define CLASS_DIGIT 0
+#define CLASS_XDIGIT 1
+#define CLASS_ALPHA 2
+#define CLASS_ALNUM 3
+#define CLASS_WORD 4
+#define CLASS_BLANK 5
+#define CLASS_SPACE 6
+
+/* symbol of the key for a class, under the Unicode rules or those of
+   /d (whose members are also members under the Unicode rules) */
+#define class_key(cls, unicode) (NFA_WIDE + 1 + 2 * (cls) + ((unicode) ? 1 : 0))
+
+typedef struct
+{
+    unsigned char kind;
+
+    /* index into Nfa.sets, for NFA_CHAR */
+    int set;
+
+    /* next state, -1 for NFA_MATCH */
+    int out;
+
+    /* other next state, for NFA_SPLIT */
+    int out2;
+} NfaState;
+
+typedef struct
+{
+    NfaState *states;
+    int size;
+    int alloc;
+
+    unsigned char (*sets)[SET_SIZE];
+    int nsets;
+    int asets;
+
+    int start;
+
+    /* set for the left regexp, whose sets are approximated from
+       above; the right one's are approximated from below */
+    int over;
+
+    /* set when the program contains something not translated */
+    int unsupported;
+
+    int depth;
+
+    /* nesting of repetitions */
+    int loops;
+
+    /* scratch space for close_states, alloc elements */
+    unsigned *mark;
+    unsigned stamp;
+} Nfa;
+
+/* returned instead of a state which would take the automaton over
+   its memory cap */
+#define DFA_FULL -3
+
+/* returned when the search visits more than RC_NFA_MAX_PAIRS pairs
+   (not RC_UNDECIDED, which is passed on to the caller) */
+#define SEARCH_FULL -4
+
+/* Lazily built subset automaton of an Nfa; states are identified by
+   index, their NFA states are a bitset of words elements. */
+typedef struct
+{
+    Nfa *nfa;
+
+    /* maximal memory of the states (see dfa_memory) */
+    size_t cap;
+
+    /* symbol classes of nfa (symbols which no set tells apart) */
+    short classes[NFA_SYMBOLS];
+    int nclasses;
+
+    int words;
+
+    /* words per state, followed by room for one more (the key of a
+       state being looked up) */
+    U32 *bits;
+
+    /* nclasses per state, -1 while not known */
+    int *next;
+
+    unsigned char *flags;
+
+    int size;
+    int alloc;
+
+    /* open-addressing table of state indices, -1 for empty slots */
+    int *table;
+    int tsize;
+
+    /* scratch space for NFA state lists, 2 * nfa->size elements */
+    int *list;
+} Dfa;
+
+/* the right automaton of a compiled regexp (see RcCompiled.dfa) */
+struct RcDfa
+{
+    /* 0 when the regexp can't be translated (and the members below
+       are empty) */
+    int built;
+
+    Nfa nfa;
+    Dfa dfa;
+};
+
+typedef struct
+{
+    int *v;
+    int count;
+    int alloc;
+} IntVec;
+
+static int push_int(IntVec *vec, int n)
+{
+    int *nv;
+    int na;
+
+    if (vec->count == vec->alloc)
+    {
+	na = vec->alloc ? 2 * vec->alloc : 8;
+	nv = (int *)realloc(vec->v, na * sizeof(int));
+	if (!nv)
+	{
+	    return -1;
+	}
+
+	vec->v = nv;
+	vec->alloc = na;
+    }
+
+    vec->v[vec->count++] = n;
+    return 0;
+}
+
+static void nfa_free(Nfa *nfa)
+{
+    free(nfa->states);
+    free(nfa->sets);
+    free(nfa->mark);
+}
+
+/* Returns the index of the new state, -1 on failure (with
+   ctx->error set on failed memory allocation, nfa->unsupported set
+   when the automaton got too big). */
+static int add_state(RcContext *ctx, Nfa *nfa, int kind, int set, int out,
+    int out2)
+{
+    NfaState *ns;
+    int na;
+
+    if (nfa->size == nfa->alloc)
+    {
+	if (nfa->size >= RC_NFA_MAX_STATES)
+	{
+	    nfa->unsupported = 1;
+	    return -1;
+	}
+
+	na = nfa->alloc ? 2 * nfa->alloc : 64;
+	ns = (NfaState *)realloc(nfa->states, na * sizeof(NfaState));
+	if (!ns)
+	{
+	    ctx->error = "Couldn't allocate memory for automaton";
+	    return -1;
+	}
+
+	nfa->states = ns;
+	nfa->alloc = na;
+    }
+
+    ns = nfa->states + nfa->size;
+    ns->kind = kind;
+    ns->set = set;
+    ns->out = out;
+    ns->out2 = out2;
+    return nfa->size++;
+}
+
+/* adds a state matching a symbol of set */
+static int add_char(RcContext *ctx, Nfa *nfa, const unsigned char *set,
+    int out)
+{
+    unsigned char (*ns)[SET_SIZE];
+    int na;
+
+    if (nfa->nsets == nfa->asets)
+    {
+	na = nfa->asets ? 2 * nfa->asets : 64;
+	ns = (unsigned char (*)[SET_SIZE])realloc(nfa->sets, na * SET_SIZE);
+	if (!ns)
+	{
+	    ctx->error = "Couldn't allocate memory for automaton";
+	    return -1;
+	}
+
+	nfa->sets = ns;
+	nfa->asets = na;
+    }
+
+    memcpy(nfa->sets[nfa->nsets], set, SET_SIZE);
+    return add_state(ctx, nfa, NFA_CHAR, nfa->nsets++, out, -1);
+}
+
+static void set_range(unsigned char *set, int from, int to)
+{
+    int c;
+
+    for (c = from; c <= to; ++c)
+    {
+	SET_ADD(set, c);
+    }
+}
+
+static void set_invert(unsigned char *set)
+{
+    int i;
+
+    for (i = 0; i < SET_SIZE; ++i)
+    {
+	set[i] = ~set[i];
+    }
+
+    /* just the symbols in the last byte */
+    if (NFA_SYMBOLS % 8)
+    {
+	set[SET_SIZE - 1] &= (1 << (NFA_SYMBOLS % 8)) - 1;
+    }
+}
+
+/* Membership of ASCII char c in a POSIX class: 1 when it's a
+   member, 0 when it isn't, 2 when that depends on the Perl version
+   (\s has matched vertical tab since 5.18). */
+static int ascii_member(int cls, int c)
+{
+    int alpha, digit;
+
+    alpha = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'));
+    digit = (c >= '0') && (c <= '9');
+    switch (cls)
+    {
+    case CLASS_WORD:
+	return alpha || digit || (c == '_');
+    case CLASS_DIGIT:
+	return digit;
+    case CLASS_SPACE:
+	if (c == '\v')
+	{
+	    return 2;
+	}
+
+	return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') ||
+	    (c == '\f');
+    case CLASS_ALPHA:
+	return alpha;
+    case CLASS_ALNUM:
+	return alpha || digit;
+    case CLASS_BLANK:
+	return (c == ' ') || (c == '\t');
+    case CLASS_XDIGIT:
+	return digit || ((c >= 'a') && (c <= 'f')) ||
+	    ((c >= 'A') && (c <= 'F'));
+    }
+
+    return 0;
+}
+
+/* Returns 1 when the non-ASCII members of class a are members of
+   class b. */
+static int class_subset(int a, int b)
+{
+    switch (a)
+    {
+    case CLASS_DIGIT:
+    case CLASS_XDIGIT:
+    case CLASS_ALPHA:
+	return (a == b) || (b == CLASS_ALNUM) || (b == CLASS_WORD);
+    case CLASS_ALNUM:
+	return (a == b) || (b == CLASS_WORD);
+    case CLASS_BLANK:
+	return (a == b) || (b == CLASS_SPACE);
+    }
+
+    return a == b;
+}
+
+/* Membership of the characters standing for key in a POSIX class:
+   1 when they're all members, 0 when none is, 2 when that depends on
+   the character. */
+static int key_member(int key, int cls, int unicode)
+{
+    int kc, ku;
+
+    kc = (key - NFA_WIDE - 1) / 2;
+    ku = (key - NFA_WIDE - 1) % 2;
+    if (class_subset(kc, cls) && (unicode || !ku))
+    {
+	return 1;
+    }
+
+    /* members of the class stand for it (or an earlier key) */
+    if (key > class_key(cls, unicode))
+    {
+	return 0;
+    }
+
+    /* spaces are neither letters nor digits */
+    if ((kc >= CLASS_BLANK) != (cls >= CLASS_BLANK))
+    {
+	return 0;
+    }
+
+    return 2;
+}
+
+/* Sets lo & hi to a subset and superset of a POSIX class. */
+static void posix_bounds(int cls, int ascii_only, int unicode,
+    unsigned char *lo, unsigned char *hi)
+{
+    int c, m;
+
+    for (c = 0; c < 128; ++c)
+    {
+	m = ascii_member(cls, c);
+	if (m == 1)
+	{
+	    SET_ADD(lo, c);
+	}
+
+	if (m)
+	{
+	    SET_ADD(hi, c);
+	}
+    }
+
+    if (ascii_only)
+    {
+	return;
+    }
+
+    for (c = NFA_WIDE + 1; c < NFA_SYMBOLS; ++c)
+    {
+	m = key_member(c, cls, unicode);
+	if (m == 1)
+	{
+	    SET_ADD(lo, c);
+	}
+
+	if (m)
+	{
+	    SET_ADD(hi, c);
+	}
+    }
+}
+
+/* Sets cls, ascii_only & unicode for a POSIX class node; returns 0
+   for other nodes (and classes not handled here). */
+static int get_posix_class(regnode *p, int *cls, int *ascii_only,
+    int *unicode, int *negated)
+{
+#ifdef RC_POSIX_NODES
+    switch (p->type)
+    {
+    case POSIXD:
+    case POSIXU:
+    case POSIXA:
+	*negated = 0;
+	break;
+    case NPOSIXD:
+    case NPOSIXU:
+    case NPOSIXA:
+	*negated = 1;
+	break;
+    default:
+	return 0;
+    }
+
+    *ascii_only = (p->type == POSIXA) || (p->type == NPOSIXA);
+    *unicode = (p->type == POSIXU) || (p->type == NPOSIXU);
+    switch (p->flags)
+    {
+    case _CC_WORDCHAR:
+	*cls = CLASS_WORD;
+	break;
+    case _CC_DIGIT:
+	*cls = CLASS_DIGIT;
+	break;
+    case _CC_SPACE:
+	*cls = CLASS_SPACE;
+	break;
+    case _CC_ALPHA:
+	*cls = CLASS_ALPHA;
+	break;
+    case _CC_ALPHANUMERIC:
+	*cls = CLASS_ALNUM;
+	break;
+    case _CC_BLANK:
+	*cls = CLASS_BLANK;
+	break;
+    case _CC_XDIGIT:
+	*cls = CLASS_XDIGIT;
+	break;
+    default:
+	return 0;
+    }
+#else
+    switch (p->type)
+    {
+    case ALNUM:
+    case ALNUMA:
+    case NALNUM:
+    case NALNUMA:
+	*cls = CLASS_WORD;
+	break;
+    case DIGIT:
+    case DIGITA:
+    case NDIGIT:
+    case NDIGITA:
+	*cls = CLASS_DIGIT;
+	break;
+    case SPACE:
+    case SPACEA:
+    case NSPACE:
+    case NSPACEA:
+	*cls = CLASS_SPACE;
+	break;
+    default:
+	return 0;
+    }
+
+    *ascii_only = (p->type == ALNUMA) || (p->type == NALNUMA) ||
+	(p->type == DIGITA) || (p->type == NDIGITA) ||
+	(p->type == SPACEA) || (p->type == NSPACEA);
+    *unicode = 0;
+    *negated = (p->type == NALNUM) || (p->type == NALNUMA) ||
+	(p->type == NDIGIT) || (p->type == NDIGITA) ||
+	(p->type == NSPACE) || (p->type == NSPACEA);
+#endif
+
+    return 1;
+}
+
+/* Sets set to the symbols matched by a single-char node (from above
+   or below, as nfa->over says); returns 0 for other nodes. */
+static int get_node_set(Nfa *nfa, regnode *p, unsigned char *set)
+{
+    unsigned char lo[SET_SIZE], hi[SET_SIZE];
+    unsigned char *bitmap;
+    int i, cls, ascii_only, unicode, negated, some, all;
+
+    memset(lo, 0, SET_SIZE);
+    memset(hi, 0, SET_SIZE);
+    negated = 0;
+    if ((p->type == REG_ANY) || (p->type == SANY))
+    {
+	set_range(lo, 0, NFA_SYMBOLS - 1);
+	if (p->type == REG_ANY)
+	{
+	    lo['\n' / 8] &= ~(1 << ('\n' % 8));
+	}
+
+	memcpy(hi, lo, SET_SIZE);
+    }
+    else if (p->type == ANYOF)
+    {
+	if (ANYOF_NONBITMAP(p) || (p->flags & ~(ANYOF_INVERT | ANYOF_LARGE |
+	    ANYOF_UNICODE_ALL | ANYOF_NON_UTF8_LATIN1_ALL)))
+	{
+	    return 0;
+	}
+
+	bitmap = (unsigned char *)(p + 2);
+	some = 0;
+	all = 1;
+	for (i = 0; i < ANYOF_BITMAP_SIZE; ++i)
+	{
+	    lo[i] = bitmap[i];
+	    if (i >= 128 / 8)
+	    {
+		some |= bitmap[i];
+		all &= bitmap[i] == 0xff;
+	    }
+	}
+
+	if (p->flags & ANYOF_UNICODE_ALL)
+	{
+	    SET_ADD(lo, NFA_WIDE);
+	}
+
+	/* class members may be anywhere beyond ASCII */
+	if (all && (p->flags & ANYOF_UNICODE_ALL))
+	{
+	    set_range(lo, NFA_WIDE + 1, NFA_SYMBOLS - 1);
+	}
+
+	memcpy(hi, lo, SET_SIZE);
+	if (some || (p->flags & (ANYOF_UNICODE_ALL |
+	    ANYOF_NON_UTF8_LATIN1_ALL)))
+	{
+	    set_range(hi, NFA_WIDE + 1, NFA_SYMBOLS - 1);
+	}
+
+	/* all of Latin-1 in strings without UTF-8 */
+	if (p->flags & ANYOF_NON_UTF8_LATIN1_ALL)
+	{
+	    set_range(hi, 128, 255);
+	}
+
+	negated = p->flags & ANYOF_INVERT;
+    }
+    else if (get_posix_class(p, &cls, &ascii_only, &unicode, &negated))
+    {
+	posix_bounds(cls, ascii_only, unicode, lo, hi);
+    }
+    else
+    {
+	return 0;
+    }
+
+    /* the complement of a superset is a subset */
+    if (negated)
+    {
+	memcpy(set, nfa->over ? lo : hi, SET_SIZE);
+	set_invert(set);
+    }
+    else
+    {
+	memcpy(set, nfa->over ? hi : lo, SET_SIZE);
+    }
+
+    return 1;
+}
+
+static int is_fold_node(regnode *p)
+{
+    return (p->type == EXACTF) || (p->type == EXACTFU);
+}
+
+/* Returns 1 when the last char of a case-insensitive literal can't
+   start a multi-char fold (e.g. "ss" matching U+00DF) with whatever
+   follows it. */
+static int fold_end_safe(RcContext *ctx, Nfa *nfa, regnode *p)
+{
+    unsigned char last, first;
+    int offs;
+
+    last = TOLOWER(((unsigned char *)(p + 1))[p->flags - 1]);
+    if ((last != 's') && (last != 'f'))
+    {
+	return 1;
+    }
+
+    /* the loop may repeat the literal */
+    if (nfa->loops)
+    {
+	return 0;
+    }
+
+    do
+    {
+	offs = rc_node_offset(ctx, p);
+	if (offs <= 0)
+	{
+	    return 0;
+	}
+
+	p += offs;
+    }
+    while ((p->type < REGNODE_MAX) && ((p->type == OPEN) ||
+	(p->type == CLOSE) || (p->type == NOTHING) || (p->type == TAIL) ||
+	(p->type == SUCCEED)));
+
+    if (is_fold_node(p))
+    {
+	first = TOLOWER(((unsigned char *)(p + 1))[0]);
+	return !strchr("stfil", first);
+    }
+
+    return (p->type == END) || (p->type == EXACT) || (p->type == EOS) ||
+	(p->type == SEOL) || (p->type == EOL) || (p->type == REG_ANY) ||
+	(p->type == SANY) || (p->type == ANYOF);
+}
+
+/* builds the states of a literal, ending in out */
+static int build_literal(RcContext *ctx, Nfa *nfa, regnode *p, int out)
+{
+    unsigned char set[SET_SIZE];
+    unsigned char *s;
+    unsigned char c;
+    int i, j, fold;
+
+    s = (unsigned char *)(p + 1);
+    fold = is_fold_node(p);
+    if (fold)
+    {
+	for (i = 0; i < p->flags; ++i)
+	{
+	    /* folds of other chars depend on the Unicode rules */
+	    if (s[i] >= 128)
+	    {
+		nfa->unsupported = 1;
+		return -1;
+	    }
+
+	    if (nfa->over && (i + 1 < p->flags) &&
+		((TOLOWER(s[i]) == 's') || (TOLOWER(s[i]) == 'f')) &&
+		strchr("stfil", TOLOWER(s[i + 1])))
+	    {
+		nfa->unsupported = 1;
+		return -1;
+	    }
+	}
+
+	if (nfa->over && p->flags && !fold_end_safe(ctx, nfa, p))
+	{
+	    nfa->unsupported = 1;
+	    return -1;
+	}
+    }
+
+    for (j = p->flags - 1; (j >= 0) && (out >= 0); --j)
+    {
+	c = s[j];
+	memset(set, 0, SET_SIZE);
+	SET_ADD(set, c);
+	if (fold && (TOLOWER(c) >= 'a') && (TOLOWER(c) <= 'z'))
+	{
+	    SET_ADD(set, TOLOWER(c));
+	    SET_ADD(set, TOLOWER(c) - 'a' + 'A');
+
+	    /* e.g. KELVIN SIGN matching k */
+	    if (nfa->over)
+	    {
+		set_range(set, NFA_WIDE, NFA_SYMBOLS - 1);
+	    }
+	}
+
+	/* the char may be a class member */
+	if ((c >= 128) && nfa->over)
+	{
+	    set_range(set, NFA_WIDE + 1, NFA_SYMBOLS - 1);
+	}
+
+	out = add_char(ctx, nfa, set, out);
+    }
+
+    return out;
+}
+
+static int build_sequence(RcContext *ctx, Nfa *nfa, regnode *p,
+    regnode *end, int out);
+
+/* builds a repetition of the sequence from p up to end */
+static int build_repeat(RcContext *ctx, Nfa *nfa, regnode *p, regnode *end,
+    int min, int max, int out)
+{
+    NfaState *ns;
+    int i, s, body, t;
+
+    if ((min < 0) || ((max != REG_INFTY) && (max < min)))
+    {
+	nfa->unsupported = 1;
+	return -1;
+    }
+
+    ++nfa->loops;
+    t = out;
+    if (max == REG_INFTY)
+    {
+	s = add_state(ctx, nfa, NFA_SPLIT, -1, -1, out);
+	body = (s < 0) ? -1 : build_sequence(ctx, nfa, p, end, s);
+	if (body < 0)
+	{
+	    return -1;
+	}
+
+	ns = nfa->states + s;
+	ns->out = body;
+	t = s;
+    }
+    else
+    {
+	/* x{0,k} is (?:x(?:x...)?)? */
+	for (i = min; i < max; ++i)
+	{
+	    body = build_sequence(ctx, nfa, p, end, t);
+	    t = (body < 0) ? -1 : add_state(ctx, nfa, NFA_SPLIT, -1, body,
+		out);
+	    if (t < 0)
+	    {
+		return -1;
+	    }
+	}
+    }
+
+    for (i = 0; (i < min) && (t >= 0); ++i)
+    {
+	t = build_sequence(ctx, nfa, p, end, t);
+    }
+
+    --nfa->loops;
+    return t;
+}
+
+/* builds the states of node p, ending in out */
+static int build_node(RcContext *ctx, Nfa *nfa, regnode *p, int out)
+{
+    unsigned char set[SET_SIZE];
+    IntVec alts;
+    regnode *q;
+    int i, offs, s, t;
+
+    if ((p->type == OPEN) || (p->type == CLOSE) || (p->type == NOTHING) ||
+	(p->type == TAIL) || (p->type == SUCCEED) || (p->type == WHILEM) ||
+	(p->type == OPTIMIZED) || (p->type == MINMOD))
+    {
+	return out;
+    }
+
+    if ((p->type == EXACT) || is_fold_node(p))
+    {
+	return build_literal(ctx, nfa, p, out);
+    }
+
+    if (get_node_set(nfa, p, set))
+    {
+	return add_char(ctx, nfa, set, out);
+    }
+
+    offs = rc_node_offset(ctx, p);
+    if (offs <= 0)
+    {
+	nfa->unsupported = 1;
+	return -1;
+    }
+
+    if ((p->type == BOL) || (p->type == SBOL))
+    {
+	return add_state(ctx, nfa, NFA_BOS, -1, out, -1);
+    }
+
+    if (p->type == EOS)
+    {
+	return add_state(ctx, nfa, NFA_EOS, -1, out, -1);
+    }
+
+    if ((p->type == SEOL) || (p->type == EOL))
+    {
+	/* At the end, or before a newline at the end - which the right
+	   automaton takes as consuming the newline, while the left one
+	   (which must match more, not less) can't consume anything, so
+	   it doesn't check at all. */
+	if (nfa->over)
+	{
+	    return out;
+	}
+
+	s = add_state(ctx, nfa, NFA_EOS, -1, out, -1);
+	if (s < 0)
+	{
+	    return -1;
+	}
+
+	memset(set, 0, SET_SIZE);
+	SET_ADD(set, '\n');
+	t = add_char(ctx, nfa, set, s);
+	return (t < 0) ? -1 : add_state(ctx, nfa, NFA_SPLIT, -1, s, t);
+    }
+
+    switch (p->type)
+    {
+    case BRANCH:
+	memset(&alts, 0, sizeof(IntVec));
+	q = p;
+	t = 0;
+	while (q->type == BRANCH)
+	{
+	    offs = rc_node_offset(ctx, q);
+	    if (offs <= 0)
+	    {
+		nfa->unsupported = 1;
+		t = -1;
+		break;
+	    }
+
+	    t = build_sequence(ctx, nfa, q + 1, q + offs, out);
+	    if (t < 0)
+	    {
+		break;
+	    }
+
+	    if (push_int(&alts, t) < 0)
+	    {
+		ctx->error = "Couldn't allocate memory for automaton";
+		t = -1;
+		break;
+	    }
+
+	    q += offs;
+	}
+
+	for (i = alts.count - 2; (i >= 0) && (t >= 0); --i)
+	{
+	    t = add_state(ctx, nfa, NFA_SPLIT, -1, alts.v[i], t);
+	}
+
+	free(alts.v);
+	return t;
+    case STAR:
+    case PLUS:
+    case CURLY:
+    case CURLYN:
+	/* simple repeats - their only node continues physically with
+	   whatever follows the repeat, which for a repeat ending an
+	   alternative is the next alternative */
+	q = p + (((p->type == STAR) || (p->type == PLUS)) ? 1 : 2);
+	offs = rc_node_offset(ctx, q);
+	if (offs <= 0)
+	{
+	    nfa->unsupported = 1;
+	    return -1;
+	}
+
+	if (p->type == STAR)
+	{
+	    return build_repeat(ctx, nfa, q, q + offs, 0, REG_INFTY, out);
+	}
+
+	if (p->type == PLUS)
+	{
+	    return build_repeat(ctx, nfa, q, q + offs, 1, REG_INFTY, out);
+	}
+
+	return build_repeat(ctx, nfa, q, q + offs, ARG1(p), ARG2(p), out);
+    case CURLYM:
+    case CURLYX:
+	return build_repeat(ctx, nfa, p + 2, p + offs, ARG1(p), ARG2(p), out);
+    }
+
+    /* lookarounds, backreferences, word boundaries, multiline
+       anchors... */
+    nfa->unsupported = 1;
+    return -1;
+}
+
+/* Builds the states of the sequence from p up to (not including)
+   END or end, whichever comes first, ending in out; returns its
+   start state. */
+static int build_sequence(RcContext *ctx, Nfa *nfa, regnode *p,
+    regnode *end, int out)
+{
+    IntVec seq;
+    regnode *start;
+    int i, offs;
+
+    if (++nfa->depth > ctx->limits.max_depth)
+    {
+	nfa->unsupported = 1;
+	return -1;
+    }
+
+    start = p;
+    memset(&seq, 0, sizeof(IntVec));
+    while ((p < end) && (p->type != END))
+    {
+	if (p->type >= REGNODE_MAX)
+	{
+	    nfa->unsupported = 1;
+	    out = -1;
+	    break;
+	}
+
+	if (push_int(&seq, p - start) < 0)
+	{
+	    ctx->error = "Couldn't allocate memory for automaton";
+	    out = -1;
+	    break;
+	}
+
+	/* alternatives continue after the last one */
+	do
+	{
+	    offs = rc_node_offset(ctx, p);
+	    if (offs <= 0)
+	    {
+		nfa->unsupported = 1;
+		break;
+	    }
+
+	    p += offs;
+	}
+	while ((p->type == BRANCH) && (start[seq.v[seq.count - 1]].type == BRANCH));
+
+	if (offs <= 0)
+	{
+	    out = -1;
+	    break;
+	}
+    }
+
+    for (i = seq.count - 1; (i >= 0) && (out >= 0); --i)
+    {
+	out = build_node(ctx, nfa, start + seq.v[i], out);
+    }
+
+    free(seq.v);
+    --nfa->depth;
+    return out;
+}
+
+/* Returns 1 when the automaton was built, 0 when c's program can't
+   be translated and -1 on error. */
+static int nfa_build(RcContext *ctx, Nfa *nfa, RcCompiled *c, int over)
+{
+    unsigned char set[SET_SIZE];
+    char *error;
+    int match, loop, body, any;
+
+    memset(nfa, 0, sizeof(Nfa));
+    nfa->over = over;
+    if (!c->program || (c->size <= 0) || RX_UTF8(c->rx))
+    {
+	return 0;
+    }
+
+    /* failures of rc_node_offset just make the program unsupported */
+    error = ctx->error;
+
+    match = add_state(ctx, nfa, NFA_MATCH, -1, -1, -1);
+    body = (match < 0) ? -1 :
+	build_sequence(ctx, nfa, c->program, c->program + c->size, match);
+
+    /* the match may start anywhere */
+    memset(set, 0, SET_SIZE);
+    set_range(set, 0, NFA_SYMBOLS - 1);
+    loop = (body < 0) ? -1 : add_state(ctx, nfa, NFA_SPLIT, -1, body, -1);
+    any = (loop < 0) ? -1 : add_char(ctx, nfa, set, loop);
+    if (any < 0)
+    {
+	loop = -1;
+    }
+    else
+    {
+	nfa->states[loop].out2 = any;
+    }
+
+    if (loop < 0)
+    {
+	if (nfa->unsupported)
+	{
+	    ctx->error = error;
+	    return 0;
+	}
+
+	return -1;
+    }
+
+    ctx->error = error;
+    nfa->start = loop;
+    nfa->mark = (unsigned *)calloc(nfa->size, sizeof(unsigned));
+    if (!nfa->mark)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    return 1;
+}
+
+/* Stores n states followed by the states reachable from them
+   without consuming a symbol (passing assertions as flags say) into
+   list; returns the new count. */
+static int close_states(Nfa *nfa, int *list, int n, int flags)
+{
+    NfaState *ns;
+    int i, j, m, next[2];
+
+    if (!++nfa->stamp)
+    {
+	memset(nfa->mark, 0, nfa->size * sizeof(unsigned));
+	nfa->stamp = 1;
+    }
+
+    m = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (nfa->mark[list[i]] != nfa->stamp)
+	{
+	    nfa->mark[list[i]] = nfa->stamp;
+	    list[m++] = list[i];
+	}
+    }
+
+    for (i = 0; i < m; ++i)
+    {
+	ns = nfa->states + list[i];
+	next[0] = next[1] = -1;
+	if (ns->kind == NFA_SPLIT)
+	{
+	    next[0] = ns->out;
+	    next[1] = ns->out2;
+	}
+	else if (((ns->kind == NFA_BOS) && (flags & CLOSE_BOS)) ||
+	    ((ns->kind == NFA_EOS) && (flags & CLOSE_EOS)))
+	{
+	    next[0] = ns->out;
+	}
+
+	for (j = 0; j < 2; ++j)
+	{
+	    if ((next[j] >= 0) && (nfa->mark[next[j]] != nfa->stamp))
+	    {
+		nfa->mark[next[j]] = nfa->stamp;
+		list[m++] = next[j];
+	    }
+	}
+    }
+
+    return m;
+}
+
+static int has_match(Nfa *nfa, int *list, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+    {
+	if (nfa->states[list[i]].kind == NFA_MATCH)
+	{
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/* states which consume symbols or may lead to a match at the end */
+static int is_kept(Nfa *nfa, int s)
+{
+    int kind = nfa->states[s].kind;
+
+    return (kind == NFA_CHAR) || (kind == NFA_MATCH) || (kind == NFA_EOS);
+}
+
+/* Splits the symbol classes (*n of them) by set. */
+static void refine(short *classes, int *n, const unsigned char *set)
+{
+    short remap[2 * NFA_SYMBOLS];
+    int i, c, k;
+
+    for (i = 0; i < 2 * *n; ++i)
+    {
+	remap[i] = -1;
+    }
+
+    k = 0;
+    for (i = 0; i < NFA_SYMBOLS; ++i)
+    {
+	c = 2 * classes[i] + SET_HAS(set, i);
+	if (remap[c] < 0)
+	{
+	    remap[c] = k++;
+	}
+
+	classes[i] = remap[c];
+    }
+
+    *n = k;
+}
+
+static void dfa_free(Dfa *dfa)
+{
+    free(dfa->bits);
+    free(dfa->next);
+    free(dfa->flags);
+    free(dfa->table);
+    free(dfa->list);
+}
+
+static int dfa_grow(RcContext *ctx, Dfa *dfa);
+
+static int dfa_init(RcContext *ctx, Dfa *dfa, Nfa *nfa, size_t cap)
+{
+    int i;
+
+    memset(dfa, 0, sizeof(Dfa));
+    dfa->nfa = nfa;
+    dfa->cap = cap;
+    dfa->nclasses = 1;
+    for (i = 0; i < nfa->nsets; ++i)
+    {
+	refine(dfa->classes, &(dfa->nclasses), nfa->sets[i]);
+    }
+
+    dfa->words = (nfa->size + 31) / 32;
+    dfa->tsize = 256;
+    dfa->table = (int *)malloc(dfa->tsize * sizeof(int));
+    dfa->list = (int *)malloc(2 * nfa->size * sizeof(int));
+    if (!dfa->table || !dfa->list)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    memset(dfa->table, 0xff, dfa->tsize * sizeof(int));
+    return dfa_grow(ctx, dfa);
+}
+
+static U32 hash_bits(U32 *bits, int words, unsigned char flags)
+{
+    U32 h;
+    int i;
+
+    h = 2166136261U ^ flags;
+    for (i = 0; i < words; ++i)
+    {
+	h = (h ^ bits[i]) * 16777619U;
+    }
+
+    return h ^ (h >> 15);
+}
+
+static int *dfa_slot(Dfa *dfa, U32 *bits, unsigned char flags)
+{
+    int *slot;
+    int d;
+
+    slot = dfa->table + (hash_bits(bits, dfa->words, flags) &
+	(dfa->tsize - 1));
+    while ((d = *slot) >= 0)
+    {
+	if (((dfa->flags[d] & DFA_START) == (flags & DFA_START)) &&
+	    !memcmp(dfa->bits + d * dfa->words, bits,
+		dfa->words * sizeof(U32)))
+	{
+	    break;
+	}
+
+	if (++slot == dfa->table + dfa->tsize)
+	{
+	    slot = dfa->table;
+	}
+    }
+
+    return slot;
+}
+
+/* Memory taken by alloc states, including (about) their part of the
+   table. */
+static size_t dfa_memory(Dfa *dfa, int alloc)
+{
+    return (size_t)alloc * (dfa->words * sizeof(U32) +
+	dfa->nclasses * sizeof(int) + 1 + 4 * sizeof(int));
+}
+
+/* drops all states, keeping the memory for new ones */
+static void dfa_flush(Dfa *dfa)
+{
+    dfa->size = 0;
+    memset(dfa->table, 0xff, dfa->tsize * sizeof(int));
+}
+
+static int dfa_grow(RcContext *ctx, Dfa *dfa)
+{
+    U32 *nb;
+    int *nn, *nt;
+    unsigned char *nf;
+    int na, d;
+
+    na = dfa->alloc ? 2 * dfa->alloc : 32;
+    nb = (U32 *)realloc(dfa->bits, (na + 1) * dfa->words * sizeof(U32));
+    if (nb)
+    {
+	dfa->bits = nb;
+    }
+
+    nn = (int *)realloc(dfa->next, na * dfa->nclasses * sizeof(int));
+    if (nn)
+    {
+	dfa->next = nn;
+    }
+
+    nf = (unsigned char *)realloc(dfa->flags, na);
+    if (nf)
+    {
+	dfa->flags = nf;
+    }
+
+    if (!nb || !nn || !nf)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    dfa->alloc = na;
+    if (2 * na <= dfa->tsize)
+    {
+	return 0;
+    }
+
+    nt = (int *)malloc(2 * dfa->tsize * sizeof(int));
+    if (!nt)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    free(dfa->table);
+    dfa->table = nt;
+    dfa->tsize *= 2;
+    memset(dfa->table, 0xff, dfa->tsize * sizeof(int));
+    for (d = 0; d < dfa->size; ++d)
+    {
+	*dfa_slot(dfa, dfa->bits + d * dfa->words, dfa->flags[d]) = d;
+    }
+
+    return 0;
+}
+
+/* Returns the state for n NFA states in dfa->list (closed under
+   transitions not consuming symbols), creating it when it doesn't
+   exist yet; -1 on error, DFA_FULL when there's no room for it. */
+static int dfa_state(RcContext *ctx, Dfa *dfa, int n, int start)
+{
+    Nfa *nfa = dfa->nfa;
+    U32 *bits;
+    int *slot;
+    unsigned char flags;
+    int i, m, d;
+
+    bits = dfa->bits + dfa->alloc * dfa->words;
+    memset(bits, 0, dfa->words * sizeof(U32));
+    m = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (is_kept(nfa, dfa->list[i]))
+	{
+	    bits[dfa->list[i] / 32] |= (U32)1 << (dfa->list[i] % 32);
+	    dfa->list[m++] = dfa->list[i];
+	}
+    }
+
+    flags = start ? DFA_START : 0;
+    slot = dfa_slot(dfa, bits, flags);
+    if (*slot >= 0)
+    {
+	return *slot;
+    }
+
+    if (dfa->size == dfa->alloc)
+    {
+	if (dfa_memory(dfa, 2 * dfa->alloc) > dfa->cap)
+	{
+	    return DFA_FULL;
+	}
+
+	/* moves the key to the new state's place (and may rehash) */
+	if (dfa_grow(ctx, dfa) < 0)
+	{
+	    return -1;
+	}
+
+	slot = dfa_slot(dfa, dfa->bits + dfa->size * dfa->words, flags);
+    }
+    else
+    {
+	memcpy(dfa->bits + dfa->size * dfa->words, bits,
+	    dfa->words * sizeof(U32));
+    }
+
+    if (has_match(nfa, dfa->list, m))
+    {
+	flags |= DFA_UNIVERSAL | DFA_ACCEPT;
+    }
+    else
+    {
+	m = close_states(nfa, dfa->list, m,
+	    CLOSE_EOS | (start ? CLOSE_BOS : 0));
+	if (has_match(nfa, dfa->list, m))
+	{
+	    flags |= DFA_ACCEPT;
+	}
+    }
+
+    d = dfa->size++;
+    dfa->flags[d] = flags;
+    for (i = 0; i < dfa->nclasses; ++i)
+    {
+	dfa->next[d * dfa->nclasses + i] = -1;
+    }
+
+    *slot = d;
+    return d;
+}
+
+static int dfa_start(RcContext *ctx, Dfa *dfa)
+{
+    dfa->list[0] = dfa->nfa->start;
+    return dfa_state(ctx, dfa, close_states(dfa->nfa, dfa->list, 1,
+	CLOSE_BOS), 1);
+}
+
+/* Returns the state following d on symbol c; -1 on error, DFA_FULL
+   when there's no room for it. */
+static int dfa_next(RcContext *ctx, Dfa *dfa, int d, int c)
+{
+    Nfa *nfa = dfa->nfa;
+    NfaState *ns;
+    U32 *bits;
+    int *next;
+    int s, n;
+
+    next = dfa->next + d * dfa->nclasses + dfa->classes[c];
+    if (*next >= 0)
+    {
+	return *next;
+    }
+
+    bits = dfa->bits + d * dfa->words;
+    n = 0;
+    for (s = 0; s < nfa->size; ++s)
+    {
+	if (bits[s / 32] & ((U32)1 << (s % 32)))
+	{
+	    ns = nfa->states + s;
+	    if (ns->kind == NFA_MATCH)
+	    {
+		dfa->list[n++] = s;
+	    }
+	    else if ((ns->kind == NFA_CHAR) && SET_HAS(nfa->sets[ns->set], c))
+	    {
+		dfa->list[n++] = ns->out;
+	    }
+	}
+    }
+
+    s = dfa_state(ctx, dfa, close_states(nfa, dfa->list, n, 0), 0);
+    if (s >= 0)
+    {
+	/* dfa->next may have moved */
+	dfa->next[d * dfa->nclasses + dfa->classes[c]] = s;
+    }
+
+    return s;
+}
+
+static int is_subset(U32 *b1, U32 *b2, int words)
+{
+    int i;
+
+    for (i = 0; i < words; ++i)
+    {
+	if (b1[i] & ~b2[i])
+	{
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/* state of the inclusion search */
+typedef struct
+{
+    Nfa *left;
+    Dfa *right;
+
+    /* a symbol of each class telling apart the sets of both
+       automata */
+    int reps[NFA_SYMBOLS];
+    int nreps;
+
+    /* right states visited with each left state (the antichain) */
+    IntVec *visited;
+
+    /* (left state, right state) pairs to expand */
+    IntVec pending;
+
+    int pairs;
+
+    /* scratch space for left state lists, 2 * left->size elements */
+    int *list;
+} Search;
+
+/* Adds pair (s, d) unless it's subsumed by a visited pair; returns
+   0, or -1 on error, SEARCH_FULL when there are too many pairs. */
+static int add_pair(RcContext *ctx, Search *sr, int s, int d)
+{
+    Dfa *dfa = sr->right;
+    IntVec *vis;
+    int i;
+
+    vis = sr->visited + s;
+    for (i = 0; i < vis->count; ++i)
+    {
+	if ((vis->v[i] == d) || is_subset(dfa->bits + vis->v[i] * dfa->words,
+	    dfa->bits + d * dfa->words, dfa->words))
+	{
+	    return 0;
+	}
+    }
+
+    if (++sr->pairs > RC_NFA_MAX_PAIRS)
+    {
+	return SEARCH_FULL;
+    }
+
+    if ((push_int(vis, d) < 0) || (push_int(&(sr->pending), s) < 0) ||
+	(push_int(&(sr->pending), d) < 0))
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Follows the symbols of left state s from right state d; returns 1
+   when they can't lead to a counterexample (yet), 0 when they did,
+   -1 on error, SEARCH_FULL when the search got too big and DFA_FULL
+   when the right automaton did. */
+static int expand(RcContext *ctx, Search *sr, int s, int d)
+{
+    Nfa *nfa = sr->left;
+    NfaState *ns;
+    int j, c, t, d2, n, m, i, rv;
+
+    ns = nfa->states + s;
+    for (j = 0; j < sr->nreps; ++j)
+    {
+	c = sr->reps[j];
+	if (ns->kind == NFA_MATCH)
+	{
+	    t = s;
+	}
+	else if (SET_HAS(nfa->sets[ns->set], c))
+	{
+	    t = ns->out;
+	}
+	else
+	{
+	    continue;
+	}
+
+	d2 = dfa_next(ctx, sr->right, d, c);
+	if (d2 < 0)
+	{
+	    return d2;
+	}
+
+	if (sr->right->flags[d2] & DFA_UNIVERSAL)
+	{
+	    continue;
+	}
+
+	sr->list[0] = t;
+	n = close_states(nfa, sr->list, 1, 0);
+
+	/* the left side matching here (at the end of a string) must
+	   be matched by the right one */
+	if (!(sr->right->flags[d2] & DFA_ACCEPT))
+	{
+	    memcpy(sr->list + n, sr->list, n * sizeof(int));
+	    m = close_states(nfa, sr->list + n, n, CLOSE_EOS);
+	    if (has_match(nfa, sr->list + n, m))
+	    {
+		return 0;
+	    }
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+	    if ((nfa->states[sr->list[i]].kind == NFA_CHAR) ||
+		(nfa->states[sr->list[i]].kind == NFA_MATCH))
+	    {
+		rv = add_pair(ctx, sr, sr->list[i], d2);
+		if (rv < 0)
+		{
+		    return rv;
+		}
+	    }
+	}
+    }
+
+    return 1;
+}
+
+static int search(RcContext *ctx, Search *sr)
+{
+    Nfa *nfa = sr->left;
+    int *initial;
+    int d0, i, n, m, rv, s, d;
+
+    d0 = dfa_start(ctx, sr->right);
+    if (d0 < 0)
+    {
+	return d0;
+    }
+
+    if (sr->right->flags[d0] & DFA_UNIVERSAL)
+    {
+	return 1;
+    }
+
+    /* the empty string */
+    sr->list[0] = nfa->start;
+    n = close_states(nfa, sr->list, 1, CLOSE_BOS);
+    if (!(sr->right->flags[d0] & DFA_ACCEPT))
+    {
+	memcpy(sr->list + n, sr->list, n * sizeof(int));
+	m = close_states(nfa, sr->list + n, n, CLOSE_BOS | CLOSE_EOS);
+	if (has_match(nfa, sr->list + n, m))
+	{
+	    return 0;
+	}
+    }
+
+    /* pairs at the start aren't visited again, so they don't go into
+       the antichain */
+    initial = (int *)malloc(n * sizeof(int));
+    if (!initial)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return -1;
+    }
+
+    memcpy(initial, sr->list, n * sizeof(int));
+    rv = 1;
+    for (i = 0; (i < n) && (rv == 1); ++i)
+    {
+	if ((nfa->states[initial[i]].kind == NFA_CHAR) ||
+	    (nfa->states[initial[i]].kind == NFA_MATCH))
+	{
+	    rv = expand(ctx, sr, initial[i], d0);
+	}
+    }
+
+    free(initial);
+    while ((rv == 1) && sr->pending.count)
+    {
+	if (rc_over_budget(ctx))
+	{
+	    return RC_UNDECIDED;
+	}
+
+	d = sr->pending.v[--sr->pending.count];
+	s = sr->pending.v[--sr->pending.count];
+	rv = expand(ctx, sr, s, d);
+    }
+
+    return rv;
+}
+
+/* forgets the pairs of an interrupted search */
+static void search_reset(Search *sr)
+{
+    int i;
+
+    for (i = 0; i < sr->left->size; ++i)
+    {
+	sr->visited[i].count = 0;
+    }
+
+    sr->pending.count = 0;
+    sr->pairs = 0;
+}
+
+/* Returns the right automaton of c, null on error. */
+static RcDfa *get_right(RcContext *ctx, RcCompiled *c)
+{
+    RcDfa *right;
+    size_t cap;
+    int rv;
+
+    right = (RcDfa *)calloc(1, sizeof(RcDfa));
+    if (!right)
+    {
+	ctx->error = "Couldn't allocate memory for automaton";
+	return 0;
+    }
+
+    cap = ctx->dfa_cache_size ? ctx->dfa_cache_size :
+	RC_DEFAULT_DFA_CACHE_SIZE;
+    rv = nfa_build(ctx, &(right->nfa), c, 0);
+    if (rv > 0)
+    {
+	right->built = 1;
+	rv = dfa_init(ctx, &(right->dfa), &(right->nfa), cap);
+    }
+    else
+    {
+	nfa_free(&(right->nfa));
+	memset(&(right->nfa), 0, sizeof(Nfa));
+    }
+
+    if (rv < 0)
+    {
+	rc_dfa_free(right);
+	return 0;
+    }
+
+    return right;
+}
+
+void rc_dfa_free(RcDfa *right)
+{
+    if (right)
+    {
+	if (right->built)
+	{
+	    dfa_free(&(right->dfa));
+	}
+
+	nfa_free(&(right->nfa));
+	free(right);
+    }
+}
+
+int rc_nfa_compare(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    Nfa left;
+    RcDfa *right;
+    Search sr;
+    short classes[NFA_SYMBOLS];
+    int i, n, rv, flushed;
+
+    rv = nfa_build(ctx, &left, c1, 1);
+    if (rv <= 0)
+    {
+	nfa_free(&left);
+	return rv;
+    }
+
+    /* contexts which don't keep automata don't touch them, as other
+       threads may */
+    right = ctx->dfa_cache_size ? c2->dfa : 0;
+    if (!right)
+    {
+	right = get_right(ctx, c2);
+	if (!right)
+	{
+	    nfa_free(&left);
+	    return -1;
+	}
+
+	if (ctx->dfa_cache_size)
+	{
+	    c2->dfa = right;
+	}
+    }
+    else
+    {
+	right->dfa.cap = ctx->dfa_cache_size;
+    }
+
+    memset(&sr, 0, sizeof(Search));
+    rv = right->built;
+    if (rv)
+    {
+	sr.left = &left;
+	sr.right = &(right->dfa);
+
+	/* the right automaton's classes, refined by the left one's sets */
+	memcpy(classes, right->dfa.classes, sizeof(classes));
+	n = right->dfa.nclasses;
+	for (i = 0; i < left.nsets; ++i)
+	{
+	    refine(classes, &n, left.sets[i]);
+	}
+
+	for (i = NFA_SYMBOLS - 1; i >= 0; --i)
+	{
+	    sr.reps[classes[i]] = i;
+	}
+
+	sr.nreps = n;
+	sr.visited = (IntVec *)calloc(left.size, sizeof(IntVec));
+	sr.list = (int *)malloc(2 * left.size * sizeof(int));
+	if (!sr.visited || !sr.list)
+	{
+	    ctx->error = "Couldn't allocate memory for automaton";
+	    rv = -1;
+	}
+	else
+	{
+	    /* a full automaton starts over once */
+	    flushed = 0;
+	    for (;;)
+	    {
+		rv = search(ctx, &sr);
+		if ((rv != DFA_FULL) || flushed)
+		{
+		    break;
+		}
+
+		++ctx->stats.dfa_flushes;
+		dfa_flush(&(right->dfa));
+		search_reset(&sr);
+		flushed = 1;
+	    }
+	}
+    }
+
+    /* too big to tell */
+    if ((rv == SEARCH_FULL) || (rv == DFA_FULL))
+    {
+	rv = 0;
+    }
+
+    if (sr.visited)
+    {
+	for (i = 0; i < left.size; ++i)
+	{
+	    free(sr.visited[i].v);
+	}
+
+	free(sr.visited);
+    }
+
+    free(sr.pending.v);
+    free(sr.list);
+    nfa_free(&left);
+    if (!ctx->dfa_cache_size)
+    {
+	rc_dfa_free(right);
+    }
+
+    return rv;
+}
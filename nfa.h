@@ -0,0 +1,49 @@
+#ifndef nfa_h
+#define nfa_h
+
+#include "engine.h"
+
+/* Second decider, for pairs the comparators can't decide: both
+   regexps are translated into automata over bytes (plus one symbol
+   standing for all wider characters) accepting the strings the
+   regexp matches somewhere, and inclusion of the left language in
+   the right one is checked by a search of their product, with the
+   right automaton determinized as the search needs its states and
+   the visited pairs kept as an antichain (a pair whose right set is
+   a superset of an already visited one can't lead to a
+   counterexample it couldn't).
+
+   Only the regular part of the program is translated - literals,
+   character classes, alternation, repetition and anchors at either
+   end of the string. Non-ASCII members of POSIX classes get symbols
+   of their own, so that e.g. \d is known to include itself. Where
+   the meaning of a construct still depends on the matched string
+   (Unicode rules, case folding beyond ASCII), the left automaton
+   accepts more than the regexp and the right one less, so a positive
+   answer is always right. */
+
+#define RC_NFA_MAX_STATES 4096
+
+/* maximal number of (left state, right set) pairs visited */
+#define RC_NFA_MAX_PAIRS 65536
+
+/* Memory cap of a right automaton when ctx->dfa_cache_size is 0.
+   Reaching the cap drops all its states, and the search starts over;
+   a search reaching it again gives up. */
+#define RC_DEFAULT_DFA_CACHE_SIZE (1 << 20)
+
+/* Returns 1 when c1 is less than or equal to c2, 0 when it isn't or
+   the automata can't tell (either regexp isn't translatable, or one
+   of the maximums above was reached), RC_UNDECIDED when a limit from
+   ctx->limits was exceeded and -1 on error. Called by
+   rc_compare_compiled when its comparison returned 0.
+
+   Unless ctx->dfa_cache_size is 0, the right automaton (or the fact
+   that c2 can't be translated) is kept in c2->dfa, with its states
+   built so far, for the next comparison with c2 on the right. */
+int rc_nfa_compare(RcContext *ctx, RcCompiled *c1, RcCompiled *c2);
+
+/* frees RcCompiled.dfa (which may be null) */
+void rc_dfa_free(RcDfa *right);
+
+#endif
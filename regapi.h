@@ -0,0 +1,39 @@
+#ifndef regapi_h
+#define regapi_h
+
+/* Regexp internals of the supported Perl versions, for the files
+   walking compiled programs. */
+
+#include "regnodes.h"
+#include "regcomp.h"
+
+#if PERL_API_REVISION != 5
+#error This module is only for Perl 5
+#else
+#if PERL_API_VERSION == 16
+#define RC_ANYOF_UTF8 0
+#else
+#if PERL_API_VERSION == 18
+#define RC_POSIX_NODES
+
+#define RC_ANYOF_UTF8 0
+#else
+#if PERL_API_VERSION == 20
+#define RC_POSIX_NODES
+#define RC_INVLIST_EX
+
+#define RC_ANYOF_UTF8 ANYOF_UTF8
+
+/* renamed */
+#define ANYOF_NON_UTF8_LATIN1_ALL ANYOF_NON_UTF8_NON_ASCII_ALL
+
+/* no longer exists - using 5.18 definition */
+#define ANYOF_NONBITMAP(node)	(ARG(node) != ANYOF_NONBITMAP_EMPTY)
+#else
+#error Unsupported PERL_API_VERSION
+#endif
+#endif
+#endif
+#endif
+
+#endif
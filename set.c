@@ -0,0 +1,569 @@
+#include "set.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* flags of RcSet.mark */
+#define IN_UP 1
+#define IN_DOWN 2
+#define REACHED 4
+
+typedef struct
+{
+    /* null when the entry was removed */
+    RcCompiled *c;
+
+    /* ids of immediate successors */
+    int *up;
+    int nup;
+    int aup;
+
+    /* ids of immediate predecessors */
+    int *down;
+    int ndown;
+    int adown;
+
+    /* structural hash of c, and the next entry of its bucket (-1 at
+       the end) */
+    UV hash;
+    int next;
+} SetNode;
+
+struct RcSet
+{
+    RcIndex *index;
+
+    /* indexed by id, alloc elements */
+    SetNode *nodes;
+    int alloc;
+
+    /* first entry (-1 for none) of the entries with structural hash
+       equal to the index modulo alloc */
+    int *buckets;
+
+    /* scratch space for updates, alloc elements each */
+    int *ids;
+    int *queue;
+    int *pending;
+    unsigned char *mark;
+};
+
+static int push_id(int **v, int *count, int *alloc, int id)
+{
+    int *nv;
+    int na;
+
+    if (*count == *alloc)
+    {
+	na = *alloc ? 2 * *alloc : 4;
+	nv = (int *)realloc(*v, na * sizeof(int));
+	if (!nv)
+	{
+	    return -1;
+	}
+
+	*v = nv;
+	*alloc = na;
+    }
+
+    (*v)[(*count)++] = id;
+    return 0;
+}
+
+static void remove_id(int *v, int *count, int id)
+{
+    int i;
+
+    for (i = 0; i < *count; ++i)
+    {
+	if (v[i] == id)
+	{
+	    v[i] = v[--(*count)];
+	    return;
+	}
+    }
+}
+
+static int link_nodes(RcContext *ctx, RcSet *s, int d, int u)
+{
+    SetNode *nd, *nu;
+
+    nd = s->nodes + d;
+    nu = s->nodes + u;
+    if ((push_id(&(nd->up), &(nd->nup), &(nd->aup), u) < 0) ||
+	(push_id(&(nu->down), &(nu->ndown), &(nu->adown), d) < 0))
+    {
+	ctx->error = "Couldn't allocate memory for set";
+	return -1;
+    }
+
+    return 0;
+}
+
+static void unlink_nodes(RcSet *s, int d, int u)
+{
+    SetNode *nd, *nu;
+
+    nd = s->nodes + d;
+    nu = s->nodes + u;
+    remove_id(nd->up, &(nd->nup), u);
+    remove_id(nu->down, &(nu->ndown), d);
+}
+
+static void link_hash(RcSet *s, int id)
+{
+    int *b;
+
+    b = s->buckets + (s->nodes[id].hash & (s->alloc - 1));
+    s->nodes[id].next = *b;
+    *b = id;
+}
+
+static void unlink_hash(RcSet *s, int id)
+{
+    int *p;
+
+    p = s->buckets + (s->nodes[id].hash & (s->alloc - 1));
+    while (*p != id)
+    {
+	p = &(s->nodes[*p].next);
+    }
+
+    *p = s->nodes[id].next;
+}
+
+/* makes room for n ids */
+static int grow(RcSet *s, int n)
+{
+    SetNode *nn;
+    unsigned char *nm;
+    int *v[4];
+    int **p[4];
+    int na, oa, i;
+
+    if (n <= s->alloc)
+    {
+	return 0;
+    }
+
+    na = s->alloc ? 2 * s->alloc : 16;
+    while (na < n)
+    {
+	na *= 2;
+    }
+
+    nn = (SetNode *)realloc(s->nodes, na * sizeof(SetNode));
+    if (!nn)
+    {
+	return -1;
+    }
+
+    memset(nn + s->alloc, 0, (na - s->alloc) * sizeof(SetNode));
+    s->nodes = nn;
+
+    p[0] = &(s->ids);
+    p[1] = &(s->queue);
+    p[2] = &(s->pending);
+    p[3] = &(s->buckets);
+    for (i = 0; i < 4; ++i)
+    {
+	v[i] = (int *)realloc(*(p[i]), na * sizeof(int));
+	if (!v[i])
+	{
+	    return -1;
+	}
+
+	*(p[i]) = v[i];
+    }
+
+    nm = (unsigned char *)realloc(s->mark, na);
+    if (!nm)
+    {
+	return -1;
+    }
+
+    s->mark = nm;
+
+    /* alloc stays a power of 2 */
+    oa = s->alloc;
+    s->alloc = na;
+    for (i = 0; i < na; ++i)
+    {
+	s->buckets[i] = -1;
+    }
+
+    for (i = 0; i < oa; ++i)
+    {
+	if (s->nodes[i].c)
+	{
+	    link_hash(s, i);
+	}
+    }
+
+    return 0;
+}
+
+/* undecided counts as not less or equal */
+static int compare_entries(RcContext *ctx, RcCompiled *c1, RcCompiled *c2)
+{
+    int rv;
+
+    rv = rc_compare_compiled(ctx, c1, c2);
+    return (rv == RC_UNDECIDED) ? 0 : rv;
+}
+
+/* Sets flag for id and everything above it (up is true) or below
+   it, not going through entries marked with stop; the stack is
+   s->queue. */
+static void mark_reachable(RcSet *s, int id, int up, unsigned char flag,
+    unsigned char stop)
+{
+    SetNode *node;
+    int *next;
+    int top, j, n, v;
+
+    if (s->mark[id] & flag)
+    {
+	return;
+    }
+
+    s->mark[id] |= flag;
+    s->queue[0] = id;
+    top = 1;
+    while (top)
+    {
+	node = s->nodes + s->queue[--top];
+	next = up ? node->up : node->down;
+	n = up ? node->nup : node->ndown;
+	for (j = 0; j < n; ++j)
+	{
+	    v = next[j];
+	    if (!(s->mark[v] & (flag | stop)))
+	    {
+		s->mark[v] |= flag;
+		s->queue[top++] = v;
+	    }
+	}
+    }
+}
+
+static int has_marked(int *v, int count, unsigned char *mark,
+    unsigned char flag)
+{
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+	if (mark[v[i]] & flag)
+	{
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+RcSet *rc_set_new(void)
+{
+    RcSet *s;
+
+    s = (RcSet *)calloc(1, sizeof(RcSet));
+    if (!s)
+    {
+	return 0;
+    }
+
+    s->index = rc_index_new();
+    if (!s->index)
+    {
+	free(s);
+	return 0;
+    }
+
+    return s;
+}
+
+void rc_set_free(RcSet *s)
+{
+    int i;
+
+    if (!s)
+    {
+	return;
+    }
+
+    for (i = 0; i < s->alloc; ++i)
+    {
+	free(s->nodes[i].up);
+	free(s->nodes[i].down);
+    }
+
+    rc_index_free(s->index);
+    free(s->nodes);
+    free(s->ids);
+    free(s->queue);
+    free(s->pending);
+    free(s->buckets);
+    free(s->mark);
+    free(s);
+}
+
+int rc_set_size(RcSet *s)
+{
+    return rc_index_size(s->index);
+}
+
+RcCompiled *rc_set_entry(RcSet *s, int id)
+{
+    return rc_index_entry(s->index, id);
+}
+
+int rc_set_covers(RcSet *s, int id, int up, const int **ids)
+{
+    SetNode *node;
+
+    if (!rc_set_entry(s, id))
+    {
+	*ids = 0;
+	return 0;
+    }
+
+    node = s->nodes + id;
+    *ids = up ? node->up : node->down;
+    return up ? node->nup : node->ndown;
+}
+
+int rc_set_add(RcContext *ctx, RcSet *s, RcCompiled *c, int *redundant,
+    int *n_redundant)
+{
+    SetNode *node;
+    UV h;
+    int n, k, i, j, e, head, tail, rv, id;
+
+    *n_redundant = 0;
+    n = rc_set_size(s);
+    if (grow(s, n + 1) < 0)
+    {
+	ctx->error = "Couldn't allocate memory for set";
+	return -1;
+    }
+
+    memset(s->mark, 0, n + 1);
+
+    /* entries greater than c - by transitivity, the set is closed
+       upwards; structurally equal entries (most likely greater) are
+       tried first */
+    h = rc_structural_hash(ctx, c);
+    for (i = s->buckets[h & (s->alloc - 1)]; i >= 0; i = s->nodes[i].next)
+    {
+	if ((s->nodes[i].hash == h) && !(s->mark[i] & IN_UP))
+	{
+	    rv = compare_entries(ctx, c, s->nodes[i].c);
+	    if (rv < 0)
+	    {
+		return rv;
+	    }
+
+	    if (rv)
+	    {
+		mark_reachable(s, i, 1, IN_UP, 0);
+	    }
+	}
+    }
+
+    k = rc_index_candidates(ctx, s->index, c, s->ids);
+    if (k < 0)
+    {
+	return k;
+    }
+
+    for (i = 0; i < k; ++i)
+    {
+	if (!(s->mark[s->ids[i]] & IN_UP))
+	{
+	    rv = compare_entries(ctx, c, rc_set_entry(s, s->ids[i]));
+	    if (rv < 0)
+	    {
+		return rv;
+	    }
+
+	    if (rv)
+	    {
+		mark_reachable(s, s->ids[i], 1, IN_UP, 0);
+	    }
+	}
+    }
+
+    /* entries less than c, visited from the top: everything below
+       an entry which is less is less as well (the converse doesn't
+       hold for comparisons which fail to decide, so entries which
+       aren't less don't exclude anything) */
+    head = tail = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (s->nodes[i].c)
+	{
+	    s->pending[i] = s->nodes[i].nup;
+	    if (!s->pending[i])
+	    {
+		s->ids[tail++] = i;
+	    }
+	}
+    }
+
+    while (head < tail)
+    {
+	e = s->ids[head++];
+	if (!(s->mark[e] & (IN_UP | IN_DOWN)))
+	{
+	    rv = compare_entries(ctx, s->nodes[e].c, c);
+	    if (rv < 0)
+	    {
+		return rv;
+	    }
+
+	    if (rv)
+	    {
+		mark_reachable(s, e, 0, IN_DOWN, IN_UP);
+	    }
+	}
+
+	node = s->nodes + e;
+	for (j = 0; j < node->ndown; ++j)
+	{
+	    if (!--(s->pending[node->down[j]]))
+	    {
+		s->ids[tail++] = node->down[j];
+	    }
+	}
+    }
+
+    id = rc_index_add(ctx, s->index, c);
+    if (id < 0)
+    {
+	return id;
+    }
+
+    s->nodes[id].c = c;
+    s->nodes[id].hash = h;
+    link_hash(s, id);
+
+    /* c goes between the greatest entries below it and the least
+       ones above it, replacing the edges between them */
+    for (i = 0; i < n; ++i)
+    {
+	node = s->nodes + i;
+	if (!node->c)
+	{
+	    continue;
+	}
+
+	if (s->mark[i] & IN_UP)
+	{
+	    if (!has_marked(node->down, node->ndown, s->mark, IN_UP) &&
+		(link_nodes(ctx, s, id, i) < 0))
+	    {
+		return -1;
+	    }
+	}
+	else if ((s->mark[i] & IN_DOWN) &&
+	    !has_marked(node->up, node->nup, s->mark, IN_DOWN))
+	{
+	    if (!node->nup)
+	    {
+		redundant[(*n_redundant)++] = i;
+	    }
+
+	    j = 0;
+	    while (j < node->nup)
+	    {
+		if (s->mark[node->up[j]] & IN_UP)
+		{
+		    unlink_nodes(s, i, node->up[j]);
+		}
+		else
+		{
+		    ++j;
+		}
+	    }
+
+	    if (link_nodes(ctx, s, i, id) < 0)
+	    {
+		return -1;
+	    }
+	}
+    }
+
+    if (s->nodes[id].nup)
+    {
+	redundant[(*n_redundant)++] = id;
+    }
+
+    return id;
+}
+
+int rc_set_remove(RcContext *ctx, RcSet *s, int id, int *released,
+    int *n_released)
+{
+    SetNode *x;
+    int i, j, d;
+
+    *n_released = 0;
+    if (!rc_set_entry(s, id))
+    {
+	ctx->error = "No such entry";
+	return -1;
+    }
+
+    x = s->nodes + id;
+    for (i = 0; i < x->ndown; ++i)
+    {
+	remove_id(s->nodes[x->down[i]].up, &(s->nodes[x->down[i]].nup), id);
+    }
+
+    for (i = 0; i < x->nup; ++i)
+    {
+	remove_id(s->nodes[x->up[i]].down, &(s->nodes[x->up[i]].ndown), id);
+    }
+
+    memset(s->mark, 0, rc_set_size(s));
+    for (i = 0; i < x->ndown; ++i)
+    {
+	d = x->down[i];
+
+	/* successors of x still above d by another path don't get an
+	   edge */
+	mark_reachable(s, d, 1, REACHED, 0);
+	for (j = 0; j < x->nup; ++j)
+	{
+	    if (!(s->mark[x->up[j]] & REACHED) &&
+		(link_nodes(ctx, s, d, x->up[j]) < 0))
+	    {
+		return -1;
+	    }
+	}
+
+	memset(s->mark, 0, rc_set_size(s));
+
+	if (!s->nodes[d].nup)
+	{
+	    released[(*n_released)++] = d;
+	}
+    }
+
+    qsort(released, *n_released, sizeof(int), compare_ids);
+
+    unlink_hash(s, id);
+    free(x->up);
+    free(x->down);
+    memset(x, 0, sizeof(SetNode));
+    rc_index_remove(s->index, id);
+    return 0;
+}
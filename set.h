@@ -0,0 +1,51 @@
+#ifndef set_h
+#define set_h
+
+#include "index.h"
+
+/* Compiled regexps with the Hasse diagram of their order, updated
+   on every change. The order is rc_compare_compiled, with ties
+   between equivalent regexps broken by id (the earlier one is
+   greater) and undecided comparisons counting as not less or
+   equal.
+   An entry is redundant when some other entry is greater. Like
+   RcIndex, the set doesn't own the entries; ids aren't reused. */
+typedef struct RcSet RcSet;
+
+/* returns null on failed memory allocation */
+RcSet *rc_set_new(void);
+
+void rc_set_free(RcSet *s);
+
+/* number of ids given out so far (including removed entries) */
+int rc_set_size(RcSet *s);
+
+/* null for ids which were removed (or never given out) */
+RcCompiled *rc_set_entry(RcSet *s, int id);
+
+/* Stores the ids of the immediate successors (up is true) or
+   predecessors of entry id into *ids (owned by the set, valid until
+   its next change); returns their number. */
+int rc_set_covers(RcSet *s, int id, int up, const int **ids);
+
+/* Adds c, comparing it with the entries which can be greater (those
+   with the same rc_structural_hash and the ones found by an RcIndex)
+   and then with the rest from the top, skipping those below an entry
+   already found to be less. Stores the ids of the entries which
+   became redundant (including the new one, if it is) into redundant,
+   which must have room for rc_set_size(s) + 1 elements, and their
+   count into *n_redundant. Returns the new id, -1 on error (with
+   ctx->error set); the set is unchanged when a comparison fails. */
+int rc_set_add(RcContext *ctx, RcSet *s, RcCompiled *c, int *redundant,
+    int *n_redundant);
+
+/* Removes entry id, connecting its predecessors to its successors
+   unless they're already ordered otherwise. Stores the ids of the
+   entries which stopped being redundant into released (which must
+   have room for rc_set_size(s) elements) and their count into
+   *n_released. Returns 0 on success, -1 on error (with ctx->error
+   set). */
+int rc_set_remove(RcContext *ctx, RcSet *s, int id, int *released,
+    int *n_released);
+
+#endif
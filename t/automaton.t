@@ -0,0 +1,28 @@
+use strict;
+
+use Regexp::Compare qw(is_less_or_equal is_less_or_equal_compiled);
+
+use Test::More tests => 13;
+
+ok(is_less_or_equal('(?:aa){1,}', 'a{2,}'), 'even repetition');
+ok(is_less_or_equal('a{2,}', '(?:aa){1,}'), 'unanchored repetition');
+ok(is_less_or_equal('(?:ab|cd)+x', '(?:ab|cd)x'), 'repeated alternation');
+ok(!is_less_or_equal('a(?s:.)b', 'a.b'), 'newline');
+ok(!is_less_or_equal('^(?:ab|cd)+$', '^(?:ab|cd)$'), 'anchored repetition');
+ok(!is_less_or_equal('\\d', '[0-9]'), 'digits beyond ASCII');
+ok(!is_less_or_equal('a$\\n', 'b'), 'newline after end of line');
+ok(!is_less_or_equal('a$\\n', '[bc]'), 'newline after end of line, class');
+
+ok(Regexp::Compare::stats()->{automaton} > 0, 'automaton counted');
+
+# the right automaton is kept by the compiled regexp
+my $c1 = Regexp::Compare::Compiled->new('(?:.a|a.){4}a.{6}');
+my $c2 = Regexp::Compare::Compiled->new('a.{6}');
+ok(is_less_or_equal_compiled($c1, $c2), 'kept automaton');
+ok(is_less_or_equal_compiled($c1, $c2), 'kept automaton reused');
+
+Regexp::Compare::set_dfa_cache_size(1);
+my $flushes = Regexp::Compare::stats()->{dfa_flushes};
+ok(!is_less_or_equal_compiled($c1,
+    Regexp::Compare::Compiled->new('a.{6}')), 'automaton over its cap');
+ok(Regexp::Compare::stats()->{dfa_flushes} > $flushes, 'flush counted');
@@ -0,0 +1,65 @@
+use strict;
+
+use File::Temp qw(tempdir);
+use Time::HiRes ();
+use Regexp::Compare qw(is_less_or_equal);
+
+use Test::More tests => 15;
+
+my $path = tempdir(CLEANUP => 1) . '/cmp.cache';
+
+Regexp::Compare::open_cache($path, { slots => 1024 });
+ok(-s $path, 'cache file created');
+
+my $before = Regexp::Compare::stats();
+is(is_less_or_equal('abc', 'b'), 1, 'computed');
+is(is_less_or_equal('abc', 'b'), 1, 'cached');
+is(is_less_or_equal('b', 'abc'), 0, 'reversed pair computed');
+
+my $after = Regexp::Compare::stats();
+is($after->{cache_hits} - $before->{cache_hits}, 1, 'hit counted');
+is($after->{comparisons} - $before->{comparisons}, 2, 'hit not compared');
+
+Regexp::Compare::close_cache();
+Regexp::Compare::open_cache($path, { read_only => 1 });
+$before = Regexp::Compare::stats();
+is(is_less_or_equal('b', 'abc'), 0, 'read from file');
+is(Regexp::Compare::stats()->{cache_hits} - $before->{cache_hits}, 1,
+   'file shared');
+Regexp::Compare::close_cache();
+
+# processes creating the same file at once agree on its size
+my $racy = "$path.racy";
+my $start = Time::HiRes::time() + 0.5;
+my @pids;
+for my $slots (1 .. 8)
+{
+    my $pid = fork();
+    last unless defined($pid);
+    if (!$pid)
+    {
+	1 while Time::HiRes::time() < $start;
+	Regexp::Compare::open_cache($racy, { slots => 1000 * $slots });
+	exit(0);
+    }
+
+    push @pids, $pid;
+}
+
+waitpid($_, 0) for @pids;
+ok(eval { Regexp::Compare::open_cache($racy, { read_only => 1 }); 1 },
+   'concurrently created file valid');
+Regexp::Compare::close_cache();
+
+Regexp::Compare::set_lru_size(2);
+$before = Regexp::Compare::stats();
+is(is_less_or_equal('a', 'a+'), 1, 'computed for LRU');
+is(is_less_or_equal('a', 'a+'), 1, 'LRU hit');
+is_less_or_equal('x', 'y');
+is_less_or_equal('y', 'x');
+is(is_less_or_equal('a', 'a+'), 1, 'evicted pair recomputed');
+$after = Regexp::Compare::stats();
+is($after->{lru_hits} - $before->{lru_hits}, 1, 'LRU hit counted');
+is($after->{comparisons} - $before->{comparisons}, 4, 'LRU hit not compared');
+ok($after->{lru_hit_rate} > 0 && $after->{lru_hit_rate} < 1, 'hit rate');
+Regexp::Compare::set_lru_size(0);
@@ -0,0 +1,77 @@
+use strict;
+
+use Regexp::Compare qw(is_less_or_equal is_less_or_equal_compiled);
+
+our @pairs;
+
+BEGIN {
+    @pairs = ( 'a' => 'a|b', 'a|b' => 'a', 'abc' => 'bc', 'ab+c' => 'abc',
+	       'a{2}' => 'aa', '\\d' => '\\w', '\\w' => '\\d' );
+}
+
+use Test::More tests => (scalar(@pairs) / 2) + 12;
+
+my %compiled = map { $_ => Regexp::Compare::Compiled->new($_) } @pairs;
+
+my $i = 0;
+while ($i < scalar(@pairs)) {
+    my ($l, $r) = @pairs[$i, $i + 1];
+    is(!!is_less_or_equal_compiled($compiled{$l}, $compiled{$r}),
+       !!is_less_or_equal($l, $r), "/$l/ vs. /$r/");
+    $i += 2;
+}
+
+my $c = Regexp::Compare::Compiled->new('x');
+ok(is_less_or_equal_compiled($c, $c), 'same handle');
+
+eval { Regexp::Compare::Compiled->new('[a'); };
+ok($@, 'invalid regexp dies');
+
+eval { is_less_or_equal_compiled('a', $c); };
+ok($@, 'string instead of handle dies');
+
+isa_ok($c, 'Regexp::Compare::Compiled');
+
+is(Regexp::Compare::Compiled->new('a{1,}')->structural_hash,
+   Regexp::Compare::Compiled->new('(?:a)+')->structural_hash,
+   'equal structure');
+isnt(Regexp::Compare::Compiled->new('a{2,3}')->structural_hash,
+     Regexp::Compare::Compiled->new('a{2,4}')->structural_hash,
+     'different structure');
+
+my $before = Regexp::Compare::stats()->{prefiltered};
+ok(!is_less_or_equal_compiled(Regexp::Compare::Compiled->new('abc'),
+			      Regexp::Compare::Compiled->new('^xyz')),
+   'prefiltered pair');
+is(Regexp::Compare::stats()->{prefiltered}, $before + 1, 'prefilter counted');
+
+my ($left, $right) = map { Regexp::Compare::Compiled->new($_) }
+    '[\\da]x', '[a\\d]x';
+ok(is_less_or_equal_compiled($left, $right), 'class pair');
+$before = Regexp::Compare::stats()->{class_hits};
+is_less_or_equal_compiled($left, $right);
+cmp_ok(Regexp::Compare::stats()->{class_hits}, '>', $before,
+       'class pair cached');
+
+# the prefilter only rejects pairs the comparison wouldn't accept
+my @fixtures = ( 'a', 'b', 'a|b', 'b|a', 'ab|cd', '[ab]', 'abc', 'bc',
+		 '^abc', 'abc$', '^a$', 'a+', 'a*', 'a{2,3}', 'a+b|c',
+		 '(?:a|b)c', 'x(?:a|b)', '\\d+', 'q\\d+|x', '\\w', '.',
+		 '^\\d{3}$', 'foo(?:bar|qux\\d+)|x1',
+		 'foobar|fooqux\\d+|x1' );
+my %fixture = map { $_ => Regexp::Compare::Compiled->new($_) } @fixtures;
+my @contradicted;
+$before = Regexp::Compare::stats()->{prefiltered};
+for my $l (@fixtures) {
+    for my $r (@fixtures) {
+	my $expected = !!is_less_or_equal($l, $r);
+	if (!!is_less_or_equal_compiled($fixture{$l}, $fixture{$r}) ne
+	    $expected) {
+	    push @contradicted, "/$l/ vs. /$r/";
+	}
+    }
+}
+
+is_deeply(\@contradicted, [], 'prefilter agrees with the comparison');
+cmp_ok(Regexp::Compare::stats()->{prefiltered}, '>', $before,
+       'fixtures prefiltered');
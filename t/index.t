@@ -0,0 +1,24 @@
+use strict;
+
+use Regexp::Compare;
+
+use Test::More tests => 10;
+
+my $ix = Regexp::Compare::Index->new;
+my @rx = ( 'foo', 'bar\d+', 'x*', 'ba', 'o{2}', 'qux' );
+is_deeply([ map { $ix->add($_) } @rx ], [ 0 .. $#rx ], 'ids assigned');
+is($ix->size, scalar(@rx), 'size');
+
+my @cand = $ix->candidates('xfoobar1');
+ok(!grep({ $_ == 5 } @cand), 'missing literal excluded');
+ok(grep({ $_ == 2 } @cand), 'entry without literal included');
+is_deeply([ $ix->supersets('xfoobar1') ], [ 0, 1, 2, 3, 4 ],
+	  'supersets found');
+is_deeply([ $ix->supersets('quux') ], [ 2 ], 'only unkeyed superset');
+
+my $c = Regexp::Compare::Compiled->new('bar');
+is($ix->add($c), scalar(@rx), 'compiled entry added');
+is($ix->entry(scalar(@rx)), $c, 'entry returned');
+ok(!defined($ix->entry(-1)), 'no entry for a negative id');
+is_deeply([ $ix->supersets('abarc', { max_steps => 1000 }) ], [ 2, 3, 6 ],
+	  'compiled entry compared');
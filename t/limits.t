@@ -0,0 +1,37 @@
+use strict;
+
+use Regexp::Compare qw(is_less_or_equal is_less_or_equal_compiled);
+
+use Test::More tests => 14;
+
+# skipped nodes don't nest
+ok(is_less_or_equal('\\d' x 20000 . 'b', 'b'), 'long regexp');
+
+ok(is_less_or_equal('ab', 'ab', { max_depth => 10 }), 'under max_depth');
+ok(!defined(is_less_or_equal('ab|cd', 'ab|cd', { max_depth => 1 })),
+   'over max_depth');
+ok(!defined(is_less_or_equal_compiled(Regexp::Compare::Compiled->new('ab|cd'),
+    Regexp::Compare::Compiled->new('ab|cd'), { max_depth => 1 })),
+   'over max_depth (compiled)');
+
+# neither tails nor repeats nest
+ok(is_less_or_equal('a\\d' x 5000, 'a\\d' x 5000), 'long regexp vs. itself');
+ok(is_less_or_equal('\\d' x 500, '\\w{400,30000}', { max_depth => 20 }),
+   'counted repeat under max_depth');
+ok(is_less_or_equal('\\d' x 30000, '\\w{20000,30000}'), 'long counted repeat');
+
+ok(is_less_or_equal('ab', 'ab'), 'limit reset');
+
+eval { is_less_or_equal('a', 'a', [ 1 ]); };
+like($@, qr/options must be a hash reference/, 'invalid options');
+
+ok(is_less_or_equal('ab', 'ab', { max_steps => 100 }), 'under max_steps');
+ok(!defined(is_less_or_equal('ab', 'ab', { max_steps => 1 })),
+   'over max_steps');
+ok(is_less_or_equal('ab', 'ab', { deadline_ms => 10000 }),
+   'before deadline');
+ok(!defined(is_less_or_equal('(?:.a|a.){4}a.{6}', 'a.{6}',
+    { max_steps => 10 })), 'over max_steps in automaton');
+
+is(join(',', Regexp::Compare::minimize_blacklist([ 'ab', 'b' ], undef,
+    { max_steps => 1 })), 'ab,b', 'undecided pairs kept');
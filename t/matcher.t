@@ -0,0 +1,19 @@
+use strict;
+
+use Regexp::Compare;
+
+use Test::More tests => 7;
+
+my @rx = ( 'abc', 'b', 'xyz', 'ab', 'q\d+', 'q1' );
+my $m = Regexp::Compare::Matcher->new(\@rx);
+
+ok($m->match('xxabcx'), 'match');
+ok(!$m->match('nothing'), 'no match');
+is($m->executions, 1 + 3, 'only maximal regexps tried');
+
+is_deeply([ $m->matching('xxabcx') ], [ 0, 1, 3 ], 'all matches found');
+is_deeply([ $m->matching('q123') ], [ 4, 5 ], 'chain followed');
+
+my $before = $m->executions;
+is_deeply([ $m->matching('zzz') ], [], 'nothing matching');
+is($m->executions - $before, 3, 'regexps below failures skipped');
@@ -0,0 +1,42 @@
+use strict;
+
+use Regexp::Compare qw(is_less_or_equal subsumption_matrix);
+
+our @rx;
+
+BEGIN {
+    @rx = ( 'a', 'a|b', '[ab]', 'abc', 'b', '\\d' );
+}
+
+use Test::More tests => scalar(@rx) * scalar(@rx) + 6;
+
+my $m = subsumption_matrix(\@rx);
+is(length($m), int((@rx * @rx + 7) / 8), 'matrix size');
+
+for my $i (0 .. $#rx) {
+    for my $j (0 .. $#rx) {
+	my $expected = ($i == $j) ? 0 : !!is_less_or_equal($rx[$i], $rx[$j]);
+	is(!!vec($m, $i * @rx + $j, 1), !!$expected,
+	   '/' . $rx[$i] . '/ vs. /' . $rx[$j] . '/');
+    }
+}
+
+is(subsumption_matrix(\@rx, threads => 4), $m, 'threads');
+is(subsumption_matrix(\@rx, { threads => 64 }), $m, 'more threads than pairs');
+
+# counters of the worker threads go to the caller's
+my @slow = map { ("(?:$_$_){1,}", "$_\{2,}") } 'a' .. 'p';
+my %delta;
+for my $threads (1, 4) {
+    my $before = Regexp::Compare::stats()->{automaton};
+    subsumption_matrix(\@slow, threads => $threads);
+    $delta{$threads} = Regexp::Compare::stats()->{automaton} - $before;
+}
+is($delta{4}, $delta{1}, 'statistics of threads');
+
+my @mixed = ( Regexp::Compare::Compiled->new('a'), 'a|b' );
+my $mm = subsumption_matrix(\@mixed);
+ok(vec($mm, 1, 1) && !vec($mm, 2, 1), 'compiled and string elements');
+
+eval { subsumption_matrix([ 'a', '[a' ]); };
+ok($@, 'invalid regexp dies');
@@ -0,0 +1,19 @@
+use strict;
+
+use Regexp::Compare qw(merge_blacklist);
+
+use Test::More tests => 8;
+
+my %stats;
+my $m = merge_blacklist([ 'foobar', 'foobaz', 'fooqux\d+', 'x1|y1' ],
+			\%stats);
+is($m, 'foo(?:ba(?:r|z)|qux(?:\d+))|(?:x1|y1)', 'common prefixes factored');
+is($stats{verified}, 1, 'merged regexp verified');
+
+for my $s ('afoobaz', 'fooqux1', 'x1', 'y1') {
+    like($s, qr/$m/, "$s matched");
+}
+
+unlike('fooquxfoobax', qr/$m/, 'rest kept');
+
+is(merge_blacklist([]), '(?!)', 'empty list matches nothing');
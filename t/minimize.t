@@ -0,0 +1,26 @@
+use strict;
+
+use Regexp::Compare qw(minimize_blacklist);
+
+use Test::More tests => 8;
+
+my %stats;
+my @rx = ( 'abc', 'a', 'xyz', 'bc', 'ab', 'c', 'a' );
+is_deeply([ minimize_blacklist(\@rx, \%stats) ], [ 'a', 'xyz', 'c' ],
+	  'redundant regexps removed');
+ok($stats{comparisons} > 0, 'comparisons counted');
+is($stats{comparisons} + $stats{saved}, @rx * (@rx - 1), 'savings reported');
+is($stats{duplicates}, 1, 'duplicate found by hash');
+
+is_deeply([ minimize_blacklist([ 'x', 'y' ]) ], [ 'x', 'y' ],
+	  'incomparable regexps kept');
+
+is_deeply([ minimize_blacklist([]) ], [], 'empty list');
+
+my $c = Regexp::Compare::Compiled->new('a+');
+my @min = minimize_blacklist([ 'aa', $c ]);
+is_deeply(\@min, [ $c ], 'compiled elements returned');
+
+my %dup;
+is_deeply([ minimize_blacklist([ 'b{1,}', 'b+', '(?:b)+', 'x' ], \%dup) ],
+	  [ 'b{1,}', 'x' ], 'equal programs removed');
@@ -0,0 +1,33 @@
+use strict;
+
+use Regexp::Compare;
+
+use Test::More tests => 14;
+
+my $set = Regexp::Compare::Set->new;
+my ($id, $red);
+
+($id, $red) = $set->add('abc');
+is($id, 0, 'first id');
+is_deeply($red, [], 'nothing redundant');
+
+$set->add('xyz');
+($id, $red) = $set->add('b');
+is_deeply($red, [ 0 ], 'smaller element became redundant');
+is_deeply([ $set->maximal ], [ 1, 2 ], 'maximal elements');
+
+($id, $red) = $set->add('ab');
+is_deeply($red, [ 3 ], 'new element redundant');
+is_deeply([ $set->upper(0) ], [ 3 ], 'inserted between');
+is_deeply([ $set->lower(2) ], [ 3 ], 'lower covers');
+
+($id, $red) = $set->add('(?:b)');
+is_deeply($red, [ 4 ], 'equivalent element redundant');
+
+is_deeply([ $set->upper(3) ], [ 4 ], 'equivalent element inserted');
+is_deeply($set->remove(2), [ 4 ], 'equivalent element released');
+
+is_deeply($set->remove(4), [ 3 ], 'element released');
+is_deeply([ $set->ids ], [ 0, 1, 3 ], 'remaining ids');
+isa_ok($set->entry(3), 'Regexp::Compare::Compiled', 'entry');
+ok(!defined($set->entry(-1)), 'no entry for a negative id');